@@ -0,0 +1,47 @@
+// Included by the shaders that read the scene geometry, not compiled on its own
+
+// Octahedral normal in [-1, 1]^2, see oct_encode in geometry_codec.h
+vec3 oct_decode(vec2 p)
+{
+    vec3 n = vec3(p, 1.0 - abs(p.x) - abs(p.y));
+    float t = max(-n.z, 0.0);
+    n.xy += mix(vec2(t), vec2(-t), greaterThanEqual(n.xy, vec2(0.0)));
+    return n;
+}
+
+// The merged scene buffers of the RT descriptor set, trace.rchit and trace.comp
+#ifdef SCENE_GEOMETRY
+// One per TLAS instance, see instance_data_t
+struct instance_t
+{
+    uint first_index;   // in units of the index type
+    int vertex_offset;
+    uint index_type;    // 0: 32-bit, 1: 16-bit
+    uint pad0;
+    vec3 normal_scale;  // transpose of the dequantization
+    uint pad1;
+};
+
+// Merged scene geometry, the instance record locates the mesh in it
+layout (binding = 4, set = 0) readonly buffer indices_t { uint indices[]; };
+layout (binding = 5, set = 0) readonly buffer normals_t { uint normals[]; };
+layout (binding = 6, set = 0) readonly buffer instances_t { instance_t instances[]; };
+// Compressed geometry: one octahedral R16G16 snorm normal per vertex, otherwise vertex_t
+layout (constant_id = 0) const bool oct_normals = false;
+
+uint fetch_index(instance_t inst, uint i)
+{
+    uint k = inst.first_index + i;
+    if (inst.index_type == 0)
+        return indices[k];
+    return (indices[k >> 1] >> ((k & 1) * 16)) & 0xFFFF;
+}
+
+vec3 fetch_normal(instance_t inst, uint i)
+{
+    uint v = uint(inst.vertex_offset) + fetch_index(inst, i);
+    if (oct_normals)
+        return oct_decode(unpackSnorm2x16(normals[v]));
+    return uintBitsToFloat(uvec3(normals[v * 6 + 3], normals[v * 6 + 4], normals[v * 6 + 5]));
+}
+#endif
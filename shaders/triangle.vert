@@ -1,20 +1,37 @@
 #version 450
+#extension GL_GOOGLE_include_directive : enable
 
-layout (binding = 0) uniform ubo_t { 
+#include "common.glsl"
+
+struct instance_t
+{
     mat4 model;
-    mat4 view;
-    mat4 proj; 
-} ubo;
+    mat4 dequant;   // quantized position to mesh space, identity for float positions
+    vec4 col;
+};
+
+// One per draw, indexed by the first instance: written by the CPU, or by cull.comp in GPU-driven mode
+layout (binding = 0) readonly buffer instances_t { instance_t instances[]; };
+layout (push_constant) uniform camera_t {
+    mat4 view_proj;
+} camera;
+// Compressed geometry: v_nor.xy is an octahedral normal (z reads as 0)
+layout (constant_id = 0) const bool oct_normals = false;
 
 layout (location = 0) in vec3 v_pos;
 layout (location = 1) in vec3 v_nor;
 
 layout (location = 0) out vec3 f_nor;
 layout (location = 1) out vec3 f_pos;
+layout (location = 2) flat out vec4 f_col;
 
 void main()
 {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(v_pos, 1);
-    f_pos = vec3(ubo.model * vec4(v_pos, 1));
-    f_nor = normalize(v_nor);
+    instance_t inst = instances[gl_InstanceIndex];
+    vec4 pos = inst.model * inst.dequant * vec4(v_pos, 1);
+    gl_Position = camera.view_proj * pos;
+    f_pos = pos.xyz;
+    vec3 nor = oct_normals ? oct_decode(v_nor.xy) : v_nor;
+    f_nor = normalize(transpose(inverse(mat3(inst.model))) * nor);
+    f_col = inst.col;
 }
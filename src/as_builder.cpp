@@ -0,0 +1,144 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "gpu_profiler.h"
+#include "as_builder.h"
+
+void blas_builder_t::add(vk::AccelerationStructureKHR blas, const vk::AccelerationStructureGeometryKHR& geo,
+    const vk::AccelerationStructureBuildOffsetInfoKHR& offset, vk::BuildAccelerationStructureFlagsKHR flags,
+    vk::DeviceSize scratch_size)
+{
+    build_t& b = builds.emplace_back();
+    b.blas = blas;
+    b.geo = geo;
+    b.offset = offset;
+    b.flags = flags;
+    b.scratch_size = (scratch_size + alignment - 1) & ~(alignment - 1);
+}
+
+vk::DeviceSize blas_builder_t::plan()
+{
+    vk::DeviceSize offset = 0;
+    batch_count = builds.empty() ? 0 : 1;
+    high_water = 0;
+    for (auto& b : builds)
+    {
+        // A build bigger than the whole budget still gets a batch on its own
+        if (offset > 0 && offset + b.scratch_size > budget)
+        {
+            batch_count++;
+            offset = 0;
+        }
+        b.batch = batch_count - 1;
+        b.scratch_offset = offset;
+        offset += b.scratch_size;
+        high_water = std::max(high_water, offset);
+    }
+    return high_water;
+}
+
+blas_build_stats_t blas_builder_t::build(const vk::UniqueDevice& device, vk::Queue queue, vk::CommandPool cmdpool,
+    vk::DeviceAddress scratch_addr, float timestamp_period, gpu_profiler_t* profiler)
+{
+    blas_build_stats_t stats;
+    stats.count = (uint32_t)builds.size();
+    stats.batches = batch_count;
+    stats.scratch_high_water = high_water;
+    if (builds.empty())
+        return stats;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    vk::UniqueQueryPool timestamp_pool;
+    if (timestamp_period > 0.f)
+        timestamp_pool = device->createQueryPoolUnique({ {}, vk::QueryType::eTimestamp, 2 });
+
+    vk::UniqueCommandBuffer cmd = std::move(
+        device->allocateCommandBuffersUnique({ cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+    debug_name(cmd, "BLAS Build Command");
+    cmd->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+    if (timestamp_pool)
+    {
+        cmd->resetQueryPool(*timestamp_pool, 0, 2);
+        cmd->writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *timestamp_pool, 0);
+    }
+    if (!acquire_barriers.empty())
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+            vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, nullptr, acquire_barriers, nullptr);
+    uint32_t profiler_slot = profiler ? profiler->setup_slot() : 0;
+    if (profiler)
+        profiler->begin_frame(cmd, profiler_slot);
+    debug_mark_begin(cmd, "Build BLAS");
+    uint32_t build_scope = profiler ? profiler->begin(cmd, profiler_slot, "Build BLAS") : UINT32_MAX;
+
+    std::vector<const vk::AccelerationStructureGeometryKHR*> geo_ptrs(builds.size());
+    std::vector<vk::AccelerationStructureBuildGeometryInfoKHR> infos;
+    std::vector<const vk::AccelerationStructureBuildOffsetInfoKHR*> offset_ptrs;
+    // Scratch is reused by the next batch, so its builds must wait for the previous ones
+    vk::MemoryBarrier barrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+        vk::AccessFlagBits::eAccelerationStructureReadKHR | vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+    size_t first = 0;
+    for (uint32_t batch = 0; batch < batch_count; batch++)
+    {
+        infos.clear();
+        offset_ptrs.clear();
+        size_t last = first;
+        for (; last < builds.size() && builds[last].batch == batch; last++)
+        {
+            build_t& b = builds[last];
+            geo_ptrs[last] = &b.geo;
+            auto& info = infos.emplace_back();
+            info.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
+            info.flags = b.flags;
+            info.update = false;
+            info.dstAccelerationStructure = b.blas;
+            info.geometryArrayOfPointers = false;
+            info.geometryCount = 1;
+            info.ppGeometries = &geo_ptrs[last];
+            info.scratchData.deviceAddress = scratch_addr + b.scratch_offset;
+            offset_ptrs.push_back(&b.offset);
+        }
+
+        {
+            gpu_scope_t scope(cmd, profiler, profiler_slot, fmt::format("BLAS Batch#{} ({} meshes)", batch, last - first));
+            cmd->buildAccelerationStructureKHR(infos, offset_ptrs);
+        }
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+            vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+            vk::DependencyFlags(), { barrier }, {}, {});
+        first = last;
+    }
+
+    if (profiler)
+        profiler->end(cmd, profiler_slot, build_scope);
+    debug_mark_end(cmd);
+    if (timestamp_pool)
+        cmd->writeTimestamp(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, *timestamp_pool, 1);
+    cmd->end();
+
+    vk::UniqueFence fence = device->createFenceUnique({});
+    vk::SubmitInfo submit_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &cmd.get();
+    vk::PipelineStageFlags wait_stage = vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR;
+    if (wait_semaphore)
+    {
+        submit_info.waitSemaphoreCount = 1;
+        submit_info.pWaitSemaphores = &wait_semaphore;
+        submit_info.pWaitDstStageMask = &wait_stage;
+    }
+    queue.submit(submit_info, *fence);
+    device->waitForFences(*fence, true, UINT64_MAX);
+
+    stats.cpu_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    if (profiler)
+        profiler->resolve(profiler_slot);
+    if (timestamp_pool)
+    {
+        std::array<uint64_t, 2> timestamps{};
+        if (device->getQueryPoolResults(*timestamp_pool, 0, 2, sizeof(timestamps), timestamps.data(),
+            sizeof(uint64_t), vk::QueryResultFlagBits::e64) == vk::Result::eSuccess)
+            stats.gpu_ms = (timestamps[1] - timestamps[0]) * timestamp_period / 1e6;
+    }
+    return stats;
+}
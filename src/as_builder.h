@@ -0,0 +1,57 @@
+#pragma once
+#include <vector>
+
+class gpu_profiler_t;
+
+struct blas_build_stats_t
+{
+    uint32_t count = 0;
+    uint32_t batches = 0;
+    double cpu_ms = 0.0;
+    double gpu_ms = 0.0;
+    vk::DeviceSize scratch_high_water = 0;
+};
+
+// Records all the BLAS builds into a single command buffer and submission.
+// Every build gets its own range of the scratch buffer so that the driver can run them
+// concurrently, when the ranges would exceed the budget the builds are split in batches
+// separated by a barrier and the next batch reuses the scratch memory from the start.
+class blas_builder_t
+{
+    struct build_t
+    {
+        vk::AccelerationStructureKHR blas;
+        vk::AccelerationStructureGeometryKHR geo;
+        vk::AccelerationStructureBuildOffsetInfoKHR offset;
+        vk::BuildAccelerationStructureFlagsKHR flags;
+        vk::DeviceSize scratch_size = 0;
+        vk::DeviceSize scratch_offset = 0;
+        uint32_t batch = 0;
+    };
+    std::vector<build_t> builds;
+    vk::DeviceSize budget = 0;
+    vk::DeviceSize alignment = 0;
+    vk::DeviceSize high_water = 0;
+    uint32_t batch_count = 0;
+    vk::Semaphore wait_semaphore;
+    std::vector<vk::BufferMemoryBarrier> acquire_barriers;
+public:
+    blas_builder_t(vk::DeviceSize scratch_budget, vk::DeviceSize scratch_alignment = 256)
+        : budget(scratch_budget), alignment(scratch_alignment) {}
+    void add(vk::AccelerationStructureKHR blas, const vk::AccelerationStructureGeometryKHR& geo,
+        const vk::AccelerationStructureBuildOffsetInfoKHR& offset, vk::BuildAccelerationStructureFlagsKHR flags,
+        vk::DeviceSize scratch_size);
+    // Assign the scratch ranges, returns the size of the scratch buffer to pass to build()
+    vk::DeviceSize plan();
+    // Make the builds wait on the GPU for the producer of the geometry (the upload queue) and
+    // acquire the ownership of its buffers, instead of a CPU wait between the two
+    void wait_for(vk::Semaphore semaphore, std::vector<vk::BufferMemoryBarrier> acquire)
+    {
+        wait_semaphore = semaphore;
+        acquire_barriers = std::move(acquire);
+    }
+    // Record, submit and wait for the builds, timestamp_period = 0 disables the GPU timing.
+    // The batches are also reported as scopes in the setup slot of the profiler when given.
+    blas_build_stats_t build(const vk::UniqueDevice& device, vk::Queue queue, vk::CommandPool cmdpool,
+        vk::DeviceAddress scratch_addr, float timestamp_period, gpu_profiler_t* profiler = nullptr);
+};
@@ -0,0 +1,65 @@
+#include "pch.h"
+#include "benchmark.h"
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    size_t n = (size_t)std::ceil(p * values.size()) - 1;
+    n = std::min(n, values.size() - 1);
+    std::nth_element(values.begin(), values.begin() + n, values.end());
+    return values[n];
+}
+
+void benchmark_t::add_frame(double cpu_time_ms, double gpu_time_ms, uint64_t primary_ray_count, uint64_t shadow_ray_count)
+{
+    if (skip > 0)
+    {
+        skip--;
+        return;
+    }
+    cpu_ms.push_back(cpu_time_ms);
+    if (gpu_times)
+        gpu_ms.push_back(gpu_time_ms);
+    primary_rays += primary_ray_count;
+    shadow_rays += shadow_ray_count;
+}
+
+void benchmark_t::add_latency(const std::string& present_mode, double latency_time_ms)
+{
+    if (skip > 0)
+        return;
+    latency_ms[present_mode].push_back(latency_time_ms);
+}
+
+void benchmark_t::report() const
+{
+    if (cpu_ms.empty())
+        return;
+    uint64_t frames = cpu_ms.size();
+    uint64_t primary_rays_per_frame = primary_rays / frames;
+    uint64_t shadow_rays_per_frame = shadow_rays / frames;
+    uint64_t rays_per_frame = primary_rays_per_frame + shadow_rays_per_frame;
+    double gpu_total_ms = std::accumulate(gpu_ms.begin(), gpu_ms.end(), 0.0);
+    double rays_per_sec = gpu_total_ms > 0.0 ? (double)(primary_rays + shadow_rays) / (gpu_total_ms / 1000.0) : 0.0;
+    std::cout << fmt::format("Benchmark: {} frames\n", cpu_ms.size());
+    std::cout << fmt::format("  CPU frame ms  p50 {:8.3f}  p95 {:8.3f}  p99 {:8.3f}\n",
+        percentile(cpu_ms, 0.50), percentile(cpu_ms, 0.95), percentile(cpu_ms, 0.99));
+    std::string rays = fmt::format("{} rays/frame: {} primary, {} shadow", rays_per_frame, primary_rays_per_frame,
+        shadow_rays_per_frame);
+    if (gpu_times)
+    {
+        std::cout << fmt::format("  GPU frame ms  p50 {:8.3f}  p95 {:8.3f}  p99 {:8.3f}\n",
+            percentile(gpu_ms, 0.50), percentile(gpu_ms, 0.95), percentile(gpu_ms, 0.99));
+        std::cout << fmt::format("  {:.2f} Mrays/s ({})\n", rays_per_sec / 1e6, rays);
+    }
+    else
+    {
+        std::cout << "  GPU frame ms  unavailable, the device has no timestamps\n";
+        std::cout << fmt::format("  Mrays/s unavailable ({})\n", rays);
+    }
+    for (const auto& [mode, values] : latency_ms)
+        std::cout << fmt::format("  Latency {:<10} p50 {:8.3f}  p95 {:8.3f}  p99 {:8.3f}  ({} frames)\n", mode,
+            percentile(values, 0.50), percentile(values, 0.95), percentile(values, 0.99), values.size());
+    std::cout << std::flush;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+
+// Collects per-frame CPU/GPU times and reports percentiles at the end of the run
+class benchmark_t
+{
+    std::vector<double> cpu_ms;
+    std::vector<double> gpu_ms;
+    uint64_t primary_rays = 0;          // launched by the measured frames
+    uint64_t shadow_rays = 0;
+    std::map<std::string, std::vector<double>> latency_ms;     // per present mode
+    uint32_t skip = 0;
+    bool gpu_times = true;
+public:
+    // Without timestamps the GPU times of the frames are not measured and not reported
+    benchmark_t(uint32_t warmup_frames, bool gpu_times) : skip(warmup_frames), gpu_times(gpu_times) {}
+    // The warmup frames are skipped for the times and for the rays alike
+    void add_frame(double cpu_time_ms, double gpu_time_ms, uint64_t primary_ray_count, uint64_t shadow_ray_count);
+    // Time from sampling the frame input to the completion of its presented image
+    void add_latency(const std::string& present_mode, double latency_time_ms);
+    // The throughput counts both kinds of rays over the GPU time of the same frames
+    void report() const;
+};
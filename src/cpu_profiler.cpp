@@ -0,0 +1,133 @@
+#include "pch.h"
+#include "cpu_profiler.h"
+
+#if CPU_PROFILER
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace
+{
+    struct event_t
+    {
+        const char* name;
+        uint64_t start;     // ns since the profiler epoch
+        uint64_t end;
+        uint32_t depth;
+    };
+    struct thread_events_t
+    {
+        uint32_t tid = 0;
+        std::string name;
+        std::vector<event_t> events;
+        uint32_t depth = 0;
+        uint64_t dropped = 0;
+    };
+
+    // Cap per thread, the frame loop would otherwise grow the buffers without bound
+    constexpr size_t max_events = 1 << 20;
+
+    std::mutex registry_mutex;
+    std::vector<std::unique_ptr<thread_events_t>> registry;
+    const auto epoch = std::chrono::steady_clock::now();
+
+    thread_events_t& local_events()
+    {
+        thread_local thread_events_t* events = nullptr;
+        if (!events)
+        {
+            std::lock_guard lock(registry_mutex);
+            auto& e = registry.emplace_back(std::make_unique<thread_events_t>());
+            e->tid = (uint32_t)registry.size() - 1;
+            e->name = fmt::format("Thread#{}", e->tid);
+            e->events.reserve(4096);
+            events = e.get();
+        }
+        return *events;
+    }
+
+    uint64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+}
+
+void cpu_zone_t::begin(const char* zone_name)
+{
+    name = zone_name;
+    open = true;
+    local_events().depth++;
+    start = now_ns();
+}
+
+void cpu_zone_t::end()
+{
+    if (!open)
+        return;
+    uint64_t stop = now_ns();
+    open = false;
+    thread_events_t& t = local_events();
+    t.depth--;
+    if (t.events.size() < max_events)
+        t.events.push_back({ name, start, stop, t.depth });
+    else
+        t.dropped++;
+}
+
+void cpu_profiler_thread_name(const char* name)
+{
+    local_events().name = name;
+}
+
+void cpu_profiler_report()
+{
+    struct total_t
+    {
+        uint64_t count = 0;
+        uint64_t ns = 0;
+    };
+    std::map<std::string, total_t> totals;
+    uint64_t dropped = 0;
+    {
+        std::lock_guard lock(registry_mutex);
+        for (const auto& t : registry)
+        {
+            for (const auto& e : t->events)
+            {
+                total_t& total = totals[e.name];
+                total.count++;
+                total.ns += e.end - e.start;
+            }
+            dropped += t->dropped;
+        }
+    }
+    std::vector<std::pair<std::string, total_t>> sorted(totals.begin(), totals.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.ns > b.second.ns; });
+    std::cout << "CPU zones:\n";
+    for (const auto& [name, total] : sorted)
+        std::cout << fmt::format("  {:<32} total {:10.3f} ms  avg {:8.3f} ms  count {}\n",
+            name, total.ns / 1e6, total.ns / 1e6 / total.count, total.count);
+    if (dropped)
+        std::cout << fmt::format("  {} zones dropped, buffer full\n", dropped);
+}
+
+std::string cpu_profiler_trace_events()
+{
+    std::string out;
+    std::lock_guard lock(registry_mutex);
+    for (const auto& t : registry)
+    {
+        if (!out.empty())
+            out += ",\n";
+        out += fmt::format("{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":\"{}\"}}}}",
+            t->tid, t->name);
+        for (const auto& e : t->events)
+            out += fmt::format(",\n{{\"name\":\"{}\",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f},"
+                "\"args\":{{\"depth\":{}}}}}", e.name, t->tid, e.start / 1e3, (e.end - e.start) / 1e3, e.depth);
+    }
+    if (!out.empty())
+        out = "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"CPU\"}},\n" + out;
+    return out;
+}
+
+#endif
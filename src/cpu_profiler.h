@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+
+// Scoped CPU zones. Every thread appends to its own event buffer, registered once under a lock,
+// so recording a zone is two clock reads and a push_back. The buffers are read only by the
+// report and the trace export, when the other threads are idle.
+// Build with CPU_PROFILER=0 to compile the zones out entirely.
+#ifndef CPU_PROFILER
+#define CPU_PROFILER 1
+#endif
+
+#if CPU_PROFILER
+
+class cpu_zone_t
+{
+    const char* name;       // must outlive the profiler, string literals only
+    uint64_t start = 0;
+    bool open = false;
+public:
+    explicit cpu_zone_t(const char* name) { begin(name); }
+    cpu_zone_t(const cpu_zone_t&) = delete;
+    ~cpu_zone_t() { end(); }
+    void begin(const char* zone_name);
+    void end();
+    // Close the zone and open a sibling, for the sequential phases of a long function
+    void next(const char* zone_name) { end(); begin(zone_name); }
+};
+
+// Thread name shown in the trace, otherwise "Thread#N"
+void cpu_profiler_thread_name(const char* name);
+// Per-zone count, total and average, sorted by total time
+void cpu_profiler_report();
+// Comma separated trace_event objects, without the enclosing array
+std::string cpu_profiler_trace_events();
+
+#define CPU_ZONE_CONCAT_(a, b) a##b
+#define CPU_ZONE_CONCAT(a, b) CPU_ZONE_CONCAT_(a, b)
+#define CPU_ZONE(name) cpu_zone_t CPU_ZONE_CONCAT(cpu_zone_, __LINE__)(name)
+#define CPU_ZONE_NAMED(var, name) cpu_zone_t var(name)
+#define CPU_ZONE_NEXT(var, name) var.next(name)
+#define CPU_ZONE_END(var) var.end()
+
+#else
+
+inline void cpu_profiler_thread_name(const char*) {}
+inline void cpu_profiler_report() {}
+inline std::string cpu_profiler_trace_events() { return {}; }
+
+#define CPU_ZONE(name) ((void)0)
+#define CPU_ZONE_NAMED(var, name) ((void)0)
+#define CPU_ZONE_NEXT(var, name) ((void)0)
+#define CPU_ZONE_END(var) ((void)0)
+
+#endif
@@ -0,0 +1,624 @@
+#include "pch.h"
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include "cpu_profiler.h"
+#include "cpu_tracer.h"
+
+static constexpr uint32_t no_hit = UINT32_MAX;
+static constexpr uint32_t bin_count = 16;
+// Deeper nodes are split at the median, so the traversal stack is bounded
+static constexpr uint32_t sah_depth = 40;
+static constexpr uint32_t stack_size = 128;
+
+// The AVX2 kernels are compiled into the SSE2 build and only called when the CPU has AVX2.
+// MSVC accepts the intrinsics anywhere, GCC and clang need them enabled per function.
+#if defined(__GNUC__) || defined(__clang__)
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define AVX2_TARGET
+#endif
+
+// AVX2 in the CPU and the YMM registers saved by the OS
+static bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+    std::array<int, 4> r{};
+    __cpuid(r.data(), 0);
+    if (r[0] < 7)
+        return false;
+    __cpuid(r.data(), 1);
+    if (!(r[2] & (1 << 27)) || !(r[2] & (1 << 28)))     // OSXSAVE, AVX
+        return false;
+    if ((_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(r.data(), 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE) || !(c & bit_AVX))
+        return false;
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6)
+        return false;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return false;
+    return (b & bit_AVX2) != 0;
+#endif
+}
+
+// Low four lanes low, high four lanes high
+AVX2_TARGET static __m256 set2(float low, float high)
+{
+    return _mm256_set_m128(_mm_set1_ps(high), _mm_set1_ps(low));
+}
+
+AVX2_TARGET static __m256 dup(__m128 v)
+{
+    return _mm256_set_m128(v, v);
+}
+
+static __m128 select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static __m128 madd(__m128 a, __m128 b, __m128 c)
+{
+    return _mm_add_ps(_mm_mul_ps(a, b), c);
+}
+
+// Zero components would make the slab test compute 0 * inf
+static __m128 safe_rcp(__m128 d)
+{
+    __m128 zero = _mm_cmpeq_ps(d, _mm_setzero_ps());
+    return _mm_div_ps(_mm_set1_ps(1.f), select(zero, _mm_set1_ps(1e-30f), d));
+}
+
+// Four rays sharing tmin, structure of arrays
+struct cpu_tracer_t::ray4_t
+{
+    std::array<__m128, 3> o;
+    std::array<__m128, 3> d;
+    std::array<__m128, 3> rd;
+    __m128 tmin;
+    __m128 tmax;        // -inf for the inactive lanes, shrinks to the closest hit
+
+    __m128 hit_box(const bvh_node_t& n) const
+    {
+        __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo.x), o[0]), rd[0]);
+        __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo.y), o[1]), rd[1]);
+        __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo.z), o[2]), rd[2]);
+        __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi.x), o[0]), rd[0]);
+        __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi.y), o[1]), rd[1]);
+        __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi.z), o[2]), rd[2]);
+        __m128 tnear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_max_ps(_mm_min_ps(t0z, t1z), tmin));
+        __m128 tfar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_min_ps(_mm_max_ps(t0z, t1z), tmax));
+        return _mm_cmple_ps(tnear, tfar);
+    }
+
+    // Both children of an inner node in one 8-wide test, the left one in the low lanes.
+    // Bits 0-3 of the mask are the rays hitting the left child, bits 4-7 the right one.
+    AVX2_TARGET int hit_children(const bvh_node_t* children) const
+    {
+        const bvh_node_t& l = children[0];
+        const bvh_node_t& r = children[1];
+        __m256 ox = dup(o[0]), oy = dup(o[1]), oz = dup(o[2]);
+        __m256 rdx = dup(rd[0]), rdy = dup(rd[1]), rdz = dup(rd[2]);
+        __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(set2(l.lo.x, r.lo.x), ox), rdx);
+        __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(set2(l.lo.y, r.lo.y), oy), rdy);
+        __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(set2(l.lo.z, r.lo.z), oz), rdz);
+        __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(set2(l.hi.x, r.hi.x), ox), rdx);
+        __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(set2(l.hi.y, r.hi.y), oy), rdy);
+        __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(set2(l.hi.z, r.hi.z), oz), rdz);
+        __m256 tnear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+            _mm256_max_ps(_mm256_min_ps(t0z, t1z), dup(tmin)));
+        __m256 tfar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+            _mm256_min_ps(_mm256_max_ps(t0z, t1z), dup(tmax)));
+        return _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+    }
+
+    // Moller-Trumbore without culling, the instances are eTriangleCullDisable on the GPU
+    __m128 hit_triangle(const triangle_t& tri, __m128& t, __m128& u, __m128& v) const
+    {
+        __m128 e1x = _mm_set1_ps(tri.e1.x), e1y = _mm_set1_ps(tri.e1.y), e1z = _mm_set1_ps(tri.e1.z);
+        __m128 e2x = _mm_set1_ps(tri.e2.x), e2y = _mm_set1_ps(tri.e2.y), e2z = _mm_set1_ps(tri.e2.z);
+        __m128 px = _mm_sub_ps(_mm_mul_ps(d[1], e2z), _mm_mul_ps(d[2], e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(d[2], e2x), _mm_mul_ps(d[0], e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(d[0], e2y), _mm_mul_ps(d[1], e2x));
+        __m128 det = madd(e1x, px, madd(e1y, py, _mm_mul_ps(e1z, pz)));
+        __m128 inv = _mm_div_ps(_mm_set1_ps(1.f), det);     // NaN/inf lanes fail the comparisons below
+        __m128 sx = _mm_sub_ps(o[0], _mm_set1_ps(tri.v0.x));
+        __m128 sy = _mm_sub_ps(o[1], _mm_set1_ps(tri.v0.y));
+        __m128 sz = _mm_sub_ps(o[2], _mm_set1_ps(tri.v0.z));
+        u = _mm_mul_ps(madd(sx, px, madd(sy, py, _mm_mul_ps(sz, pz))), inv);
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        v = _mm_mul_ps(madd(d[0], qx, madd(d[1], qy, _mm_mul_ps(d[2], qz))), inv);
+        t = _mm_mul_ps(madd(e2x, qx, madd(e2y, qy, _mm_mul_ps(e2z, qz))), inv);
+        __m128 zero = _mm_setzero_ps();
+        __m128 mask = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.f)));
+        return _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, tmin), _mm_cmplt_ps(t, tmax)));
+    }
+
+    // Affine m, the direction is not renormalized so t is the same in both spaces
+    ray4_t transform(const glm::mat4& m) const
+    {
+        ray4_t r;
+        for (int i = 0; i < 3; i++)
+        {
+            r.o[i] = madd(_mm_set1_ps(m[0][i]), o[0], madd(_mm_set1_ps(m[1][i]), o[1],
+                madd(_mm_set1_ps(m[2][i]), o[2], _mm_set1_ps(m[3][i]))));
+            r.d[i] = madd(_mm_set1_ps(m[0][i]), d[0], madd(_mm_set1_ps(m[1][i]), d[1], _mm_mul_ps(_mm_set1_ps(m[2][i]), d[2])));
+            r.rd[i] = safe_rcp(r.d[i]);
+        }
+        r.tmin = tmin;
+        r.tmax = tmax;
+        return r;
+    }
+};
+
+struct cpu_tracer_t::hit4_t
+{
+    __m128 u = _mm_setzero_ps();
+    __m128 v = _mm_setzero_ps();
+    std::array<uint32_t, 4> instance{ no_hit, no_hit, no_hit, no_hit };
+    std::array<uint32_t, 4> triangle{};
+};
+
+std::vector<cpu_tracer_t::bvh_node_t> cpu_tracer_t::build_bvh(std::span<const aabb_t> boxes, uint32_t max_leaf,
+    std::vector<uint32_t>& order)
+{
+    std::vector<bvh_node_t> nodes;
+    order.resize(boxes.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (boxes.empty())
+        return nodes;
+    std::vector<glm::vec3> centroids(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++)
+        centroids[i] = (boxes[i].lo + boxes[i].hi) * 0.5f;
+
+    struct task_t
+    {
+        uint32_t node;
+        uint32_t begin;
+        uint32_t end;
+        uint32_t depth;
+    };
+    std::vector<task_t> tasks{ { 0, 0, (uint32_t)boxes.size(), 0 } };
+    nodes.reserve(boxes.size() * 2);
+    nodes.emplace_back();
+    while (!tasks.empty())
+    {
+        task_t task = tasks.back();
+        tasks.pop_back();
+        aabb_t bounds, centroid_bounds;
+        for (uint32_t i = task.begin; i < task.end; i++)
+        {
+            bounds.grow(boxes[order[i]]);
+            centroid_bounds.grow(centroids[order[i]]);
+        }
+        uint32_t count = task.end - task.begin;
+        nodes[task.node] = { bounds.lo, task.begin, bounds.hi, (uint16_t)count, 0 };
+        if (count == 1)
+            continue;
+
+        glm::vec3 extent = centroid_bounds.hi - centroid_bounds.lo;
+        uint32_t axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+        uint32_t mid = task.begin + count / 2;
+        bool median = true;
+        if (extent[axis] > 0.f && task.depth < sah_depth)
+        {
+            // Binned SAH along the widest centroid axis
+            float scale = bin_count / extent[axis];
+            auto bin_of = [&](uint32_t prim)
+            {
+                return std::min(bin_count - 1, (uint32_t)((centroids[prim][axis] - centroid_bounds.lo[axis]) * scale));
+            };
+            std::array<aabb_t, bin_count> bin_bounds;
+            std::array<uint32_t, bin_count> bin_counts{};
+            for (uint32_t i = task.begin; i < task.end; i++)
+            {
+                uint32_t b = bin_of(order[i]);
+                bin_counts[b]++;
+                bin_bounds[b].grow(boxes[order[i]]);
+            }
+            std::array<float, bin_count> right_cost{};
+            aabb_t right;
+            uint32_t right_count = 0;
+            for (uint32_t b = bin_count - 1; b > 0; b--)
+            {
+                right.grow(bin_bounds[b]);
+                right_count += bin_counts[b];
+                right_cost[b] = right.area() * right_count;
+            }
+            aabb_t left;
+            uint32_t left_count = 0;
+            float best_cost = std::numeric_limits<float>::max();
+            uint32_t best_split = 1;
+            for (uint32_t b = 1; b < bin_count; b++)
+            {
+                left.grow(bin_bounds[b - 1]);
+                left_count += bin_counts[b - 1];
+                float cost = left.area() * left_count + right_cost[b];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_split = b;
+                }
+            }
+            // A traversal step costs about one primitive test
+            float split_cost = 1.f + best_cost / std::max(bounds.area(), 1e-20f);
+            if (count <= max_leaf && split_cost >= (float)count)
+                continue;
+            auto split = std::partition(order.begin() + task.begin, order.begin() + task.end,
+                [&](uint32_t prim) { return bin_of(prim) < best_split; });
+            uint32_t split_index = (uint32_t)(split - order.begin());
+            if (split_index != task.begin && split_index != task.end)
+            {
+                mid = split_index;
+                median = false;
+            }
+        }
+        else if (count <= max_leaf)
+            continue;
+        if (median)
+        {
+            std::nth_element(order.begin() + task.begin, order.begin() + mid, order.begin() + task.end,
+                [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+        }
+
+        uint32_t left_child = (uint32_t)nodes.size();
+        nodes.emplace_back();
+        nodes.emplace_back();
+        nodes[task.node].first = left_child;
+        nodes[task.node].count = 0;
+        nodes[task.node].axis = (uint16_t)axis;
+        tasks.push_back({ left_child, task.begin, mid, task.depth + 1 });
+        tasks.push_back({ left_child + 1, mid, task.end, task.depth + 1 });
+    }
+    return nodes;
+}
+
+template<bool wide, typename Leaf>
+void cpu_tracer_t::traverse(std::span<const bvh_node_t> nodes, const ray4_t& ray, Leaf&& leaf)
+{
+    if (nodes.empty())
+        return;
+    std::array<uint32_t, stack_size> stack;
+    uint32_t top = 0;
+    stack[top++] = 0;
+    if constexpr (wide)
+    {
+        // The children are tested together before they are pushed, the popped nodes are known hit
+        if (!_mm_movemask_ps(ray.hit_box(nodes[0])))
+            return;
+        while (top > 0)
+        {
+            const bvh_node_t& node = nodes[stack[--top]];
+            if (node.count > 0)
+            {
+                leaf(node);
+                continue;
+            }
+            int hits = ray.hit_children(&nodes[node.first]);
+            bool negative = _mm_movemask_ps(ray.d[node.axis]) & 1;
+            uint32_t near_child = negative ? node.first + 1 : node.first;
+            uint32_t far_child = negative ? node.first : node.first + 1;
+            int near_hits = negative ? hits >> 4 : hits & 0xF;
+            int far_hits = negative ? hits & 0xF : hits >> 4;
+            if (far_hits)
+                stack[top++] = far_child;
+            if (near_hits)
+                stack[top++] = near_child;
+        }
+        return;
+    }
+    while (top > 0)
+    {
+        // Tested when popped, so the hits found since the push are taken into account
+        const bvh_node_t& node = nodes[stack[--top]];
+        if (!_mm_movemask_ps(ray.hit_box(node)))
+            continue;
+        if (node.count > 0)
+        {
+            leaf(node);
+            continue;
+        }
+        // The right child holds the larger centroids, it is nearer for a negative direction
+        bool negative = _mm_movemask_ps(ray.d[node.axis]) & 1;
+        stack[top++] = negative ? node.first : node.first + 1;
+        stack[top++] = negative ? node.first + 1 : node.first;
+    }
+}
+
+template<bool any_hit, bool wide>
+void cpu_tracer_t::trace(ray4_t& ray, hit4_t& hit) const
+{
+    const __m128 neg_inf = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+    traverse<wide>(tlas, ray, [&](const bvh_node_t& tlas_leaf)
+    {
+        for (uint32_t i = tlas_leaf.first; i < tlas_leaf.first + tlas_leaf.count; i++)
+        {
+            const instance_t& inst = instances[i];
+            const blas_t& blas = blases[inst.blas];
+            ray4_t obj = ray.transform(inst.world_to_object);
+            traverse<wide>(blas.nodes, obj, [&](const bvh_node_t& blas_leaf)
+            {
+                for (uint32_t j = blas_leaf.first; j < blas_leaf.first + blas_leaf.count; j++)
+                {
+                    __m128 t, u, v;
+                    __m128 mask = obj.hit_triangle(blas.triangles[j], t, u, v);
+                    int bits = _mm_movemask_ps(mask);
+                    if (!bits)
+                        continue;
+                    if constexpr (any_hit)
+                        obj.tmax = select(mask, neg_inf, obj.tmax);
+                    else
+                    {
+                        obj.tmax = select(mask, t, obj.tmax);
+                        hit.u = select(mask, u, hit.u);
+                        hit.v = select(mask, v, hit.v);
+                        for (int k = 0; k < 4; k++)
+                        {
+                            if (bits & (1 << k))
+                            {
+                                hit.instance[k] = i;
+                                hit.triangle[k] = j;
+                            }
+                        }
+                    }
+                }
+            });
+            ray.tmax = obj.tmax;
+        }
+    });
+}
+
+cpu_tracer_t::cpu_tracer_t(const scene_t& scene, job_system_t& jobs) : scene(scene), avx2(cpu_has_avx2())
+{
+    CPU_ZONE("CPU BVH Build");
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // BLAS: one per mesh record, the dedup already shares them between the nodes
+    blases.resize(scene.meshes.size());
+    jobs.parallel_for((uint32_t)scene.meshes.size(), [&](uint32_t mesh_index)
+    {
+        const mesh_record_t& m = scene.meshes[mesh_index];
+        blas_t& blas = blases[mesh_index];
+        blas.vtx_offset = m.vtx_offset;
+        auto position = [&](uint32_t index) { return scene.vertices[m.vtx_offset + scene.indices[index]].pos; };
+        std::vector<aabb_t> boxes(m.idx_count / 3);
+        for (uint32_t i = 0; i < boxes.size(); i++)
+        {
+            for (uint32_t k = 0; k < 3; k++)
+                boxes[i].grow(position(m.idx_offset + i * 3 + k));
+        }
+        std::vector<uint32_t> order;
+        blas.nodes = build_bvh(boxes, 4, order);
+        blas.triangles.reserve(order.size());
+        for (uint32_t i : order)
+        {
+            uint32_t index = m.idx_offset + i * 3;
+            glm::vec3 v0 = position(index);
+            blas.triangles.push_back({ v0, position(index + 1) - v0, position(index + 2) - v0, index });
+        }
+    });
+
+    // TLAS: one instance per node mesh, like the GPU instances
+    std::vector<instance_t> node_instances;
+    std::vector<aabb_t> boxes;
+    for (const node_record_t& n : scene.nodes)
+    {
+        glm::mat4 world_to_object = glm::inverse(n.mat);
+        glm::mat3 normal_mat = glm::transpose(glm::inverse(glm::mat3(n.mat)));
+        for (uint32_t mesh_index : scene.node_mesh_indices.subspan(n.mesh_first, n.mesh_count))
+        {
+            const blas_t& blas = blases[mesh_index];
+            if (blas.nodes.empty())
+                continue;
+            boxes.push_back(aabb_t{ blas.nodes[0].lo, blas.nodes[0].hi }.transform(n.mat));
+            node_instances.push_back({ world_to_object, normal_mat, glm::vec3(n.col), mesh_index });
+        }
+    }
+    std::vector<uint32_t> order;
+    tlas = build_bvh(boxes, 1, order);
+    for (uint32_t i : order)
+        instances.push_back(node_instances[i]);
+
+    size_t blas_nodes = 0;
+    size_t triangles = 0;
+    for (const blas_t& blas : blases)
+    {
+        blas_nodes += blas.nodes.size();
+        triangles += blas.triangles.size();
+    }
+    std::cout << fmt::format("CPU BVH: {} BLAS, {} triangles, {} nodes, {} instances, built in {:.3f} ms\n",
+        blases.size(), triangles, blas_nodes + tlas.size(), instances.size(),
+        std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+}
+
+std::vector<uint8_t> cpu_tracer_t::render(const cpu_camera_t& camera, glm::uvec2 size, job_system_t& jobs,
+    cpu_trace_stats_t& stats) const
+{
+    CPU_ZONE("CPU Trace");
+    constexpr uint32_t tile = 16;
+    constexpr float t_min = 0.001f;
+    constexpr float t_max = 10000.f;
+    const float inf = std::numeric_limits<float>::infinity();
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::vector<uint8_t> rgb((size_t)size.x * size.y * 3);
+    glm::uvec2 grid = (size + tile - 1u) / tile;
+    glm::vec3 origin = glm::vec3(camera.view_inverse * glm::vec4(0, 0, 0, 1));
+    std::atomic<uint64_t> primary_rays = 0;
+    std::atomic<uint64_t> shadow_rays = 0;
+    jobs.parallel_for(grid.x * grid.y, [&](uint32_t tile_index)
+    {
+        glm::uvec2 tile_origin = glm::uvec2(tile_index % grid.x, tile_index / grid.x) * tile;
+        glm::uvec2 tile_end = glm::min(tile_origin + tile, size);
+        uint64_t primary = 0;
+        uint64_t shadow = 0;
+        for (uint32_t y = tile_origin.y; y < tile_end.y; y += 2)
+        {
+            for (uint32_t x = tile_origin.x; x < tile_end.x; x += 2)
+            {
+                // 2x2 quad, the lanes outside the image stay inactive
+                std::array<glm::uvec2, 4> pixels{ glm::uvec2(x, y), glm::uvec2(x + 1, y), glm::uvec2(x, y + 1), glm::uvec2(x + 1, y + 1) };
+                std::array<bool, 4> inside{};
+                std::array<glm::vec3, 4> dirs{};
+                alignas(16) std::array<float, 4> dx{}, dy{}, dz{}, tmax{};
+                for (int k = 0; k < 4; k++)
+                {
+                    inside[k] = pixels[k].x < tile_end.x && pixels[k].y < tile_end.y;
+                    // trace.rgen
+                    glm::vec2 d = (glm::vec2(pixels[k]) + 0.5f) / glm::vec2(size) * 2.f - 1.f;
+                    glm::vec4 target = camera.proj_inverse * glm::vec4(d.x, d.y, 1, 1);
+                    dirs[k] = glm::vec3(camera.view_inverse * glm::vec4(glm::normalize(glm::vec3(target)), 0));
+                    dx[k] = dirs[k].x;
+                    dy[k] = dirs[k].y;
+                    dz[k] = dirs[k].z;
+                    tmax[k] = inside[k] ? t_max : -inf;
+                    primary += inside[k];
+                }
+                ray4_t ray;
+                ray.o = { _mm_set1_ps(origin.x), _mm_set1_ps(origin.y), _mm_set1_ps(origin.z) };
+                ray.d = { _mm_loadu_ps(dx.data()), _mm_loadu_ps(dy.data()), _mm_loadu_ps(dz.data()) };
+                for (int i = 0; i < 3; i++)
+                    ray.rd[i] = safe_rcp(ray.d[i]);
+                ray.tmin = _mm_set1_ps(t_min);
+                ray.tmax = _mm_loadu_ps(tmax.data());
+                hit4_t hit;
+                if (avx2)
+                    trace<false, true>(ray, hit);
+                else
+                    trace<false, false>(ray, hit);
+
+                // trace.rchit
+                alignas(16) std::array<float, 4> t{}, u{}, v{};
+                _mm_storeu_ps(t.data(), ray.tmax);
+                _mm_storeu_ps(u.data(), hit.u);
+                _mm_storeu_ps(v.data(), hit.v);
+                std::array<glm::vec3, 4> color;
+                std::array<float, 4> diffuse{};
+                alignas(16) std::array<float, 4> sox{}, soy{}, soz{}, sdx{}, sdy{}, sdz{}, stmax{};
+                stmax.fill(-inf);
+                for (int k = 0; k < 4; k++)
+                {
+                    color[k] = glm::vec3(1, 0, 0);      // trace.rmiss
+                    if (!inside[k] || hit.instance[k] == no_hit)
+                        continue;
+                    const instance_t& inst = instances[hit.instance[k]];
+                    const blas_t& blas = blases[inst.blas];
+                    const triangle_t& tri = blas.triangles[hit.triangle[k]];
+                    auto normal = [&](uint32_t i) { return scene.vertices[blas.vtx_offset + scene.indices[tri.index + i]].nor; };
+                    glm::vec3 nor = normal(0) * (1.f - u[k] - v[k]) + normal(1) * u[k] + normal(2) * v[k];
+                    nor = glm::normalize(inst.normal_mat * nor);
+                    nor = glm::faceforward(nor, dirs[k], nor);
+                    glm::vec3 pos = origin + dirs[k] * t[k];
+                    glm::vec3 to_light = camera.light_pos - pos;
+                    float dist = glm::length(to_light);
+                    glm::vec3 light = to_light / dist;
+                    diffuse[k] = std::max(glm::dot(nor, light), 0.f);
+                    color[k] = inst.col;
+                    if (diffuse[k] > 0.f)
+                    {
+                        glm::vec3 shadow_origin = pos + nor * t_min;
+                        sox[k] = shadow_origin.x;
+                        soy[k] = shadow_origin.y;
+                        soz[k] = shadow_origin.z;
+                        sdx[k] = light.x;
+                        sdy[k] = light.y;
+                        sdz[k] = light.z;
+                        stmax[k] = dist;
+                        shadow++;
+                    }
+                }
+
+                // Shadow rays, the lanes still active after the any hit traversal see the light
+                std::array<float, 4> visibility{};
+                if (std::any_of(stmax.begin(), stmax.end(), [&](float s) { return s != -inf; }))
+                {
+                    alignas(16) std::array<float, 4> active = stmax;
+                    ray4_t shadow_ray;
+                    shadow_ray.o = { _mm_loadu_ps(sox.data()), _mm_loadu_ps(soy.data()), _mm_loadu_ps(soz.data()) };
+                    shadow_ray.d = { _mm_loadu_ps(sdx.data()), _mm_loadu_ps(sdy.data()), _mm_loadu_ps(sdz.data()) };
+                    for (int i = 0; i < 3; i++)
+                        shadow_ray.rd[i] = safe_rcp(shadow_ray.d[i]);
+                    shadow_ray.tmin = _mm_set1_ps(t_min);
+                    shadow_ray.tmax = _mm_loadu_ps(stmax.data());
+                    hit4_t shadow_hit;
+                    if (avx2)
+                        trace<true, true>(shadow_ray, shadow_hit);
+                    else
+                        trace<true, false>(shadow_ray, shadow_hit);
+                    _mm_storeu_ps(stmax.data(), shadow_ray.tmax);
+                    for (int k = 0; k < 4; k++)
+                        visibility[k] = active[k] != -inf && stmax[k] != -inf ? 1.f : 0.f;
+                }
+
+                for (int k = 0; k < 4; k++)
+                {
+                    if (!inside[k])
+                        continue;
+                    if (hit.instance[k] != no_hit)
+                        color[k] *= 0.2f + 0.8f * diffuse[k] * visibility[k];
+                    // R8G8B8A8Unorm store
+                    uint8_t* dst = rgb.data() + ((size_t)pixels[k].y * size.x + pixels[k].x) * 3;
+                    for (int c = 0; c < 3; c++)
+                        dst[c] = (uint8_t)std::round(std::clamp(color[k][c], 0.f, 1.f) * 255.f);
+                }
+            }
+        }
+        primary_rays += primary;
+        shadow_rays += shadow;
+    });
+
+    stats.primary_rays = primary_rays;
+    stats.shadow_rays = shadow_rays;
+    stats.ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    return rgb;
+}
+
+void write_ppm(const std::string& path, glm::uvec2 size, std::span<const uint8_t> rgb)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw std::runtime_error("cannot open the output image " + path);
+    out << fmt::format("P6\n{} {}\n255\n", size.x, size.y);
+    out.write(reinterpret_cast<const char*>(rgb.data()), (std::streamsize)rgb.size());
+}
+
+std::vector<uint8_t> read_ppm(const std::string& path, glm::uvec2& size)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    uint32_t max_value = 0;
+    if (!(in >> magic >> size.x >> size.y >> max_value) || magic != "P6" || max_value != 255)
+        throw std::runtime_error("cannot read the RGB8 PPM image " + path);
+    in.get();
+    std::vector<uint8_t> rgb((size_t)size.x * size.y * 3);
+    if (!in.read(reinterpret_cast<char*>(rgb.data()), (std::streamsize)rgb.size()))
+        throw std::runtime_error("truncated PPM image " + path);
+    return rgb;
+}
+
+image_diff_t compare_images(std::span<const uint8_t> a, std::span<const uint8_t> b, uint32_t tolerance)
+{
+    image_diff_t diff;
+    for (size_t i = 0; i + 2 < std::min(a.size(), b.size()); i += 3)
+    {
+        uint32_t pixel_diff = 0;
+        for (size_t c = 0; c < 3; c++)
+            pixel_diff = std::max(pixel_diff, (uint32_t)std::abs(a[i + c] - b[i + c]));
+        diff.max_diff = std::max(diff.max_diff, pixel_diff);
+        diff.pixels += pixel_diff > tolerance;
+    }
+    return diff;
+}
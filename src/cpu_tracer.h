@@ -0,0 +1,95 @@
+#pragma once
+#include <array>
+#include <span>
+#include <string>
+#include <vector>
+#include "scene.h"
+#include "scene_cache.h"
+#include "job_system.h"
+
+// trace.rgen camera and trace.rchit light
+struct cpu_camera_t
+{
+    glm::mat4 view_inverse;
+    glm::mat4 proj_inverse;
+    glm::vec3 light_pos;
+};
+
+struct cpu_trace_stats_t
+{
+    uint64_t primary_rays = 0;
+    uint64_t shadow_rays = 0;
+    double ms = 0.0;
+};
+
+// CPU reference of the traced path, for the machines without a ray tracing device and as the
+// golden image of the GPU backends. The BVHs mirror the BLAS/TLAS split: a binned SAH BVH per
+// mesh in mesh space, built on the job system, and one over the node instances in world space.
+// The image is traced in tiles on the job system, every 2x2 pixel quad is a packet of 4 rays
+// traversing the BVHs together with SSE, then a packet of shadow rays from the hits. When the
+// CPU has AVX2 the two children of a node are tested against the packet in one 8-wide test.
+class cpu_tracer_t
+{
+    struct bvh_node_t
+    {
+        glm::vec3 lo;
+        uint32_t first;         // leaf: first primitive, inner: left child, the right one follows it
+        glm::vec3 hi;
+        uint16_t count;         // 0 for the inner nodes
+        uint16_t axis;          // inner: split axis, the child on the side of the ray direction is visited first
+    };
+    // Precomputed edges for Moller-Trumbore, mesh space
+    struct triangle_t
+    {
+        glm::vec3 v0, e1, e2;
+        uint32_t index;         // first of the three in scene_t::indices
+    };
+    struct blas_t
+    {
+        std::vector<bvh_node_t> nodes;
+        std::vector<triangle_t> triangles;  // leaf order
+        uint32_t vtx_offset = 0;
+    };
+    struct instance_t
+    {
+        glm::mat4 world_to_object;
+        glm::mat3 normal_mat;               // inverse transpose of the node transform
+        glm::vec3 col;
+        uint32_t blas;
+    };
+    struct ray4_t;
+    struct hit4_t;
+
+    const scene_t& scene;
+    std::vector<blas_t> blases;
+    std::vector<instance_t> instances;      // leaf order of the TLAS
+    std::vector<bvh_node_t> tlas;
+    bool avx2 = false;                      // checked with cpuid at construction
+
+    // Leaves of at most max_leaf primitives, order receives the primitives in leaf order
+    static std::vector<bvh_node_t> build_bvh(std::span<const aabb_t> boxes, uint32_t max_leaf, std::vector<uint32_t>& order);
+    // Calls leaf(node) for every leaf hit by an active lane, leaf may shrink ray.tmax.
+    // wide tests the children of a node together with AVX2 instead of one by one when popped.
+    template<bool wide, typename Leaf>
+    static void traverse(std::span<const bvh_node_t> nodes, const ray4_t& ray, Leaf&& leaf);
+    // Closest hit, or with any_hit the lanes that hit anything end with tmax = -inf
+    template<bool any_hit, bool wide>
+    void trace(ray4_t& ray, hit4_t& hit) const;
+public:
+    // The scene must outlive the tracer, its normals are read at every hit
+    cpu_tracer_t(const scene_t& scene, job_system_t& jobs);
+    // Top-left pixel first, RGB8 like the offline GPU render
+    std::vector<uint8_t> render(const cpu_camera_t& camera, glm::uvec2 size, job_system_t& jobs, cpu_trace_stats_t& stats) const;
+    bool uses_avx2() const { return avx2; }
+};
+
+// Binary PPM (P6) of RGB8 pixels
+void write_ppm(const std::string& path, glm::uvec2 size, std::span<const uint8_t> rgb);
+std::vector<uint8_t> read_ppm(const std::string& path, glm::uvec2& size);
+
+struct image_diff_t
+{
+    uint64_t pixels = 0;        // with a channel further than the tolerance
+    uint32_t max_diff = 0;
+};
+image_diff_t compare_images(std::span<const uint8_t> a, std::span<const uint8_t> b, uint32_t tolerance);
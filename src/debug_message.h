@@ -137,7 +137,7 @@ void debug_name(const vk::UniqueHandle<T, VULKAN_HPP_DEFAULT_DISPATCHER_TYPE>& o
     }
 }
 
-void debug_mark_begin(const vk::UniqueCommandBuffer& cmd, const std::string& name)
+inline void debug_mark_begin(const vk::UniqueCommandBuffer& cmd, const std::string& name)
 {
     if (VULKAN_HPP_DEFAULT_DISPATCHER.vkCmdDebugMarkerBeginEXT)
         cmd->debugMarkerBeginEXT({ name.c_str() });
@@ -145,7 +145,7 @@ void debug_mark_begin(const vk::UniqueCommandBuffer& cmd, const std::string& nam
         cmd->beginDebugUtilsLabelEXT({ name.c_str() });
 }
 
-void debug_mark_end(const vk::UniqueCommandBuffer& cmd)
+inline void debug_mark_end(const vk::UniqueCommandBuffer& cmd)
 {
     if (VULKAN_HPP_DEFAULT_DISPATCHER.vkCmdDebugMarkerEndEXT)
         cmd->debugMarkerEndEXT();
@@ -153,7 +153,7 @@ void debug_mark_end(const vk::UniqueCommandBuffer& cmd)
         cmd->endDebugUtilsLabelEXT();
 }
 
-void debug_mark_insert(const vk::UniqueCommandBuffer& cmd, const std::string& name)
+inline void debug_mark_insert(const vk::UniqueCommandBuffer& cmd, const std::string& name)
 {
     if (VULKAN_HPP_DEFAULT_DISPATCHER.vkCmdDebugMarkerInsertEXT)
         cmd->debugMarkerInsertEXT({ name.c_str() });
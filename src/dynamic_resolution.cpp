@@ -0,0 +1,69 @@
+#include "pch.h"
+#include "dynamic_resolution.h"
+
+// Grow only when the cost is this far under the budget, shrink when over it
+static constexpr double grow_band = 0.85;
+// Size changes smaller than this are ignored
+static constexpr float min_step = 1.f / 32.f;
+
+dynamic_resolution_t::dynamic_resolution_t(glm::uvec2 max_size, double target_ms, float min_scale, uint32_t window)
+    : max_size(max_size), target_ms(target_ms), min_scale(std::clamp(min_scale, 0.05f, 1.f)), window(std::max(1u, window))
+{
+    ns_per_pixel.reserve(this->window);
+}
+
+void dynamic_resolution_t::add_sample(double gpu_ms, glm::uvec2 traced_size)
+{
+    if (!enabled() || gpu_ms <= 0.0 || traced_size.x == 0 || traced_size.y == 0)
+        return;
+    // Frames already in flight when the size changed still report the old cost
+    if (cooldown > 0)
+    {
+        cooldown--;
+        return;
+    }
+    double sample = gpu_ms * 1e6 / ((double)traced_size.x * traced_size.y);
+    if (ns_per_pixel.size() < window)
+        ns_per_pixel.push_back(sample);
+    else
+        ns_per_pixel[next] = sample;
+    next = (next + 1) % window;
+    if (ns_per_pixel.size() < window)
+        return;
+
+    double avg = std::accumulate(ns_per_pixel.begin(), ns_per_pixel.end(), 0.0) / ns_per_pixel.size();
+    double max_pixels = (double)max_size.x * max_size.y;
+    double current_ms = avg * max_pixels * scale * scale / 1e6;
+    bool over = current_ms > target_ms;
+    bool under = current_ms < target_ms * grow_band;
+    if (!over && !under)
+        return;
+
+    // The cost scales with the pixel count, aim for the middle of the band
+    double budget_ms = target_ms * (1.0 + grow_band) * 0.5;
+    float wanted = (float)std::sqrt(budget_ms * 1e6 / (avg * max_pixels));
+    wanted = std::clamp(wanted, min_scale, 1.f);
+    if (std::abs(wanted - scale) < min_step)
+        return;
+    scale = wanted;
+    lowest_scale = std::min(lowest_scale, scale);
+    changes++;
+    ns_per_pixel.clear();
+    next = 0;
+    cooldown = window;
+}
+
+glm::uvec2 dynamic_resolution_t::size() const
+{
+    glm::uvec2 s = glm::uvec2(glm::vec2(max_size) * scale);
+    return glm::clamp(s, glm::uvec2(1), max_size);
+}
+
+void dynamic_resolution_t::report() const
+{
+    if (!enabled())
+        return;
+    glm::uvec2 s = size();
+    std::cout << fmt::format("Dynamic resolution: target {:.2f} ms, scale {:.2f} ({}x{} of {}x{}), lowest {:.2f}, {} changes\n",
+        target_ms, scale, s.x, s.y, max_size.x, max_size.y, lowest_scale, changes);
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+
+// Picks the size of the traced sub-rectangle of the output image from the measured GPU cost.
+// The samples are normalized to cost per pixel so that frames traced at different sizes can be
+// averaged together. The scale drops as soon as the average is over budget, it only grows back
+// when the average stays under the lower band, and after every change the controller waits for
+// a full window of samples taken at the new size.
+class dynamic_resolution_t
+{
+    glm::uvec2 max_size;
+    double target_ms = 0.0;
+    float min_scale = 0.5f;
+    float scale = 1.f;
+    std::vector<double> ns_per_pixel;   // recent samples, ring buffer
+    size_t next = 0;
+    uint32_t window = 0;
+    uint32_t cooldown = 0;              // samples to skip until the last change is measured
+    uint32_t changes = 0;
+    float lowest_scale = 1.f;
+public:
+    // target_ms = 0 keeps the full size
+    dynamic_resolution_t(glm::uvec2 max_size, double target_ms, float min_scale, uint32_t window = 8);
+    bool enabled() const { return target_ms > 0.0; }
+    // New full size, the cost history is kept since it is per pixel
+    void resize(glm::uvec2 new_max_size) { max_size = new_max_size; }
+    // GPU time of a frame traced at the given size
+    void add_sample(double gpu_ms, glm::uvec2 traced_size);
+    // Size to trace the next frame at, never larger than max_size
+    glm::uvec2 size() const;
+    float get_scale() const { return scale; }
+    void report() const;
+};
@@ -0,0 +1,105 @@
+#include "pch.h"
+#include "geometry_codec.h"
+
+static int16_t to_snorm16(float v)
+{
+    return (int16_t)std::round(std::clamp(v, -1.f, 1.f) * 32767.f);
+}
+
+static float from_snorm16(int16_t v)
+{
+    return std::max(v / 32767.f, -1.f);
+}
+
+uint32_t oct_encode(glm::vec3 n)
+{
+    n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z) + 1e-20f;
+    glm::vec2 p(n.x, n.y);
+    if (n.z < 0)
+    {
+        // Fold the lower hemisphere over the diagonals
+        p = (1.f - glm::abs(glm::vec2(n.y, n.x))) * glm::vec2(n.x >= 0 ? 1.f : -1.f, n.y >= 0 ? 1.f : -1.f);
+    }
+    return (uint16_t)to_snorm16(p.x) | (uint32_t)(uint16_t)to_snorm16(p.y) << 16;
+}
+
+glm::vec3 oct_decode(uint32_t packed)
+{
+    glm::vec2 p(from_snorm16((int16_t)(packed & 0xFFFF)), from_snorm16((int16_t)(packed >> 16)));
+    glm::vec3 n(p.x, p.y, 1.f - std::abs(p.x) - std::abs(p.y));
+    float t = std::max(-n.z, 0.f);
+    n.x += n.x >= 0 ? -t : t;
+    n.y += n.y >= 0 ? -t : t;
+    return glm::normalize(n);
+}
+
+packed_geometry_t pack_geometry(const scene_t& scene, bool quantize_positions, job_system_t& jobs)
+{
+    packed_geometry_t geo;
+    // snorm16x4 keeps the 2 byte alignment the BLAS builder requires, w is padding
+    geo.position_format = quantize_positions ? vk::Format::eR16G16B16A16Snorm : vk::Format::eR32G32B32Sfloat;
+    geo.position_stride = quantize_positions ? sizeof(int16_t) * 4 : sizeof(float) * 3;
+    geo.positions.resize(scene.vertices.size() * geo.position_stride);
+    geo.normals.resize(scene.vertices.size());
+
+    // Index byte offsets, every mesh starts 4 byte aligned so that primitiveOffset is valid for both types
+    geo.meshes.resize(scene.meshes.size());
+    vk::DeviceSize idx_size = 0;
+    for (size_t i = 0; i < scene.meshes.size(); i++)
+    {
+        const mesh_record_t& m = scene.meshes[i];
+        packed_mesh_t& pm = geo.meshes[i];
+        pm.index_type = m.vtx_count <= 0x10000 ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+        pm.idx_byte_offset = idx_size;
+        idx_size = (idx_size + m.idx_count * (pm.index_type == vk::IndexType::eUint16 ? 2 : 4) + 3) & ~3ull;
+    }
+    geo.indices.resize(idx_size);
+
+    jobs.parallel_for((uint32_t)scene.meshes.size(), [&](uint32_t mesh_index)
+    {
+        const mesh_record_t& m = scene.meshes[mesh_index];
+        packed_mesh_t& pm = geo.meshes[mesh_index];
+        auto vertices = scene.vertices.subspan(m.vtx_offset, m.vtx_count);
+
+        pm.dequant = glm::identity<glm::mat4>();
+        if (quantize_positions)
+        {
+            glm::vec3 bb_min(std::numeric_limits<float>::max());
+            glm::vec3 bb_max(std::numeric_limits<float>::lowest());
+            for (const auto& v : vertices)
+            {
+                bb_min = glm::min(bb_min, v.pos);
+                bb_max = glm::max(bb_max, v.pos);
+            }
+            glm::vec3 center = m.vtx_count ? (bb_min + bb_max) * 0.5f : glm::vec3(0);
+            glm::vec3 half = m.vtx_count ? glm::max((bb_max - bb_min) * 0.5f, glm::vec3(1e-20f)) : glm::vec3(1);
+            pm.dequant = glm::translate(center) * glm::scale(half);
+            auto* dst = reinterpret_cast<int16_t*>(geo.positions.data()) + (size_t)m.vtx_offset * 4;
+            for (const auto& v : vertices)
+            {
+                glm::vec3 q = (v.pos - center) / half;
+                *dst++ = to_snorm16(q.x);
+                *dst++ = to_snorm16(q.y);
+                *dst++ = to_snorm16(q.z);
+                *dst++ = 0;
+            }
+        }
+        else
+        {
+            auto* dst = reinterpret_cast<glm::vec3*>(geo.positions.data()) + m.vtx_offset;
+            for (const auto& v : vertices)
+                *dst++ = v.pos;
+        }
+
+        for (uint32_t i = 0; i < m.vtx_count; i++)
+            geo.normals[m.vtx_offset + i] = oct_encode(vertices[i].nor);
+
+        auto indices = scene.indices.subspan(m.idx_offset, m.idx_count);
+        uint8_t* dst = geo.indices.data() + pm.idx_byte_offset;
+        if (pm.index_type == vk::IndexType::eUint16)
+            std::transform(indices.begin(), indices.end(), reinterpret_cast<uint16_t*>(dst), [](uint32_t i) { return (uint16_t)i; });
+        else
+            std::copy(indices.begin(), indices.end(), reinterpret_cast<uint32_t*>(dst));
+    });
+    return geo;
+}
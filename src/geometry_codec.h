@@ -0,0 +1,30 @@
+#pragma once
+#include <vector>
+#include "scene_cache.h"
+#include "job_system.h"
+
+// Octahedral normal encoding, two snorm16 packed in 32 bits
+uint32_t oct_encode(glm::vec3 n);
+glm::vec3 oct_decode(uint32_t packed);
+
+struct packed_mesh_t
+{
+    vk::IndexType index_type;           // eUint16 when all the indices fit
+    vk::DeviceSize idx_byte_offset;     // offset of the first index in packed_geometry_t::indices
+    glm::mat4 dequant;                  // maps the quantized positions back to the mesh space
+};
+
+// Compressed geometry streams: positions quantized to snorm16 in the mesh bounding box
+// (or kept as floats when the BLAS cannot consume them), octahedral normals in a separate
+// stream, mixed 16/32 bit indices
+struct packed_geometry_t
+{
+    std::vector<uint8_t> positions;
+    vk::Format position_format;
+    uint32_t position_stride;
+    std::vector<uint32_t> normals;
+    std::vector<uint8_t> indices;
+    std::vector<packed_mesh_t> meshes;
+};
+
+packed_geometry_t pack_geometry(const scene_t& scene, bool quantize_positions, job_system_t& jobs);
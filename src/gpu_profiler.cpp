@@ -0,0 +1,164 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "gpu_profiler.h"
+
+gpu_profiler_t::gpu_profiler_t(const vk::UniqueDevice& device, vk::PhysicalDevice physical_device, uint32_t queue_family,
+    uint32_t frame_slots, const std::string& trace_path, uint32_t max_scopes, uint32_t window)
+    : device(device), queries_per_slot(max_scopes * 2), window_size(window)
+{
+    // The trace is written even without timestamps, it also carries the CPU zones
+    if (!trace_path.empty())
+    {
+        trace.open(trace_path, std::ios::trunc);
+        if (!trace)
+            throw std::runtime_error("cannot open the trace file " + trace_path);
+        trace << "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"GPU\"}}";
+    }
+
+    auto props = physical_device.getProperties();
+    uint32_t valid_bits = physical_device.getQueueFamilyProperties()[queue_family].timestampValidBits;
+    enabled = props.limits.timestampComputeAndGraphics && valid_bits > 0;
+    if (!enabled)
+    {
+        std::cout << "GPU profiler disabled: timestamps not supported\n";
+        return;
+    }
+    period = props.limits.timestampPeriod;
+    valid_mask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+    slots.resize(frame_slots + 1);
+    pool = device->createQueryPoolUnique({ {}, vk::QueryType::eTimestamp, queries_per_slot * (uint32_t)slots.size() });
+    debug_name(pool, "GPU Profiler Query Pool");
+}
+
+gpu_profiler_t::~gpu_profiler_t()
+{
+    finish();
+}
+
+void gpu_profiler_t::finish(const std::string& extra_events)
+{
+    if (!trace.is_open())
+        return;
+    if (!extra_events.empty())
+        trace << ",\n" << extra_events;
+    trace << "\n]}\n";
+    trace.close();
+}
+
+void gpu_profiler_t::begin_frame(const vk::UniqueCommandBuffer& cmd, uint32_t slot)
+{
+    if (!enabled)
+        return;
+    slot_t& s = slots[slot];
+    s.scopes.clear();
+    s.open.clear();
+    s.used = 0;
+    s.frame = frame_index++;
+    cmd->resetQueryPool(*pool, slot * queries_per_slot, queries_per_slot);
+}
+
+uint32_t gpu_profiler_t::begin(const vk::UniqueCommandBuffer& cmd, uint32_t slot, const std::string& name)
+{
+    if (!enabled || slots[slot].used + 2 > queries_per_slot)
+        return UINT32_MAX;
+    slot_t& s = slots[slot];
+    uint32_t query = slot * queries_per_slot + s.used;
+    s.used += 2;
+    s.scopes.push_back({ name, query, (uint32_t)s.open.size() });
+    s.open.push_back((uint32_t)s.scopes.size() - 1);
+    cmd->writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *pool, query);
+    return (uint32_t)s.scopes.size() - 1;
+}
+
+void gpu_profiler_t::end(const vk::UniqueCommandBuffer& cmd, uint32_t slot, uint32_t scope)
+{
+    if (!enabled || scope == UINT32_MAX)
+        return;
+    slot_t& s = slots[slot];
+    s.scopes[scope].closed = true;
+    if (!s.open.empty())
+        s.open.pop_back();
+    cmd->writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *pool, s.scopes[scope].query + 1);
+}
+
+void gpu_profiler_t::resolve(uint32_t slot)
+{
+    if (!enabled)
+        return;
+    slot_t& s = slots[slot];
+    if (s.used == 0)
+        return;
+    // Value and availability pairs, the work is known to be complete so nothing waits here
+    std::vector<uint64_t> results(s.used * 2);
+    device->getQueryPoolResults(*pool, slot * queries_per_slot, s.used, results.size() * sizeof(uint64_t), results.data(),
+        2 * sizeof(uint64_t), vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability);
+    for (const auto& scope : s.scopes)
+    {
+        uint32_t local = scope.query - slot * queries_per_slot;
+        if (!scope.closed || !results[local * 2 + 1] || !results[local * 2 + 3])
+            continue;
+        uint64_t t0 = results[local * 2] & valid_mask;
+        uint64_t t1 = results[local * 2 + 2] & valid_mask;
+        double ms = t1 >= t0 ? (t1 - t0) * period / 1e6 : 0.0;
+
+        stats_t& st = stats[scope.name];
+        if (st.window.size() < window_size)
+            st.window.push_back(ms);
+        else
+            st.window[st.next] = ms;
+        st.next = (st.next + 1) % window_size;
+        st.count++;
+        st.total += ms;
+
+        if (trace.is_open())
+        {
+            if (trace_origin == 0)
+                trace_origin = t0;
+            double ts_us = (double)(int64_t)(t0 - trace_origin) * period / 1e3;
+            trace << ",\n" << fmt::format(
+                "{{\"name\":\"{}\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":{:.3f},\"dur\":{:.3f},"
+                "\"args\":{{\"frame\":{},\"depth\":{}}}}}", scope.name, ts_us, ms * 1e3, s.frame, scope.depth);
+        }
+    }
+    s.scopes.clear();
+    s.used = 0;
+}
+
+void gpu_profiler_t::report() const
+{
+    if (!enabled)
+        return;
+    std::cout << fmt::format("GPU scopes (last {} samples):\n", window_size);
+    for (const auto& [name, st] : stats)
+    {
+        if (st.window.empty())
+            continue;
+        auto [min_it, max_it] = std::minmax_element(st.window.begin(), st.window.end());
+        double avg = std::accumulate(st.window.begin(), st.window.end(), 0.0) / st.window.size();
+        std::cout << fmt::format("  {:<32} avg {:8.3f} ms  min {:8.3f} ms  max {:8.3f} ms  total {:10.3f} ms  count {}\n",
+            name, avg, *min_it, *max_it, st.total, st.count);
+    }
+}
+
+double gpu_profiler_t::average(const std::string& name) const
+{
+    auto it = stats.find(name);
+    if (it == stats.end() || it->second.count == 0)
+        return 0.0;
+    return it->second.total / it->second.count;
+}
+
+gpu_scope_t::gpu_scope_t(const vk::UniqueCommandBuffer& cmd, gpu_profiler_t* profiler, uint32_t slot, const std::string& name)
+    : cmd(cmd), profiler(profiler), slot(slot)
+{
+    debug_mark_begin(cmd, name);
+    if (profiler)
+        scope = profiler->begin(cmd, slot, name);
+}
+
+gpu_scope_t::~gpu_scope_t()
+{
+    if (profiler)
+        profiler->end(cmd, slot, scope);
+    debug_mark_end(cmd);
+}
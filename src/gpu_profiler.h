@@ -0,0 +1,75 @@
+#pragma once
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Timestamp based GPU profiler. Every slot (one per frame in flight plus one for the setup
+// command buffers) owns a range of a timestamp query pool, the results are read once the
+// slot's fence has been waited, so the CPU never stalls on the queries. The scopes feed
+// rolling per-name statistics and optionally a Chrome trace_event JSON file.
+class gpu_profiler_t
+{
+    struct scope_t
+    {
+        std::string name;
+        uint32_t query;         // begin query, end is query + 1
+        uint32_t depth;
+        bool closed = false;
+    };
+    struct slot_t
+    {
+        std::vector<scope_t> scopes;
+        std::vector<uint32_t> open;
+        uint32_t used = 0;
+        uint64_t frame = 0;
+    };
+    struct stats_t
+    {
+        std::vector<double> window;     // last samples in ms, ring buffer
+        size_t next = 0;
+        uint64_t count = 0;
+        double total = 0.0;
+    };
+    const vk::UniqueDevice& device;
+    vk::UniqueQueryPool pool;
+    bool enabled = false;
+    float period = 0.f;                 // ns per tick
+    uint64_t valid_mask = ~0ull;
+    uint32_t queries_per_slot = 0;
+    uint32_t window_size = 0;
+    std::vector<slot_t> slots;
+    std::map<std::string, stats_t> stats;
+    uint64_t frame_index = 0;
+    std::ofstream trace;
+    uint64_t trace_origin = 0;
+public:
+    // trace_path empty = no JSON output
+    gpu_profiler_t(const vk::UniqueDevice& device, vk::PhysicalDevice physical_device, uint32_t queue_family,
+        uint32_t frame_slots, const std::string& trace_path, uint32_t max_scopes = 128, uint32_t window = 256);
+    ~gpu_profiler_t();
+    uint32_t setup_slot() const { return (uint32_t)slots.size() - 1; }
+    // Reset the slot's queries, must be recorded before any scope and after the slot was resolved
+    void begin_frame(const vk::UniqueCommandBuffer& cmd, uint32_t slot);
+    uint32_t begin(const vk::UniqueCommandBuffer& cmd, uint32_t slot, const std::string& name);
+    void end(const vk::UniqueCommandBuffer& cmd, uint32_t slot, uint32_t scope);
+    // Read the results of the slot, call it after waiting for the work recorded into it
+    void resolve(uint32_t slot);
+    void report() const;
+    // Mean of all the resolved samples of a scope in ms, 0 when there are none
+    double average(const std::string& name) const;
+    // Close the JSON trace, extra_events (comma separated trace_event objects) are appended first
+    void finish(const std::string& extra_events = {});
+};
+
+// Debug marker and profiler scope in one, the profiler can be null
+class gpu_scope_t
+{
+    const vk::UniqueCommandBuffer& cmd;
+    gpu_profiler_t* profiler;
+    uint32_t slot;
+    uint32_t scope = UINT32_MAX;
+public:
+    gpu_scope_t(const vk::UniqueCommandBuffer& cmd, gpu_profiler_t* profiler, uint32_t slot, const std::string& name);
+    ~gpu_scope_t();
+};
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+// FNV-1a 64 bit, 8 bytes per step on the bulk of the data
+inline uint64_t hash_bytes(const void* bytes, size_t size, uint64_t h = 0xcbf29ce484222325ull)
+{
+    auto* data = reinterpret_cast<const uint8_t*>(bytes);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x100000001b3ull;
+    }
+    for (; i < size; i++)
+        h = (h ^ data[i]) * 0x100000001b3ull;
+    return h;
+}
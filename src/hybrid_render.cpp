@@ -0,0 +1,589 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "shader_registry.h"
+#include "hybrid_render.h"
+
+// World space frustum planes of a [0, 1] depth projection, inside when dot(xyz, p) + w >= 0
+static std::array<glm::vec4, 6> frustum_planes(const glm::mat4& view_proj)
+{
+    glm::mat4 rows = glm::transpose(view_proj);
+    return {
+        rows[3] + rows[0],      // left
+        rows[3] - rows[0],      // right
+        rows[3] + rows[1],      // bottom
+        rows[3] - rows[1],      // top
+        rows[2],                // near
+        rows[3] - rows[2],      // far
+    };
+}
+
+hybrid_render_t::hybrid_render_t(memory_allocator_t& allocator, vk::PhysicalDevice physical_device, vk::PipelineCache cache,
+    vk::DescriptorPool pool, vk::Queue queue, vk::CommandPool cmdpool, const std::string& shader_dir, const hybrid_geometry_t& geometry,
+    const std::vector<mesh_t>& meshes, const std::vector<node_t>& nodes, vk::AccelerationStructureKHR tlas,
+    const ray_counter_t& ray_counter, uint32_t slots, bool gpu_driven)
+    : allocator(allocator), device(allocator.device()), geometry(geometry), node_count((uint32_t)nodes.size()),
+    gpu_driven(gpu_driven)
+{
+    // One draw per mesh instance, grouped by index type so the index buffer is bound once per type.
+    // Every mesh starts 4 byte aligned in the index buffer, see pack_geometry.
+    for (uint32_t node_index = 0; node_index < nodes.size(); node_index++)
+    {
+        for (uint32_t mesh_index : nodes[node_index].mesh_indices)
+        {
+            const mesh_t& m = meshes[mesh_index];
+            uint32_t index_size = m.index_type == vk::IndexType::eUint16 ? 2 : 4;
+            draws.push_back({ node_index, m.idx_count, m.index_type, (uint32_t)(m.idx_byte_offset / index_size),
+                (int32_t)m.vtx_offset, m.dequant, glm::vec4(nodes[node_index].col, 1.f), m.bounds });
+        }
+    }
+    std::stable_sort(draws.begin(), draws.end(), [](const draw_t& a, const draw_t& b) { return a.index_type < b.index_type; });
+    draws32 = (uint32_t)std::count_if(draws.begin(), draws.end(), [](const draw_t& d) { return d.index_type == vk::IndexType::eUint32; });
+
+    for (vk::Format format : { vk::Format::eD32Sfloat, vk::Format::eX8D24UnormPack32, vk::Format::eD16Unorm })
+    {
+        if (physical_device.getFormatProperties(format).optimalTilingFeatures & vk::FormatFeatureFlagBits::eDepthStencilAttachment)
+        {
+            depth_format = format;
+            break;
+        }
+    }
+
+    // Uniforms and instance records
+    auto pd_props = physical_device.getProperties();
+    vk::DeviceSize ubo_alignment = pd_props.limits.minUniformBufferOffsetAlignment;
+    slot_stride = (sizeof(uniform_buffers_comp_t) + ubo_alignment - 1) & ~(ubo_alignment - 1);
+    uniforms = create_buffer(allocator, "Composite Uniform Buffer", slot_stride * slots,
+        vk::BufferUsageFlagBits::eUniformBuffer, memory_usage_t::upload);
+    vk::DeviceSize ssbo_alignment = pd_props.limits.minStorageBufferOffsetAlignment;
+    vk::DeviceSize draw_count = std::max<vk::DeviceSize>(draws.size(), 1);
+    vk::DeviceSize instance_range = sizeof(instance_record_t) * draw_count;
+    if (!gpu_driven)
+    {
+        instance_slot_stride = (instance_range + ssbo_alignment - 1) & ~(ssbo_alignment - 1);
+        host_instances = create_buffer(allocator, "Instances Buffer", instance_slot_stride * slots,
+            vk::BufferUsageFlagBits::eStorageBuffer, memory_usage_t::upload);
+    }
+    else
+    {
+        instances = create_buffer(allocator, "Instances Buffer", instance_range,
+            vk::BufferUsageFlagBits::eStorageBuffer, memory_usage_t::device_local);
+    }
+    view_proj.resize(slots);
+
+    // Render passes
+    // The G-buffer is read by the shadow rays as storage images and by the composite pass as input attachments
+    std::array<vk::AttachmentDescription, 4> gbuffer_attachments{
+        vk::AttachmentDescription({}, vk::Format::eR32G32B32A32Sfloat, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral),
+        vk::AttachmentDescription({}, vk::Format::eR16G16B16A16Sfloat, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral),
+        vk::AttachmentDescription({}, vk::Format::eR8G8B8A8Unorm, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined, vk::ImageLayout::eShaderReadOnlyOptimal),
+        vk::AttachmentDescription({}, depth_format, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined, vk::ImageLayout::eDepthStencilReadOnlyOptimal),
+    };
+    std::array<vk::AttachmentReference, 3> gbuffer_color_refs{
+        vk::AttachmentReference(0, vk::ImageLayout::eColorAttachmentOptimal),
+        vk::AttachmentReference(1, vk::ImageLayout::eColorAttachmentOptimal),
+        vk::AttachmentReference(2, vk::ImageLayout::eColorAttachmentOptimal),
+    };
+    vk::AttachmentReference gbuffer_depth_ref(3, vk::ImageLayout::eDepthStencilAttachmentOptimal);
+    vk::SubpassDescription gbuffer_subpass;
+    gbuffer_subpass.pipelineBindPoint = vk::PipelineBindPoint::eGraphics;
+    gbuffer_subpass.colorAttachmentCount = (uint32_t)gbuffer_color_refs.size();
+    gbuffer_subpass.pColorAttachments = gbuffer_color_refs.data();
+    gbuffer_subpass.pDepthStencilAttachment = &gbuffer_depth_ref;
+    std::array<vk::SubpassDependency, 2> gbuffer_dependencies{
+        // The previous frame may still be reading the G-buffer
+        vk::SubpassDependency(VK_SUBPASS_EXTERNAL, 0,
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eFragmentShader,
+            vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests,
+            {}, vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite, vk::DependencyFlagBits::eByRegion),
+        vk::SubpassDependency(0, VK_SUBPASS_EXTERNAL,
+            vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eLateFragmentTests,
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eFragmentShader,
+            vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+            vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eInputAttachmentRead, {}),
+    };
+    gbuffer_pass = device->createRenderPassUnique({ {}, (uint32_t)gbuffer_attachments.size(), gbuffer_attachments.data(),
+        1, &gbuffer_subpass, (uint32_t)gbuffer_dependencies.size(), gbuffer_dependencies.data() });
+    debug_name(gbuffer_pass, "G-Buffer Render Pass");
+
+    // Output, then depth, pos, nor, alb and shadow as input attachments in the order of composite.frag
+    std::array<vk::AttachmentDescription, 6> composite_attachments{
+        vk::AttachmentDescription({}, vk::Format::eR8G8B8A8Unorm, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferSrcOptimal),
+        vk::AttachmentDescription({}, depth_format, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eDontCare, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eDepthStencilReadOnlyOptimal, vk::ImageLayout::eDepthStencilReadOnlyOptimal),
+        vk::AttachmentDescription({}, vk::Format::eR32G32B32A32Sfloat, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eDontCare, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eGeneral, vk::ImageLayout::eGeneral),
+        vk::AttachmentDescription({}, vk::Format::eR16G16B16A16Sfloat, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eDontCare, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eGeneral, vk::ImageLayout::eGeneral),
+        vk::AttachmentDescription({}, vk::Format::eR8G8B8A8Unorm, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eDontCare, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eShaderReadOnlyOptimal, vk::ImageLayout::eShaderReadOnlyOptimal),
+        vk::AttachmentDescription({}, vk::Format::eR32Sfloat, vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eDontCare, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eGeneral, vk::ImageLayout::eGeneral),
+    };
+    vk::AttachmentReference composite_color_ref(0, vk::ImageLayout::eColorAttachmentOptimal);
+    std::array<vk::AttachmentReference, 5> composite_input_refs{
+        vk::AttachmentReference(1, vk::ImageLayout::eDepthStencilReadOnlyOptimal),
+        vk::AttachmentReference(2, vk::ImageLayout::eGeneral),
+        vk::AttachmentReference(3, vk::ImageLayout::eGeneral),
+        vk::AttachmentReference(4, vk::ImageLayout::eShaderReadOnlyOptimal),
+        vk::AttachmentReference(5, vk::ImageLayout::eGeneral),
+    };
+    vk::SubpassDescription composite_subpass;
+    composite_subpass.pipelineBindPoint = vk::PipelineBindPoint::eGraphics;
+    composite_subpass.inputAttachmentCount = (uint32_t)composite_input_refs.size();
+    composite_subpass.pInputAttachments = composite_input_refs.data();
+    composite_subpass.colorAttachmentCount = 1;
+    composite_subpass.pColorAttachments = &composite_color_ref;
+    std::array<vk::SubpassDependency, 2> composite_dependencies{
+        // Shadow rays written, and the blit of the previous frame done with the output
+        vk::SubpassDependency(VK_SUBPASS_EXTERNAL, 0,
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eFragmentShader | vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eInputAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite,
+            vk::DependencyFlagBits::eByRegion),
+        vk::SubpassDependency(0, VK_SUBPASS_EXTERNAL,
+            vk::PipelineStageFlagBits::eColorAttachmentOutput, vk::PipelineStageFlagBits::eTransfer,
+            vk::AccessFlagBits::eColorAttachmentWrite, vk::AccessFlagBits::eTransferRead, {}),
+    };
+    composite_pass = device->createRenderPassUnique({ {}, (uint32_t)composite_attachments.size(), composite_attachments.data(),
+        1, &composite_subpass, (uint32_t)composite_dependencies.size(), composite_dependencies.data() });
+    debug_name(composite_pass, "Composite Render Pass");
+
+    // Descriptor sets
+    // The CPU path selects the instance records of the slot with the dynamic offset, the GPU-driven one uses 0
+    vk::DescriptorSetLayoutBinding gbuffer_binding(0, vk::DescriptorType::eStorageBufferDynamic, 1, vk::ShaderStageFlagBits::eVertex);
+    gbuffer_set_layout = device->createDescriptorSetLayoutUnique({ {}, 1, &gbuffer_binding });
+    debug_name(gbuffer_set_layout, "G-Buffer Descriptor Set Layout");
+    std::array<vk::DescriptorSetLayoutBinding, 6> shadow_bindings{
+        vk::DescriptorSetLayoutBinding(0, vk::DescriptorType::eAccelerationStructureKHR, 1, vk::ShaderStageFlagBits::eRaygenKHR),
+        vk::DescriptorSetLayoutBinding(1, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eRaygenKHR),
+        vk::DescriptorSetLayoutBinding(2, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eRaygenKHR),
+        vk::DescriptorSetLayoutBinding(3, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eRaygenKHR),
+        vk::DescriptorSetLayoutBinding(4, vk::DescriptorType::eUniformBufferDynamic, 1, vk::ShaderStageFlagBits::eRaygenKHR),
+        vk::DescriptorSetLayoutBinding(5, vk::DescriptorType::eStorageBufferDynamic, 1, vk::ShaderStageFlagBits::eRaygenKHR),
+    };
+    shadow_set_layout = device->createDescriptorSetLayoutUnique({ {}, (uint32_t)shadow_bindings.size(), shadow_bindings.data() });
+    debug_name(shadow_set_layout, "Shadow Rays Descriptor Set Layout");
+    std::array<vk::DescriptorSetLayoutBinding, 6> composite_bindings{
+        vk::DescriptorSetLayoutBinding(0, vk::DescriptorType::eUniformBufferDynamic, 1, vk::ShaderStageFlagBits::eFragment),
+        vk::DescriptorSetLayoutBinding(1, vk::DescriptorType::eInputAttachment, 1, vk::ShaderStageFlagBits::eFragment),
+        vk::DescriptorSetLayoutBinding(2, vk::DescriptorType::eInputAttachment, 1, vk::ShaderStageFlagBits::eFragment),
+        vk::DescriptorSetLayoutBinding(3, vk::DescriptorType::eInputAttachment, 1, vk::ShaderStageFlagBits::eFragment),
+        vk::DescriptorSetLayoutBinding(4, vk::DescriptorType::eInputAttachment, 1, vk::ShaderStageFlagBits::eFragment),
+        vk::DescriptorSetLayoutBinding(5, vk::DescriptorType::eInputAttachment, 1, vk::ShaderStageFlagBits::eFragment),
+    };
+    composite_set_layout = device->createDescriptorSetLayoutUnique({ {}, (uint32_t)composite_bindings.size(), composite_bindings.data() });
+    debug_name(composite_set_layout, "Composite Descriptor Set Layout");
+
+    // Freed with the pool
+    std::array<vk::DescriptorSetLayout, 3> set_layouts{ *gbuffer_set_layout, *shadow_set_layout, *composite_set_layout };
+    std::vector<vk::DescriptorSet> sets = device->allocateDescriptorSets({ pool, (uint32_t)set_layouts.size(), set_layouts.data() });
+    gbuffer_set = sets[0];
+    shadow_set = sets[1];
+    composite_set = sets[2];
+
+    // The images are written by resize()
+    vk::DescriptorBufferInfo instances_info(gpu_driven ? *instances.buffer : *host_instances.buffer, 0, instance_range);
+    vk::DescriptorBufferInfo comp_ubo(*uniforms.buffer, 0, uniform_buffers_comp_t::size);
+    vk::DescriptorBufferInfo ray_count = ray_counter.descriptor();
+    vk::StructureChain tlas_write(
+        vk::WriteDescriptorSet(shadow_set, 0, 0, 1, vk::DescriptorType::eAccelerationStructureKHR),
+        vk::WriteDescriptorSetAccelerationStructureKHR(1, &tlas)
+    );
+    std::array<vk::WriteDescriptorSet, 5> writes{
+        vk::WriteDescriptorSet(gbuffer_set, 0, 0, 1, vk::DescriptorType::eStorageBufferDynamic, nullptr, &instances_info),
+        tlas_write.get<vk::WriteDescriptorSet>(),
+        vk::WriteDescriptorSet(shadow_set, 4, 0, 1, vk::DescriptorType::eUniformBufferDynamic, nullptr, &comp_ubo),
+        vk::WriteDescriptorSet(shadow_set, 5, 0, 1, vk::DescriptorType::eStorageBufferDynamic, nullptr, &ray_count),
+        vk::WriteDescriptorSet(composite_set, 0, 0, 1, vk::DescriptorType::eUniformBufferDynamic, nullptr, &comp_ubo),
+    };
+    device->updateDescriptorSets(writes, nullptr);
+
+    // Pipeline layouts
+    vk::PushConstantRange view_proj_range(vk::ShaderStageFlagBits::eVertex, 0, sizeof(glm::mat4));
+    gbuffer_layout = device->createPipelineLayoutUnique({ {}, 1, &gbuffer_set_layout.get(), 1, &view_proj_range });
+    debug_name(gbuffer_layout, "G-Buffer Pipeline Layout");
+    shadow_layout = device->createPipelineLayoutUnique({ {}, 1, &shadow_set_layout.get() });
+    debug_name(shadow_layout, "Shadow Rays Pipeline Layout");
+    composite_layout = device->createPipelineLayoutUnique({ {}, 1, &composite_set_layout.get() });
+    debug_name(composite_layout, "Composite Pipeline Layout");
+
+    // G-buffer pipeline
+    // Compressed geometry has the octahedral normals in their own stream, triangle.vert decodes them
+    vk::UniqueShaderModule triangle_vert = load_shader_module(device, "triangle.vert", shader_dir);
+    vk::UniqueShaderModule triangle_frag = load_shader_module(device, "triangle.frag", shader_dir);
+    VkBool32 oct_normals = geometry.normals ? VK_TRUE : VK_FALSE;
+    vk::SpecializationMapEntry oct_normals_entry(0, 0, sizeof(VkBool32));
+    vk::SpecializationInfo vert_specialization(1, &oct_normals_entry, sizeof(oct_normals), &oct_normals);
+    std::array<vk::PipelineShaderStageCreateInfo, 2> gbuffer_stages{
+        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eVertex, *triangle_vert, "main", &vert_specialization),
+        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eFragment, *triangle_frag, "main"),
+    };
+    std::vector<vk::VertexInputBindingDescription> vertex_bindings{
+        vk::VertexInputBindingDescription(0, geometry.position_stride, vk::VertexInputRate::eVertex),
+    };
+    std::vector<vk::VertexInputAttributeDescription> vertex_attributes{
+        vk::VertexInputAttributeDescription(0, 0, geometry.position_format, 0),
+    };
+    if (geometry.normals)
+    {
+        vertex_bindings.emplace_back(1, (uint32_t)sizeof(uint32_t), vk::VertexInputRate::eVertex);
+        vertex_attributes.emplace_back(1, 1, vk::Format::eR16G16Snorm, 0);
+    }
+    else
+    {
+        vertex_attributes.emplace_back(1, 0, vk::Format::eR32G32B32Sfloat, (uint32_t)offsetof(vertex_t, nor));
+    }
+    vk::PipelineVertexInputStateCreateInfo vertex_input({}, (uint32_t)vertex_bindings.size(), vertex_bindings.data(),
+        (uint32_t)vertex_attributes.size(), vertex_attributes.data());
+    vk::PipelineInputAssemblyStateCreateInfo input_assembly({}, vk::PrimitiveTopology::eTriangleList);
+    // Viewport and scissor follow the dynamic resolution
+    vk::PipelineViewportStateCreateInfo viewport_state({}, 1, nullptr, 1, nullptr);
+    std::array<vk::DynamicState, 2> dynamic_states{ vk::DynamicState::eViewport, vk::DynamicState::eScissor };
+    vk::PipelineDynamicStateCreateInfo dynamic_state({}, (uint32_t)dynamic_states.size(), dynamic_states.data());
+    // The instances are traced with culling disabled, rasterize both faces as well
+    vk::PipelineRasterizationStateCreateInfo rasterization;
+    rasterization.cullMode = vk::CullModeFlagBits::eNone;
+    rasterization.lineWidth = 1.f;
+    vk::PipelineMultisampleStateCreateInfo multisample;
+    vk::PipelineDepthStencilStateCreateInfo depth_test({}, true, true, vk::CompareOp::eLess);
+    std::array<vk::PipelineColorBlendAttachmentState, 3> gbuffer_blend;
+    for (auto& b : gbuffer_blend)
+        b.colorWriteMask = vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
+            vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
+    vk::PipelineColorBlendStateCreateInfo gbuffer_blend_state({}, false, vk::LogicOp::eCopy,
+        (uint32_t)gbuffer_blend.size(), gbuffer_blend.data());
+
+    vk::GraphicsPipelineCreateInfo gbuffer_info;
+    gbuffer_info.stageCount = (uint32_t)gbuffer_stages.size();
+    gbuffer_info.pStages = gbuffer_stages.data();
+    gbuffer_info.pVertexInputState = &vertex_input;
+    gbuffer_info.pInputAssemblyState = &input_assembly;
+    gbuffer_info.pViewportState = &viewport_state;
+    gbuffer_info.pRasterizationState = &rasterization;
+    gbuffer_info.pMultisampleState = &multisample;
+    gbuffer_info.pDepthStencilState = &depth_test;
+    gbuffer_info.pColorBlendState = &gbuffer_blend_state;
+    gbuffer_info.pDynamicState = &dynamic_state;
+    gbuffer_info.layout = *gbuffer_layout;
+    gbuffer_info.renderPass = *gbuffer_pass;
+    gbuffer_pipeline = device->createGraphicsPipelineUnique(cache, gbuffer_info).value;
+    debug_name(gbuffer_pipeline, "G-Buffer Pipeline");
+
+    // Composite pipeline, a full screen quad without vertex input
+    vk::UniqueShaderModule composite_vert = load_shader_module(device, "composite.vert", shader_dir);
+    vk::UniqueShaderModule composite_frag = load_shader_module(device, "composite.frag", shader_dir);
+    std::array<vk::PipelineShaderStageCreateInfo, 2> composite_stages{
+        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eVertex, *composite_vert, "main"),
+        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eFragment, *composite_frag, "main"),
+    };
+    vk::PipelineVertexInputStateCreateInfo no_vertex_input;
+    vk::PipelineDepthStencilStateCreateInfo no_depth_test;
+    vk::PipelineColorBlendStateCreateInfo composite_blend_state({}, false, vk::LogicOp::eCopy, 1, gbuffer_blend.data());
+    vk::GraphicsPipelineCreateInfo composite_info = gbuffer_info;
+    composite_info.stageCount = (uint32_t)composite_stages.size();
+    composite_info.pStages = composite_stages.data();
+    composite_info.pVertexInputState = &no_vertex_input;
+    composite_info.pDepthStencilState = &no_depth_test;
+    composite_info.pColorBlendState = &composite_blend_state;
+    composite_info.layout = *composite_layout;
+    composite_info.renderPass = *composite_pass;
+    composite_pipeline = device->createGraphicsPipelineUnique(cache, composite_info).value;
+    debug_name(composite_pipeline, "Composite Pipeline");
+
+    // Shadow rays pipeline, no hit shader: the rays skip the closest hit and stop at the first hit
+    vk::UniqueShaderModule shadow_rgen = load_shader_module(device, "shadow.rgen", shader_dir);
+    vk::UniqueShaderModule shadow_rmiss = load_shader_module(device, "shadow.rmiss", shader_dir);
+    std::array<vk::PipelineShaderStageCreateInfo, 2> shadow_stages{
+        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eRaygenKHR, *shadow_rgen, "main"),
+        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eMissKHR, *shadow_rmiss, "main"),
+    };
+    std::array<vk::RayTracingShaderGroupCreateInfoKHR, 2> shadow_groups{
+        vk::RayTracingShaderGroupCreateInfoKHR(vk::RayTracingShaderGroupTypeKHR::eGeneral,
+            0, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR),
+        vk::RayTracingShaderGroupCreateInfoKHR(vk::RayTracingShaderGroupTypeKHR::eGeneral,
+            1, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR),
+    };
+    vk::RayTracingPipelineCreateInfoKHR shadow_info;
+    shadow_info.stageCount = (uint32_t)shadow_stages.size();
+    shadow_info.pStages = shadow_stages.data();
+    shadow_info.groupCount = (uint32_t)shadow_groups.size();
+    shadow_info.pGroups = shadow_groups.data();
+    shadow_info.maxRecursionDepth = 1;
+    shadow_info.layout = *shadow_layout;
+    shadow_pipeline = device->createRayTracingPipelineKHRUnique(cache, shadow_info).value;
+    debug_name(shadow_pipeline, "Shadow Rays Pipeline");
+
+    sbt_builder_t sbt_builder;
+    sbt_builder.add(sbt_region_t::raygen, 0);
+    sbt_builder.add(sbt_region_t::miss, 1);
+    sbt = sbt_builder.build(allocator, physical_device, *shadow_pipeline, (uint32_t)shadow_groups.size(), queue, cmdpool, "Shadow Rays");
+
+    if (!gpu_driven)
+        return;
+
+    // Static draw records, the 32-bit index draws first so each index type owns a contiguous command range
+    std::vector<draw_record_t> records;
+    for (const draw_t& d : draws)
+    {
+        records.push_back({ d.dequant, d.col, d.bounds.lo, d.node, d.bounds.hi, d.index_count, d.first_index,
+            d.vertex_offset, d.index_type == vk::IndexType::eUint16 ? 1u : 0u, 0 });
+    }
+    draw_records = create_buffer(allocator, "Cull Draws Buffer", sizeof(draw_record_t) * draw_count,
+        vk::BufferUsageFlagBits::eStorageBuffer, memory_usage_t::upload);
+    std::copy_n(reinterpret_cast<const uint8_t*>(records.data()), records.size() * sizeof(draw_record_t), draw_records.mem.mapped);
+
+    vk::DeviceSize node_range = sizeof(glm::mat4) * std::max(node_count, 1u);
+    node_slot_stride = (node_range + ssbo_alignment - 1) & ~(ssbo_alignment - 1);
+    node_buffer = create_buffer(allocator, "Cull Nodes Buffer", node_slot_stride * slots,
+        vk::BufferUsageFlagBits::eStorageBuffer, memory_usage_t::upload);
+    commands = create_buffer(allocator, "Indirect Commands Buffer", sizeof(vk::DrawIndexedIndirectCommand) * draw_count,
+        vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer, memory_usage_t::device_local);
+    counts = create_buffer(allocator, "Indirect Counts Buffer", sizeof(uint32_t) * 2,
+        vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eTransferDst,
+        memory_usage_t::device_local);
+    cull_push.resize(slots);
+
+    std::array<vk::DescriptorSetLayoutBinding, 5> cull_bindings{
+        vk::DescriptorSetLayoutBinding(0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(1, vk::DescriptorType::eStorageBufferDynamic, 1, vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(3, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(4, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute),
+    };
+    cull_set_layout = device->createDescriptorSetLayoutUnique({ {}, (uint32_t)cull_bindings.size(), cull_bindings.data() });
+    debug_name(cull_set_layout, "Cull Descriptor Set Layout");
+    cull_set = device->allocateDescriptorSets({ pool, 1, &cull_set_layout.get() })[0];
+    vk::DescriptorBufferInfo draws_info(*draw_records.buffer, 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo nodes_info(*node_buffer.buffer, 0, node_range);
+    vk::DescriptorBufferInfo commands_info(*commands.buffer, 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo counts_info(*counts.buffer, 0, VK_WHOLE_SIZE);
+    std::array<vk::WriteDescriptorSet, 5> cull_writes{
+        vk::WriteDescriptorSet(cull_set, 0, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &draws_info),
+        vk::WriteDescriptorSet(cull_set, 1, 0, 1, vk::DescriptorType::eStorageBufferDynamic, nullptr, &nodes_info),
+        vk::WriteDescriptorSet(cull_set, 2, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &commands_info),
+        vk::WriteDescriptorSet(cull_set, 3, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &counts_info),
+        vk::WriteDescriptorSet(cull_set, 4, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &instances_info),
+    };
+    device->updateDescriptorSets(cull_writes, nullptr);
+
+    vk::PushConstantRange cull_range(vk::ShaderStageFlagBits::eCompute, 0, sizeof(cull_push_t));
+    cull_layout = device->createPipelineLayoutUnique({ {}, 1, &cull_set_layout.get(), 1, &cull_range });
+    debug_name(cull_layout, "Cull Pipeline Layout");
+
+    vk::UniqueShaderModule cull_comp = load_shader_module(device, "cull.comp", shader_dir);
+    vk::ComputePipelineCreateInfo cull_info({},
+        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eCompute, *cull_comp, "main"), *cull_layout);
+    cull_pipeline = device->createComputePipelineUnique(cache, cull_info).value;
+    debug_name(cull_pipeline, "Cull Pipeline");
+}
+
+hybrid_render_t::target_t hybrid_render_t::create_target(const std::string& name, glm::uvec2 size, vk::Format format, vk::ImageUsageFlags usage)
+{
+    target_t t;
+    vk::ImageCreateInfo info;
+    info.imageType = vk::ImageType::e2D;
+    info.format = format;
+    info.extent = vk::Extent3D(size.x, size.y, 1);
+    info.mipLevels = 1;
+    info.arrayLayers = 1;
+    info.samples = vk::SampleCountFlagBits::e1;
+    info.tiling = vk::ImageTiling::eOptimal;
+    info.usage = usage | vk::ImageUsageFlagBits::eInputAttachment;
+    info.initialLayout = vk::ImageLayout::eUndefined;
+    t.image = device->createImageUnique(info);
+    debug_name(t.image, name + " Image");
+    t.mem = allocator.bind(*t.image, memory_usage_t::device_local);
+    bool is_depth = (bool)(usage & vk::ImageUsageFlagBits::eDepthStencilAttachment);
+    vk::ImageSubresourceRange range(is_depth ? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+    t.view = device->createImageViewUnique({ {}, *t.image, vk::ImageViewType::e2D, format, {}, range });
+    debug_name(t.view, name + " View");
+    return t;
+}
+
+void hybrid_render_t::resize(glm::uvec2 size, vk::ImageView output)
+{
+    composite_framebuffer.reset();
+    gbuffer_framebuffer.reset();
+    pos = create_target("GBufferPOS", size, vk::Format::eR32G32B32A32Sfloat,
+        vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eStorage);
+    nor = create_target("GBufferNOR", size, vk::Format::eR16G16B16A16Sfloat,
+        vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eStorage);
+    alb = create_target("GBufferALB", size, vk::Format::eR8G8B8A8Unorm, vk::ImageUsageFlagBits::eColorAttachment);
+    depth = create_target("GBufferDepth", size, depth_format, vk::ImageUsageFlagBits::eDepthStencilAttachment);
+    shadow = create_target("Shadow Mask", size, vk::Format::eR32Sfloat, vk::ImageUsageFlagBits::eStorage);
+
+    std::array<vk::ImageView, 4> gbuffer_views{ *pos.view, *nor.view, *alb.view, *depth.view };
+    gbuffer_framebuffer = device->createFramebufferUnique({ {}, *gbuffer_pass,
+        (uint32_t)gbuffer_views.size(), gbuffer_views.data(), size.x, size.y, 1 });
+    debug_name(gbuffer_framebuffer, "G-Buffer Framebuffer");
+    std::array<vk::ImageView, 6> composite_views{ output, *depth.view, *pos.view, *nor.view, *alb.view, *shadow.view };
+    composite_framebuffer = device->createFramebufferUnique({ {}, *composite_pass,
+        (uint32_t)composite_views.size(), composite_views.data(), size.x, size.y, 1 });
+    debug_name(composite_framebuffer, "Composite Framebuffer");
+
+    vk::DescriptorImageInfo pos_storage(nullptr, *pos.view, vk::ImageLayout::eGeneral);
+    vk::DescriptorImageInfo nor_storage(nullptr, *nor.view, vk::ImageLayout::eGeneral);
+    vk::DescriptorImageInfo shadow_storage(nullptr, *shadow.view, vk::ImageLayout::eGeneral);
+    vk::DescriptorImageInfo depth_input(nullptr, *depth.view, vk::ImageLayout::eDepthStencilReadOnlyOptimal);
+    vk::DescriptorImageInfo alb_input(nullptr, *alb.view, vk::ImageLayout::eShaderReadOnlyOptimal);
+    std::array<vk::WriteDescriptorSet, 8> writes{
+        vk::WriteDescriptorSet(shadow_set, 1, 0, 1, vk::DescriptorType::eStorageImage, &pos_storage),
+        vk::WriteDescriptorSet(shadow_set, 2, 0, 1, vk::DescriptorType::eStorageImage, &nor_storage),
+        vk::WriteDescriptorSet(shadow_set, 3, 0, 1, vk::DescriptorType::eStorageImage, &shadow_storage),
+        vk::WriteDescriptorSet(composite_set, 1, 0, 1, vk::DescriptorType::eInputAttachment, &depth_input),
+        vk::WriteDescriptorSet(composite_set, 2, 0, 1, vk::DescriptorType::eInputAttachment, &pos_storage),
+        vk::WriteDescriptorSet(composite_set, 3, 0, 1, vk::DescriptorType::eInputAttachment, &nor_storage),
+        vk::WriteDescriptorSet(composite_set, 4, 0, 1, vk::DescriptorType::eInputAttachment, &alb_input),
+        vk::WriteDescriptorSet(composite_set, 5, 0, 1, vk::DescriptorType::eInputAttachment, &shadow_storage),
+    };
+    device->updateDescriptorSets(writes, nullptr);
+}
+
+void hybrid_render_t::update(uint32_t slot, const glm::mat4& view, const glm::mat4& proj, glm::vec3 camera, glm::vec3 light_pos,
+    std::span<const glm::mat4> node_mats, bool show_gbuffer)
+{
+    view_proj[slot] = proj * view;
+    if (gpu_driven)
+    {
+        std::copy_n(reinterpret_cast<const uint8_t*>(node_mats.data()), node_count * sizeof(glm::mat4),
+            node_buffer.mem.mapped + slot * node_slot_stride);
+        cull_push[slot] = { frustum_planes(view_proj[slot]), (uint32_t)draws.size(), draws32 };
+    }
+    else
+    {
+        auto* records = reinterpret_cast<instance_record_t*>(host_instances.mem.mapped + slot * instance_slot_stride);
+        for (size_t i = 0; i < draws.size(); i++)
+            records[i] = { node_mats[draws[i].node], draws[i].dequant, draws[i].col };
+    }
+    auto* comp = reinterpret_cast<uniform_buffers_comp_t*>(uniforms.mem.mapped + slot * slot_stride);
+    comp->camera = glm::vec4(camera, show_gbuffer ? 1.f : 0.f);
+    comp->light_pos = glm::vec4(light_pos, 1.f);
+}
+
+void hybrid_render_t::record(const vk::UniqueCommandBuffer& cmd, uint32_t slot, glm::uvec2 size, gpu_profiler_t* profiler)
+{
+    uint32_t comp_offset = (uint32_t)(slot * slot_stride);
+    vk::Rect2D area({ 0, 0 }, { size.x, size.y });
+    vk::Viewport viewport(0.f, 0.f, (float)size.x, (float)size.y, 0.f, 1.f);
+
+    // Frustum culling, writes the indirect commands and the instance records of the visible draws
+    if (gpu_driven)
+    {
+        gpu_scope_t scope(cmd, profiler, slot, "Cull");
+        // The previous frame may still be drawing from the commands
+        vk::MemoryBarrier reuse(vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead,
+            vk::AccessFlagBits::eTransferWrite | vk::AccessFlagBits::eShaderWrite);
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexShader,
+            vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eComputeShader, {}, reuse, nullptr, nullptr);
+        cmd->fillBuffer(*counts.buffer, 0, VK_WHOLE_SIZE, 0);
+        vk::MemoryBarrier cleared(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader, {}, cleared, nullptr, nullptr);
+        cmd->bindPipeline(vk::PipelineBindPoint::eCompute, *cull_pipeline);
+        cmd->bindDescriptorSets(vk::PipelineBindPoint::eCompute, *cull_layout, 0, cull_set, (uint32_t)(slot * node_slot_stride));
+        cmd->pushConstants<cull_push_t>(*cull_layout, vk::ShaderStageFlagBits::eCompute, 0, cull_push[slot]);
+        cmd->dispatch(((uint32_t)draws.size() + 63) / 64, 1, 1);
+        vk::MemoryBarrier culled(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead);
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+            vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexShader, {}, culled, nullptr, nullptr);
+    }
+
+    // Primary visibility
+    {
+        gpu_scope_t scope(cmd, profiler, slot, "G-Buffer");
+        std::array<vk::ClearValue, 4> clear_values{
+            vk::ClearColorValue(std::array<float, 4>{ 0.f, 0.f, 0.f, 0.f }),    // pos.w = 0 marks the background
+            vk::ClearColorValue(std::array<float, 4>{ 0.f, 0.f, 0.f, 0.f }),
+            vk::ClearColorValue(std::array<float, 4>{ 0.f, 0.f, 0.f, 0.f }),
+            vk::ClearDepthStencilValue(1.f, 0),
+        };
+        cmd->beginRenderPass({ *gbuffer_pass, *gbuffer_framebuffer, area, (uint32_t)clear_values.size(), clear_values.data() },
+            vk::SubpassContents::eInline);
+        cmd->bindPipeline(vk::PipelineBindPoint::eGraphics, *gbuffer_pipeline);
+        cmd->setViewport(0, viewport);
+        cmd->setScissor(0, area);
+        vk::DeviceSize vertex_offset = 0;
+        cmd->bindVertexBuffers(0, geometry.positions, vertex_offset);
+        if (geometry.normals)
+            cmd->bindVertexBuffers(1, geometry.normals, vertex_offset);
+        uint32_t instance_offset = gpu_driven ? 0 : (uint32_t)(slot * instance_slot_stride);
+        cmd->bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *gbuffer_layout, 0, gbuffer_set, instance_offset);
+        cmd->pushConstants<glm::mat4>(*gbuffer_layout, vk::ShaderStageFlagBits::eVertex, 0, view_proj[slot]);
+        if (gpu_driven)
+        {
+            // One call per index type, the counts were written by the cull pass
+            constexpr uint32_t command_stride = sizeof(vk::DrawIndexedIndirectCommand);
+            uint32_t draws16 = (uint32_t)draws.size() - draws32;
+            if (draws32 > 0)
+            {
+                cmd->bindIndexBuffer(geometry.indices, 0, vk::IndexType::eUint32);
+                cmd->drawIndexedIndirectCount(*commands.buffer, 0, *counts.buffer, 0, draws32, command_stride);
+            }
+            if (draws16 > 0)
+            {
+                cmd->bindIndexBuffer(geometry.indices, 0, vk::IndexType::eUint16);
+                cmd->drawIndexedIndirectCount(*commands.buffer, draws32 * command_stride, *counts.buffer, sizeof(uint32_t),
+                    draws16, command_stride);
+            }
+        }
+        else
+        {
+            // The draw index selects the instance record
+            for (uint32_t i = 0; i < draws.size(); i++)
+            {
+                const draw_t& d = draws[i];
+                if (i == 0 || d.index_type != draws[i - 1].index_type)
+                    cmd->bindIndexBuffer(geometry.indices, 0, d.index_type);
+                cmd->drawIndexed(d.index_count, 1, d.first_index, d.vertex_offset, i);
+            }
+        }
+        cmd->endRenderPass();
+    }
+
+    // Secondary rays
+    {
+        gpu_scope_t scope(cmd, profiler, slot, "Shadow Rays");
+        vk::ImageMemoryBarrier barrier;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.subresourceRange = vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+        barrier.image = *shadow.image;
+        barrier.srcAccessMask = {};
+        barrier.dstAccessMask = vk::AccessFlagBits::eShaderWrite;
+        barrier.oldLayout = vk::ImageLayout::eUndefined;
+        barrier.newLayout = vk::ImageLayout::eGeneral;
+        // The composite of the previous frame may still be reading the mask
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eFragmentShader, vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+            vk::DependencyFlagBits::eByRegion, nullptr, nullptr, barrier);
+        cmd->bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, *shadow_pipeline);
+        std::array<uint32_t, 2> shadow_offsets{ comp_offset, ray_counter_t::offset(slot) };
+        cmd->bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, *shadow_layout, 0, shadow_set, shadow_offsets);
+        cmd->traceRaysKHR(sbt.regions[0], sbt.regions[1], sbt.regions[2], sbt.regions[3], size.x, size.y, 1);
+    }
+
+    // Shading
+    {
+        gpu_scope_t scope(cmd, profiler, slot, "Composite");
+        cmd->beginRenderPass({ *composite_pass, *composite_framebuffer, area }, vk::SubpassContents::eInline);
+        cmd->bindPipeline(vk::PipelineBindPoint::eGraphics, *composite_pipeline);
+        cmd->setViewport(0, viewport);
+        cmd->setScissor(0, area);
+        cmd->bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *composite_layout, 0, composite_set, comp_offset);
+        cmd->draw(6, 1, 0, 0);
+        cmd->endRenderPass();
+    }
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include <array>
+#include <span>
+#include <string>
+#include <vector>
+#include "memory.h"
+#include "scene.h"
+#include "gpu_profiler.h"
+#include "ray_counter.h"
+#include "sbt_builder.h"
+
+// composite.frag and shadow.rgen, one per frame in flight
+struct uniform_buffers_comp_t
+{
+    glm::vec4 camera;       // w != 0 shows the G-buffer channels at the top of the image
+    glm::vec4 light_pos;
+    static constexpr uint32_t size = sizeof(camera) + sizeof(light_pos);
+    uint8_t pad3[0x100 - size & ~0x100]; // alignment
+};
+
+// The merged buffers uploaded for the BLAS builds, owned by the graphics queue family
+struct hybrid_geometry_t
+{
+    vk::Buffer positions;
+    vk::Format position_format;
+    uint32_t position_stride;
+    vk::Buffer normals;         // octahedral, null when the normals are interleaved with the positions
+    vk::Buffer indices;
+};
+
+// Hybrid primary visibility: the nodes are rasterized into a G-buffer (position, normal, albedo,
+// depth), one shadow ray per covered pixel is traced from it toward the light, then composite.frag
+// shades the pixels into the output image. The output is left in eTransferSrcOptimal.
+// The draws read their transform and color from a packed instance table through the first instance.
+// GPU-driven mode replaces the per-draw CPU loop: cull.comp tests the bounds of every mesh instance
+// against the frustum and writes the indirect commands and the instance records of the visible
+// ones, then a single drawIndexedIndirectCount per index type draws them.
+class hybrid_render_t
+{
+    struct target_t
+    {
+        vk::UniqueImage image;
+        allocation_t mem;
+        vk::UniqueImageView view;
+    };
+    struct draw_t
+    {
+        uint32_t node;
+        uint32_t index_count;
+        vk::IndexType index_type;
+        uint32_t first_index;
+        int32_t vertex_offset;
+        glm::mat4 dequant;
+        glm::vec4 col;
+        aabb_t bounds;                  // mesh space
+    };
+    // draw_t in cull.comp, std430
+    struct draw_record_t
+    {
+        glm::mat4 dequant;
+        glm::vec4 col;
+        glm::vec3 lo;
+        uint32_t node;
+        glm::vec3 hi;
+        uint32_t index_count;
+        uint32_t first_index;
+        int32_t vertex_offset;
+        uint32_t index_type;            // 0: 32-bit, 1: 16-bit
+        uint32_t pad;
+    };
+    // instance_t in cull.comp and triangle.vert
+    struct instance_record_t
+    {
+        glm::mat4 model;
+        glm::mat4 dequant;
+        glm::vec4 col;
+    };
+    struct cull_push_t
+    {
+        std::array<glm::vec4, 6> planes;
+        uint32_t draw_count;
+        uint32_t base16;
+    };
+
+    memory_allocator_t& allocator;
+    const vk::UniqueDevice& device;
+    hybrid_geometry_t geometry;
+    std::vector<draw_t> draws;              // 32-bit index draws first
+    uint32_t draws32 = 0;
+    uint32_t node_count = 0;
+    bool gpu_driven = false;
+    vk::Format depth_format = vk::Format::eD32Sfloat;
+
+    // Per slot: the composite uniforms
+    buffer_t uniforms;
+    vk::DeviceSize slot_stride = 0;
+    // Per slot: one instance record per draw, written by update() when the draws are recorded on the CPU
+    buffer_t host_instances;
+    vk::DeviceSize instance_slot_stride = 0;
+    std::vector<glm::mat4> view_proj;       // per slot
+
+    target_t pos, nor, alb, depth, shadow;
+    vk::UniqueRenderPass gbuffer_pass;
+    vk::UniqueRenderPass composite_pass;
+    vk::UniqueFramebuffer gbuffer_framebuffer;
+    vk::UniqueFramebuffer composite_framebuffer;
+
+    vk::UniqueDescriptorSetLayout gbuffer_set_layout;
+    vk::UniqueDescriptorSetLayout shadow_set_layout;
+    vk::UniqueDescriptorSetLayout composite_set_layout;
+    vk::DescriptorSet gbuffer_set;
+    vk::DescriptorSet shadow_set;
+    vk::DescriptorSet composite_set;
+    vk::UniquePipelineLayout gbuffer_layout;
+    vk::UniquePipelineLayout shadow_layout;
+    vk::UniquePipelineLayout composite_layout;
+    vk::UniquePipeline gbuffer_pipeline;
+    vk::UniquePipeline shadow_pipeline;
+    vk::UniquePipeline composite_pipeline;
+    sbt_t sbt;
+
+    // GPU-driven
+    buffer_t draw_records;                  // static, read once per frame
+    buffer_t node_buffer;                   // node transforms, one section per slot
+    vk::DeviceSize node_slot_stride = 0;
+    buffer_t commands;
+    buffer_t counts;
+    buffer_t instances;
+    std::vector<cull_push_t> cull_push;     // per slot
+    vk::UniqueDescriptorSetLayout cull_set_layout;
+    vk::DescriptorSet cull_set;
+    vk::UniquePipelineLayout cull_layout;
+    vk::UniquePipeline cull_pipeline;
+
+    target_t create_target(const std::string& name, glm::uvec2 size, vk::Format format, vk::ImageUsageFlags usage);
+public:
+    // The descriptor sets come from pool, it must have room for the three of them, plus one in GPU-driven
+    // mode which needs the drawIndirectCount, multiDrawIndirect and drawIndirectFirstInstance features.
+    // The shader binding table is uploaded with a one time command on queue. The shadow rays are
+    // counted in the region of the slot of ray_counter, reset and copied by the caller.
+    hybrid_render_t(memory_allocator_t& allocator, vk::PhysicalDevice physical_device, vk::PipelineCache cache,
+        vk::DescriptorPool pool, vk::Queue queue, vk::CommandPool cmdpool, const std::string& shader_dir,
+        const hybrid_geometry_t& geometry, const std::vector<mesh_t>& meshes, const std::vector<node_t>& nodes,
+        vk::AccelerationStructureKHR tlas, const ray_counter_t& ray_counter, uint32_t slots, bool gpu_driven);
+    // (Re)create the G-buffer and the framebuffers, output must be an RGBA8 color attachment of the same size
+    void resize(glm::uvec2 size, vk::ImageView output);
+    // Camera and node transforms of the frame, proj must map the depth to [0, 1]
+    void update(uint32_t slot, const glm::mat4& view, const glm::mat4& proj, glm::vec3 camera, glm::vec3 light_pos,
+        std::span<const glm::mat4> node_mats, bool show_gbuffer);
+    // G-buffer, shadow rays and composite of the top-left size pixels
+    void record(const vk::UniqueCommandBuffer& cmd, uint32_t slot, glm::uvec2 size, gpu_profiler_t* profiler);
+};
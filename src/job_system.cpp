@@ -0,0 +1,106 @@
+#include "pch.h"
+#include "cpu_profiler.h"
+#include "job_system.h"
+
+job_system_t::job_system_t(uint32_t thread_count)
+{
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    for (uint32_t i = 0; i < thread_count + 1; i++)
+        queues.push_back(std::make_unique<queue_t>());
+    for (uint32_t i = 0; i < thread_count; i++)
+        threads.emplace_back(&job_system_t::worker, this, i);
+}
+
+job_system_t::~job_system_t()
+{
+    {
+        std::lock_guard lock(wake_mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+bool job_system_t::try_run(uint32_t self)
+{
+    std::function<void()> job;
+    {
+        std::lock_guard lock(queues[self]->mutex);
+        if (!queues[self]->jobs.empty())
+        {
+            job = std::move(queues[self]->jobs.back());
+            queues[self]->jobs.pop_back();
+        }
+    }
+    for (uint32_t i = 1; i < queues.size() && !job; i++)
+    {
+        queue_t& victim = *queues[(self + i) % queues.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.jobs.empty())
+        {
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+        }
+    }
+    if (!job)
+        return false;
+    queued--;
+    CPU_ZONE("Job");
+    job();
+    return true;
+}
+
+void job_system_t::worker(uint32_t self)
+{
+    cpu_profiler_thread_name(fmt::format("Worker#{}", self).c_str());
+    while (true)
+    {
+        if (try_run(self))
+            continue;
+        std::unique_lock lock(wake_mutex);
+        wake.wait(lock, [this] { return queued > 0 || stop; });
+        if (stop)
+            return;
+    }
+}
+
+void job_system_t::parallel_for(uint32_t count, const std::function<void(uint32_t)>& fn)
+{
+    std::atomic<uint32_t> remaining = count;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    // Count the jobs before they are visible so that a thief never takes the counter below zero
+    {
+        std::lock_guard lock(wake_mutex);
+        queued += count;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        queue_t& q = *queues[i % queues.size()];
+        std::lock_guard lock(q.mutex);
+        q.jobs.emplace_back([&, i]
+        {
+            try
+            {
+                fn(i);
+            }
+            catch (...)
+            {
+                std::lock_guard lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+            remaining--;
+        });
+    }
+    wake.notify_all();
+
+    uint32_t self = (uint32_t)queues.size() - 1;
+    while (remaining > 0)
+        if (!try_run(self))
+            std::this_thread::yield();
+    if (error)
+        std::rethrow_exception(error);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool: every worker owns a deque, it pops its own jobs from the back
+// and steals from the front of the others when it runs dry. The thread calling parallel_for
+// takes part in the work until all the jobs are done.
+class job_system_t
+{
+    struct queue_t
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+    };
+    std::vector<std::unique_ptr<queue_t>> queues;     // one per worker plus one for the caller
+    std::vector<std::thread> threads;
+    std::atomic<uint32_t> queued = 0;
+    std::atomic<bool> stop = false;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+
+    bool try_run(uint32_t self);
+    void worker(uint32_t self);
+public:
+    // 0 threads = one per hardware thread, minus the caller
+    explicit job_system_t(uint32_t thread_count = 0);
+    job_system_t(const job_system_t&) = delete;
+    ~job_system_t();
+    uint32_t size() const { return (uint32_t)queues.size(); }
+    // Run fn(0..count-1) and wait, the first exception thrown by a job is rethrown
+    void parallel_for(uint32_t count, const std::function<void(uint32_t)>& fn);
+};
@@ -1,60 +1,141 @@
 #include "pch.h"
 #include "debug_message.h"
+#include "options.h"
+#include "benchmark.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "geometry_codec.h"
+#include "pipeline_cache.h"
+#include "shader_registry.h"
+#include "tlas_refit.h"
+#include "as_builder.h"
+#include "gpu_profiler.h"
+#include "cpu_profiler.h"
+#include "dynamic_resolution.h"
+#include "tiled_render.h"
+#include "swapchain.h"
+#include "hybrid_render.h"
+#include "ray_counter.h"
+#include "sbt_builder.h"
+#include "memory.h"
+#include "uploader.h"
+#include "cpu_tracer.h"
+#include <future>
+#include <optional>
 
 static bool running = true;
+static bool window_resized = false;
+static bool cycle_present_mode = false;
+static options_t options;
 
 static vk::UniqueInstance instance;
 static vk::UniqueSurfaceKHR surface;
 static vk::UniqueDevice device;
+static std::unique_ptr<memory_allocator_t> allocator;
+static std::unique_ptr<pipeline_cache_t> pipeline_cache;
+static std::unique_ptr<gpu_profiler_t> gpu_profiler;
 static vk::UniqueCommandPool cmdpool;
 static vk::UniqueDescriptorPool descrpool;
 
 static uint32_t device_family = 0;
+static uint32_t transfer_family = 0;     // same as device_family when there is no dedicated transfer queue
+static uint32_t compute_family = 0;      // same as device_family when there is no async compute queue
 static vk::PhysicalDevice physical_device;
 static vk::Queue q;
+static vk::Queue transfer_q;
+static vk::Queue compute_q;             // acceleration structure builds and compaction
+static vk::UniqueCommandPool compute_cmdpool;
+static uint32_t build_queue_index = 0;  // queue of transfer_q and compute_q when their family is device_family
+static bool gpu_driven_draws = false;   // drawIndirectCount, multiDrawIndirect and drawIndirectFirstInstance enabled
+static bool ray_query_support = false;  // rayQuery enabled, trace.comp can replace the RT pipeline
 
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE;
 
-struct uniform_buffers_t
-{
-    glm::mat4 model;
-    glm::mat4 view;
-    glm::mat4 proj;
-    static constexpr uint32_t mvp_size = sizeof(model) + sizeof(view) + sizeof(proj);
-    uint8_t pad2[0x100 - mvp_size & ~0x100]; // alignment
-    
-    glm::vec4 col;
-    uint8_t pad3[0x100 - sizeof(col) & ~0x100]; // alignment
-};
-
-struct uniform_buffers_comp_t
-{
-    glm::vec4 camera;
-    glm::vec4 light_pos;
-    static constexpr uint32_t size = sizeof(camera) + sizeof(light_pos);
-    uint8_t pad3[0x100 - size & ~0x100]; // alignment
-};
-
 struct uniform_rt_buffers_t
 {
     glm::mat4 view_inverse;
     glm::mat4 proj_inverse;
     glm::vec4 color;
-    static constexpr uint32_t rgen_size = sizeof(view_inverse) + sizeof(proj_inverse);
+    static constexpr uint32_t rgen_size = sizeof(view_inverse) + sizeof(proj_inverse) + sizeof(color);
     uint8_t pad1[0x100 - rgen_size & ~0x100]; // alignment
 
     glm::vec4 light_pos;
     static constexpr uint32_t rhit_size = sizeof(light_pos);
     static constexpr uint32_t rhit_offset = rgen_size + sizeof(pad1);
-    uint8_t pad2[0x100 - rgen_size & ~0x100]; // alignment
+    uint8_t pad2[0x100 - rhit_size & ~0x100]; // alignment
+};
+
+// trace.rchit, one per TLAS instance indexed by instanceCustomIndex, std430
+struct instance_data_t
+{
+    uint32_t first_index;           // in the merged index buffer, in units of the index type
+    int32_t vertex_offset;
+    uint32_t index_type;            // 0: 32-bit, 1: 16-bit
+    uint32_t pad0;
+    glm::vec3 normal_scale;         // transpose of the dequantization, keeps the normals out of the quantized space
+    uint32_t pad1;
+};
+
+// trace.rchit shaderRecordEXT, inline data of the hit records selected by instanceShaderBindingTableRecordOffset.
+// trace.comp reads the same records from a storage buffer.
+struct material_t
+{
+    glm::vec4 col;
+};
+
+// Orbit camera and light, the rasterized passes of the hybrid mode use the matrices directly
+struct camera_t
+{
+    glm::vec3 pos;
+    glm::vec3 light_pos;
+    glm::mat4 view;
+    glm::mat4 proj;
+};
+
+static camera_t orbit_camera(float angle, float aspect)
+{
+    camera_t cam;
+    cam.pos = glm::vec3(glm::cos(angle * 0.1f), 0.5f, glm::sin(angle * 0.1f)) * 3.f;
+    cam.light_pos = glm::vec3(glm::cos(angle), 0.3f, glm::sin(angle)) * 5.f;
+    cam.proj = glm::perspective(glm::radians(85.f), aspect, .1f, 100.f);
+    cam.view = glm::lookAt(cam.pos, glm::vec3(0, 0, 0), glm::vec3(0, -1, 0));
+    return cam;
+}
+
+// Camera angle of the offline still, shared by the GPU render and the CPU reference
+static const float still_angle = glm::radians(1.f);
+
+// Per-slot objects of the frames-in-flight ring, a slot is reused only after its fence is signaled
+struct frame_t
+{
+    vk::UniqueCommandPool cmdpool;
+    vk::UniqueCommandBuffer cmd;
+    vk::UniqueSemaphore acquire_sem;
+    vk::UniqueSemaphore render_sem;
+    vk::UniqueFence fence;
+    uniform_rt_buffers_t* uniforms = nullptr;   // persistently mapped slice
+    uint32_t uniform_offset = 0;
+    bool pending = false;
+    double cpu_ms = 0.0;
+    glm::uvec2 traced_size{ 0 };                // sub-rectangle of rt_output traced by this frame
+    std::chrono::high_resolution_clock::time_point input_time;  // when the camera was sampled
+    bool latency_pending = false;
 };
 
+#ifdef _WIN32
 LRESULT WINAPI main_window_proc(HWND hWnd, UINT msg, WPARAM wp, LPARAM lp)
 {
     switch (msg)
     {
     case WM_CREATE:
         return 0;
+    case WM_SIZE:
+        window_resized = true;
+        break;
+    case WM_KEYDOWN:
+        if (wp == 'P')
+            cycle_present_mode = true;
+        break;
     case WM_DESTROY:
         device->waitIdle();
         running = false;
@@ -64,73 +145,156 @@ LRESULT WINAPI main_window_proc(HWND hWnd, UINT msg, WPARAM wp, LPARAM lp)
     }
     return DefWindowProc(hWnd, msg, wp, lp);
 }
+#endif
 
-void find_device()
+bool has_extension(const vk::PhysicalDevice& pd, const char* name)
+{
+    for (auto ext : pd.enumerateDeviceExtensionProperties())
+        if (strcmp(ext.extensionName, name) == 0)
+            return true;
+    return false;
+}
+
+int device_rank(vk::PhysicalDeviceType type)
+{
+    switch (type)
+    {
+    case vk::PhysicalDeviceType::eDiscreteGpu:
+        return 0;
+    case vk::PhysicalDeviceType::eIntegratedGpu:
+        return 1;
+    case vk::PhysicalDeviceType::eVirtualGpu:
+        return 2;
+    case vk::PhysicalDeviceType::eCpu:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+// False when no device can trace rays, the frames then fall back to the CPU tracer
+bool find_device()
 {
-    uint32_t device_family = 0;
     std::vector<vk::PhysicalDevice> physical_devices = instance->enumeratePhysicalDevices();
+    // Headless runs accept any device type (integrated, software rasterizers such as lavapipe)
+    // but still prefer a discrete GPU when there is one
+    std::stable_sort(physical_devices.begin(), physical_devices.end(), 
+        [](const vk::PhysicalDevice& a, const vk::PhysicalDevice& b) {
+            return device_rank(a.getProperties().deviceType) < device_rank(b.getProperties().deviceType);
+        });
     for (const auto& pd : physical_devices)
     {
         auto pd_props = pd.getProperties();
+        if (!options.headless && pd_props.deviceType != vk::PhysicalDeviceType::eDiscreteGpu)
+            continue;
+        // Software devices such as lavapipe have no ray tracing, they get the CPU fallback below
+        if (!has_extension(pd, VK_KHR_RAY_TRACING_EXTENSION_NAME))
+        {
+            std::cout << fmt::format("Device {} ({}): {} not supported\n", pd_props.deviceName,
+                vk::to_string(pd_props.deviceType), VK_KHR_RAY_TRACING_EXTENSION_NAME);
+            continue;
+        }
         auto props = pd.getQueueFamilyProperties();
         for (int family_index = 0; family_index < props.size(); family_index++)
         {
             bool support_graphics = (bool)(props[family_index].queueFlags & vk::QueueFlagBits::eGraphics);
-            bool support_present = pd.getSurfaceSupportKHR(family_index, *surface);
-            if (support_graphics && support_present && pd_props.deviceType == vk::PhysicalDeviceType::eDiscreteGpu)
+            bool support_present = options.headless || pd.getSurfaceSupportKHR(family_index, *surface);
+            if (support_graphics && support_present)
             {
                 std::array<const char*, 0> device_layers{
                 };
                 std::vector<const char*> device_extensions{
-                    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
                     VK_KHR_RAY_TRACING_EXTENSION_NAME,
                     VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME,
                     VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME,
                     VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
                     VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME,
                 };
+                if (!options.headless)
+                    device_extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
                 // Add debug names extension which is available only when it's profiled
-                for (auto ext : pd.enumerateDeviceExtensionProperties())
-                    if (strcmp(ext.extensionName, VK_EXT_DEBUG_MARKER_EXTENSION_NAME) == 0)
-                        device_extensions.push_back(VK_EXT_DEBUG_MARKER_EXTENSION_NAME);
-
-                std::array<float, 1> queue_priorities{ 1.f };
-                vk::DeviceQueueCreateInfo queue_info;
-                queue_info.queueFamilyIndex = family_index;
-                queue_info.queueCount = 1;
-                queue_info.pQueuePriorities = queue_priorities.data();
-                vk::StructureChain device_info {
+                if (has_extension(pd, VK_EXT_DEBUG_MARKER_EXTENSION_NAME))
+                    device_extensions.push_back(VK_EXT_DEBUG_MARKER_EXTENSION_NAME);
+
+                // A transfer-only family maps to the copy engines of discrete GPUs
+                uint32_t transfer_index = family_index;
+                for (uint32_t i = 0; i < props.size() && options.transfer_queue; i++)
+                {
+                    if ((props[i].queueFlags & vk::QueueFlagBits::eTransfer) && 
+                        !(props[i].queueFlags & (vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute)))
+                    {
+                        transfer_index = i;
+                        break;
+                    }
+                }
+
+                // A compute family without graphics runs the AS builds next to the frames
+                uint32_t compute_index = family_index;
+                for (uint32_t i = 0; i < props.size() && options.async_compute; i++)
+                {
+                    if ((props[i].queueFlags & vk::QueueFlagBits::eCompute) && !(props[i].queueFlags & vk::QueueFlagBits::eGraphics))
+                    {
+                        compute_index = i;
+                        break;
+                    }
+                }
+
+                // The culled draws of the GPU-driven raster path
+                auto supported = pd.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceVulkan12Features,
+                    vk::PhysicalDeviceRayTracingFeaturesKHR>();
+                bool indirect_draws = supported.get<vk::PhysicalDeviceVulkan12Features>().drawIndirectCount &&
+                    supported.get<vk::PhysicalDeviceFeatures2>().features.multiDrawIndirect &&
+                    supported.get<vk::PhysicalDeviceFeatures2>().features.drawIndirectFirstInstance;
+                vk::PhysicalDeviceFeatures features;
+                features.multiDrawIndirect = indirect_draws;
+                features.drawIndirectFirstInstance = indirect_draws;
+                // The inline ray query backend
+                bool ray_query = supported.get<vk::PhysicalDeviceRayTracingFeaturesKHR>().rayQuery;
+
+                // A streamed scene is uploaded and built while the frames are submitted from another
+                // thread, the build queues of the graphics family then need a queue of their own
+                uint32_t graphics_queues = 1;
+                if (!options.stream_scene_path.empty() && (transfer_index == family_index || compute_index == family_index))
+                    graphics_queues = std::min(2u, props[family_index].queueCount);
+
+                std::array<float, 2> queue_priorities{ 1.f, 1.f };
+                std::vector<vk::DeviceQueueCreateInfo> queue_infos{
+                    { {}, (uint32_t)family_index, graphics_queues, queue_priorities.data() } };
+                if (transfer_index != family_index)
+                    queue_infos.emplace_back(vk::DeviceQueueCreateFlags(), transfer_index, 1, queue_priorities.data());
+                if (compute_index != family_index && compute_index != transfer_index)
+                    queue_infos.emplace_back(vk::DeviceQueueCreateFlags(), compute_index, 1, queue_priorities.data());
+                // One flat chain, it must outlive the device creation since pNext points into it
+                vk::StructureChain<vk::DeviceCreateInfo, vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceVulkan12Features,
+                    vk::PhysicalDeviceRayTracingFeaturesKHR> device_info {
                     vk::DeviceCreateInfo()
-                        .setQueueCreateInfoCount(1)
-                        .setPQueueCreateInfos(&queue_info)
+                        .setQueueCreateInfoCount((uint32_t)queue_infos.size())
+                        .setPQueueCreateInfos(queue_infos.data())
                         .setEnabledLayerCount((uint32_t)device_layers.size())
                         .setPpEnabledLayerNames(device_layers.data())
                         .setEnabledExtensionCount((uint32_t)device_extensions.size())
                         .setPpEnabledExtensionNames(device_extensions.data()),
-                    vk::StructureChain{
-                        vk::PhysicalDeviceFeatures2(),
-                        vk::PhysicalDeviceVulkan12Features()
-                            .setBufferDeviceAddress(true),
-                        vk::PhysicalDeviceRayTracingFeaturesKHR()
-                            .setRayTracing(true),
-                    }.get<vk::PhysicalDeviceFeatures2>(),
+                    vk::PhysicalDeviceFeatures2(features),
+                    vk::PhysicalDeviceVulkan12Features()
+                        .setBufferDeviceAddress(true)
+                        .setDrawIndirectCount(indirect_draws),
+                    vk::PhysicalDeviceRayTracingFeaturesKHR()
+                        .setRayTracing(true)
+                        .setRayQuery(ray_query),
                 };
                 device = pd.createDeviceUnique(device_info.get<vk::DeviceCreateInfo>());
                 physical_device = pd;
                 device_family = family_index;
-                return;
+                transfer_family = transfer_index;
+                compute_family = compute_index;
+                build_queue_index = graphics_queues - 1;
+                gpu_driven_draws = indirect_draws;
+                ray_query_support = ray_query;
+                return true;
             }
         }
     }
-}
-
-uint32_t find_memory(const vk::MemoryRequirements& req, vk::MemoryPropertyFlags flags)
-{
-    vk::PhysicalDeviceMemoryProperties mp = physical_device.getMemoryProperties();
-    for (uint32_t mem_i = 0; mem_i < mp.memoryTypeCount; mem_i++)
-        if ((1 << mem_i) & req.memoryTypeBits && (mp.memoryTypes[mem_i].propertyFlags & flags) == flags)
-            return mem_i;
-    throw std::runtime_error("find_memory failed");
+    return false;
 }
 
 auto create_gbuffer(const std::string& name, const vk::Extent2D& extent, vk::Format format, vk::ImageUsageFlags usage)
@@ -147,11 +311,7 @@ auto create_gbuffer(const std::string& name, const vk::Extent2D& extent, vk::For
     info.initialLayout = vk::ImageLayout::eUndefined;
     vk::UniqueImage image = device->createImageUnique(info);
     debug_name(image, name + " Image");
-    vk::MemoryRequirements mem_req = device->getImageMemoryRequirements(*image);
-    uint32_t mem_idx = find_memory(mem_req, vk::MemoryPropertyFlagBits::eDeviceLocal);
-    vk::UniqueDeviceMemory mem = device->allocateMemoryUnique({ mem_req.size, mem_idx });
-    debug_name(mem, name + " Memory");
-    device->bindImageMemory(*image, *mem, 0);
+    allocation_t mem = allocator->bind(*image, memory_usage_t::device_local);
     vk::ImageViewCreateInfo view_info;
     view_info.image = *image;
     view_info.viewType = vk::ImageViewType::e2D;
@@ -238,285 +398,295 @@ void change_layout(const vk::UniqueImage& image, vk::ImageLayout src, vk::ImageL
     q.waitIdle();
 }
 
-vk::UniqueShaderModule load_shader_module(const std::string& path)
+struct as_compaction_t
 {
-    std::ifstream file(path, std::ios::binary | std::ios::ate);
-    if (!file.is_open())
-        throw std::runtime_error("cannot open the file " + path);
-    size_t size = file.tellg();
-    file.seekg(std::ios::beg);
-    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(size);
-    file.read(buffer.get(), size);
-
-    vk::ShaderModuleCreateInfo module_info;
-    module_info.codeSize = size;
-    module_info.pCode = reinterpret_cast<uint32_t*>(buffer.get());
-    vk::UniqueShaderModule m = device->createShaderModuleUnique(module_info);
-    debug_name(m, "ShaderModule " + path);
-    return m;
-}
+    vk::UniqueAccelerationStructureKHR* as;
+    vk::AccelerationStructureTypeKHR type;
+    std::string name;
+    vk::DeviceSize size_before = 0;
+    vk::DeviceSize size_after = 0;
+    vk::DeviceSize offset = 0;          // offset in the compacted memory
+    vk::DeviceAddress address = 0;
+};
 
-int main_run()
+// Replace the acceleration structures with compacted copies packed in a single allocation.
+// The structures must have been built with eAllowCompaction, the old ones are destroyed on return
+// and their memory can be released by the caller.
+allocation_t compact_acceleration_structures(std::vector<as_compaction_t>& entries, const std::string& name)
 {
-    // Instance creation
+    std::vector<vk::AccelerationStructureKHR> handles;
+    for (const auto& e : entries)
+        handles.push_back(**e.as);
 
-    vk::DynamicLoader dl;
-    PFN_vkGetInstanceProcAddr vkGetInstanceProcAddr =
-        dl.getProcAddress<PFN_vkGetInstanceProcAddr>("vkGetInstanceProcAddr");
-    VULKAN_HPP_DEFAULT_DISPATCHER.init(vkGetInstanceProcAddr);
-
-    vk::ApplicationInfo instance_app_info;
-    instance_app_info.pApplicationName = "VulkanSample";
-    instance_app_info.applicationVersion = VK_MAKE_VERSION(0, 1, 0);
-    instance_app_info.pEngineName = "Custom";
-    instance_app_info.engineVersion = VK_MAKE_VERSION(0, 1, 0);
-    instance_app_info.apiVersion = VK_VERSION_1_2;
-    std::array<const char*, 1> instance_layers {
-        "VK_LAYER_KHRONOS_validation",
-        //"VK_LAYER_RENDERDOC_Capture",
-    };
-    std::array<const char*, 5> instance_extensions{
-        VK_KHR_SURFACE_EXTENSION_NAME,
-        VK_KHR_WIN32_SURFACE_EXTENSION_NAME,
-        VK_EXT_DEBUG_UTILS_EXTENSION_NAME,
-        VK_EXT_DEBUG_REPORT_EXTENSION_NAME,
-        VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
-    };
-    vk::InstanceCreateInfo instance_info;
-    instance_info.pApplicationInfo = &instance_app_info;
-    instance_info.enabledLayerCount = (uint32_t)instance_layers.size();
-    instance_info.ppEnabledLayerNames = instance_layers.data();
-    instance_info.enabledExtensionCount = (uint32_t)instance_extensions.size();
-    instance_info.ppEnabledExtensionNames = instance_extensions.data();
-    instance = vk::createInstanceUnique(instance_info);
-    VULKAN_HPP_DEFAULT_DISPATCHER.init(*instance);
-
-    // Debugging
-    
-    auto debug_messenger = init_debug_message(instance);
-
-    // Window/Surface creation
-
-    WNDCLASS wc{};
-    wc.style = CS_HREDRAW | CS_VREDRAW;
-    wc.lpfnWndProc = main_window_proc;
-    wc.hInstance = GetModuleHandle(NULL);
-    wc.hIcon = LoadIcon(NULL, IDI_APPLICATION);
-    wc.hCursor = LoadCursor(NULL, IDC_ARROW);
-    wc.hbrBackground = (HBRUSH)GetStockObject(WHITE_BRUSH);
-    wc.lpszClassName = TEXT("MainWindow");
-    RegisterClass(&wc);
-    RECT window_rect = { 0, 0, 800, 600 };
-    AdjustWindowRect(&window_rect, WS_OVERLAPPEDWINDOW, false);
-    HWND hWnd = CreateWindow(TEXT("MainWindow"), TEXT("VulkanSample - RayTraced"), WS_OVERLAPPEDWINDOW | WS_VISIBLE,
-        CW_USEDEFAULT, CW_USEDEFAULT, window_rect.right - window_rect.left, 
-        window_rect.bottom - window_rect.top, NULL, NULL, wc.hInstance, NULL);
-
-    vk::Win32SurfaceCreateInfoKHR surface_info;
-    surface_info.hinstance = wc.hInstance;
-    surface_info.hwnd = hWnd;
-    surface = instance->createWin32SurfaceKHRUnique(surface_info);
-    vk::SurfaceKHR surface1 = instance->createWin32SurfaceKHR(surface_info);
-
-    // Create device
-
-    find_device();
-    VULKAN_HPP_DEFAULT_DISPATCHER.init(*device);
-
-    auto pd_props = physical_device.getProperties();
-    std::string title = fmt::format("VulkanSample - RayTraced - {}", pd_props.deviceName);
-    SetWindowTextA(hWnd, title.c_str());
-
-    // Create Swapchain
-
-    vk::SurfaceCapabilitiesKHR surface_caps = physical_device.getSurfaceCapabilitiesKHR(*surface);
-    std::vector<vk::SurfaceFormatKHR> swapchain_formats = physical_device.getSurfaceFormatsKHR(*surface);
-    vk::SwapchainCreateInfoKHR swapchain_info;
-    swapchain_info.surface = *surface;
-    swapchain_info.minImageCount = 2;
-    swapchain_info.imageFormat = vk::Format::eB8G8R8A8Unorm;
-    swapchain_info.imageColorSpace = vk::ColorSpaceKHR::eSrgbNonlinear;
-    swapchain_info.imageExtent = surface_caps.currentExtent;
-    swapchain_info.imageArrayLayers = 1;
-    swapchain_info.imageUsage = vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferDst;
-    swapchain_info.presentMode = vk::PresentModeKHR::eFifo;
-    swapchain_info.clipped = true;
-    vk::UniqueSwapchainKHR swapchain = device->createSwapchainKHRUnique(swapchain_info);
-    std::vector<vk::Image> swapchain_images = device->getSwapchainImagesKHR(*swapchain);
-
-    // Load 3D model
-
-    struct vertex_t
+    auto submit_and_wait = [](const vk::UniqueCommandBuffer& cmd)
     {
-        glm::vec3 pos;
-        glm::vec3 nor;
-        vertex_t() = default;
-        vertex_t(glm::vec3 pos) : pos(pos), nor(0) {}
-        vertex_t(glm::vec2 pos) : pos(glm::vec3(pos, 0)), nor(0) {}
-        vertex_t(glm::vec3 pos, glm::vec3 nor) : pos(pos), nor(nor) {}
+        vk::UniqueFence fence = device->createFenceUnique({});
+        vk::SubmitInfo submit_info;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &cmd.get();
+        compute_q.submit(submit_info, *fence);
+        device->waitForFences(*fence, true, UINT64_MAX);
     };
 
-    struct mesh_t
-    {
-        uint32_t id;
-        uint32_t vtx_offset;
-        uint32_t vtx_count;
-        uint32_t idx_offset;
-        uint32_t idx_count;
-        vk::DeviceAddress blas_addr;
-        vk::DeviceSize blas_offset;
-        vk::DeviceSize blas_size;
-        vk::UniqueAccelerationStructureKHR blas;
-        vk::AccelerationStructureBuildGeometryInfoKHR build_geo;
-        vk::AccelerationStructureBuildOffsetInfoKHR build_offset;
-    };
+    // Query the compacted sizes
+    vk::UniqueQueryPool query_pool = device->createQueryPoolUnique({ {},
+        vk::QueryType::eAccelerationStructureCompactedSizeKHR, (uint32_t)handles.size() });
+    vk::UniqueCommandBuffer cmd = std::move(
+        device->allocateCommandBuffersUnique({ *compute_cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+    debug_name(cmd, name + " Compaction Query Command");
+    cmd->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+    // Orders the query after the builds submitted before on the same queue
+    vk::MemoryBarrier build_barrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR);
+    cmd->pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, build_barrier, nullptr, nullptr);
+    cmd->resetQueryPool(*query_pool, 0, (uint32_t)handles.size());
+    cmd->writeAccelerationStructuresPropertiesKHR(handles, vk::QueryType::eAccelerationStructureCompactedSizeKHR, *query_pool, 0);
+    cmd->end();
+    submit_and_wait(cmd);
+    std::vector<vk::DeviceSize> compacted_sizes(handles.size());
+    device->getQueryPoolResults(*query_pool, 0, (uint32_t)handles.size(), compacted_sizes.size() * sizeof(vk::DeviceSize),
+        compacted_sizes.data(), sizeof(vk::DeviceSize), vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+
+    // Create the compacted structures tightly packed in one allocation
+    std::vector<vk::UniqueAccelerationStructureKHR> compacted(entries.size());
+    vk::DeviceSize mem_size = 0;
+    vk::MemoryRequirements mem_req;
+    vk::DeviceSize mem_alignment = 1;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        vk::AccelerationStructureCreateInfoKHR info;
+        info.compactedSize = compacted_sizes[i];
+        info.type = entries[i].type;
+        compacted[i] = device->createAccelerationStructureKHRUnique(info);
+        debug_name(compacted[i], entries[i].name + " (compacted)");
+        mem_req = device->getAccelerationStructureMemoryRequirementsKHR({
+            vk::AccelerationStructureMemoryRequirementsTypeKHR::eObject,
+            vk::AccelerationStructureBuildTypeKHR::eDevice, *compacted[i] }).memoryRequirements;
+        mem_size = (mem_size + mem_req.alignment - 1) & ~(mem_req.alignment - 1);
+        mem_alignment = std::max(mem_alignment, mem_req.alignment);
+        entries[i].offset = mem_size;
+        entries[i].size_after = mem_req.size;
+        mem_size += mem_req.size;
+    }
+    mem_req.size = mem_size;
+    mem_req.alignment = mem_alignment;
+    allocation_t mem = allocator->allocate(mem_req, memory_usage_t::device_local, resource_kind_t::linear);
+    for (size_t i = 0; i < entries.size(); i++)
+        device->bindAccelerationStructureMemoryKHR({ { *compacted[i], mem.memory, mem.offset + entries[i].offset } });
+
+    // Copy
+    cmd = std::move(device->allocateCommandBuffersUnique({ *compute_cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+    debug_name(cmd, name + " Compaction Copy Command");
+    cmd->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+    debug_mark_begin(cmd, "Compact " + name);
+    for (size_t i = 0; i < entries.size(); i++)
+        cmd->copyAccelerationStructureKHR({ handles[i], *compacted[i], vk::CopyAccelerationStructureModeKHR::eCompact });
+    debug_mark_end(cmd);
+    cmd->end();
+    submit_and_wait(cmd);
 
-    struct node_t
+    for (size_t i = 0; i < entries.size(); i++)
     {
-        std::vector<uint32_t> mesh_indices;
-        glm::mat4 mat;
-        glm::vec3 col;
-    };
+        *entries[i].as = std::move(compacted[i]);
+        entries[i].address = device->getAccelerationStructureAddressKHR({ **entries[i].as });
+    }
+    return mem;
+}
 
-    std::vector<vertex_t> mesh_data_vert;
-    std::vector<uint32_t> mesh_data_idx;
+void report_compaction(const std::vector<as_compaction_t>& entries, const std::string& name)
+{
+    vk::DeviceSize before = 0, after = 0;
+    for (const auto& e : entries)
+    {
+        std::cout << fmt::format("  {}: {} -> {} bytes\n", e.name, e.size_before, e.size_after);
+        before += e.size_before;
+        after += e.size_after;
+    }
+    std::cout << fmt::format("{} compaction: {:.2f} MB -> {:.2f} MB, saved {:.2f} MB ({:.1f}%)\n", name,
+        before / (1024.0 * 1024.0), after / (1024.0 * 1024.0), (before - after) / (1024.0 * 1024.0),
+        before ? 100.0 * (before - after) / before : 0.0);
+}
 
-    Assimp::Importer importer;
-    const aiScene* scene = importer.ReadFile("D:\\3D\\cars.fbx", aiProcessPreset_TargetRealtime_Fast);
+// GPU resources of a scene: the geometry, the acceleration structures, the hit shader records
+// and the SBT. The frames trace one of them, a streamed scene is built into another one next to
+// the frames and replaces it between two frames.
+struct scene_gpu_t
+{
     std::vector<mesh_t> meshes;
-    for (uint32_t mesh_index = 0; mesh_index < scene->mNumMeshes; mesh_index++)
+    std::vector<node_t> nodes;
+    buffer_t triangle_buffer;
+    buffer_t triangle_buffer_nor;
+    buffer_t triangle_buffer_idx;
+    vk::Format position_format = vk::Format::eR32G32B32Sfloat;     // BLAS and rasterized vertex input
+    vk::DeviceSize position_stride = sizeof(vertex_t);
+    std::string geometry_encoding;          // reported next to the BLAS build and trace times at the end of the run
+    blas_build_stats_t blas_stats;
+    allocation_t blas_mem;
+    vk::UniqueAccelerationStructureKHR tlas;
+    allocation_t tlas_mem;
+    vk::BuildAccelerationStructureFlagsKHR tlas_flags;
+    std::vector<vk::AccelerationStructureInstanceKHR> rt_instances;
+    buffer_t instance_buffer;
+    std::vector<material_t> materials;
+    buffer_t instance_data_buffer;
+    buffer_t material_buffer;
+    sbt_t sbt;
+    // Signaled by the release on the build queue, the graphics queue waits on it before the acquire
+    vk::UniqueSemaphore ready;
+    std::vector<vk::BufferMemoryBarrier> acquire;
+    vk::UniqueCommandBuffer release_cmd;
+    vk::UniqueCommandBuffer acquire_cmd;
+    double load_ms = 0.0;                   // import and build of a streamed scene
+};
+
+// Upload the geometry of the scene and build its acceleration structures on the transfer and
+// build queues. The upload signals a semaphore that the BLAS builds wait on, the TLAS build
+// follows them on the same queue. The geometry stays owned by the build queue family until
+// release_scene, timestamp_period = 0 disables the build timing.
+static scene_gpu_t create_scene_gpu(const scene_t& scene, job_system_t& jobs, float timestamp_period,
+    gpu_profiler_t* build_profiler)
+{
+    std::vector<mesh_t> meshes(scene.meshes.size());
+    for (uint32_t mesh_index = 0; mesh_index < meshes.size(); mesh_index++)
     {
-        aiMesh* scene_mesh = scene->mMeshes[mesh_index];
-        mesh_t& mesh = meshes.emplace_back();
+        mesh_t& mesh = meshes[mesh_index];
         mesh.id = mesh_index;
-        mesh.idx_offset = (uint32_t)mesh_data_idx.size();
-        mesh.idx_count = scene_mesh->mNumFaces * 3;
-        mesh.vtx_offset = (uint32_t)mesh_data_vert.size();
-        mesh.vtx_count = (uint32_t)scene_mesh->mNumVertices;
-        for (uint32_t vertex_index = 0; vertex_index < scene_mesh->mNumVertices; vertex_index++)
-        {
-            glm::vec3 pos = glm::make_vec3(&scene_mesh->mVertices[vertex_index].x);
-            glm::vec3 nor = glm::make_vec3(&scene_mesh->mNormals[vertex_index].x);
-            mesh_data_vert.emplace_back(pos, nor);
-        }
-        for (uint32_t face_index = 0; face_index < scene_mesh->mNumFaces; face_index++)
-        {
-            mesh_data_idx.insert(mesh_data_idx.end(), 
-                scene_mesh->mFaces[face_index].mIndices, 
-                scene_mesh->mFaces[face_index].mIndices + 3);
-        }
+        mesh.vtx_offset = scene.meshes[mesh_index].vtx_offset;
+        mesh.vtx_count = scene.meshes[mesh_index].vtx_count;
+        mesh.idx_offset = scene.meshes[mesh_index].idx_offset;
+        mesh.idx_count = scene.meshes[mesh_index].idx_count;
+        mesh.idx_byte_offset = mesh.idx_offset * sizeof(uint32_t);
     }
+    jobs.parallel_for((uint32_t)meshes.size(), [&](uint32_t mesh_index)
+    {
+        for (const auto& v : scene.vertices.subspan(meshes[mesh_index].vtx_offset, meshes[mesh_index].vtx_count))
+            meshes[mesh_index].bounds.grow(v.pos);
+    });
     std::vector<node_t> nodes;
-    for (uint32_t node_index = 0; node_index < scene->mRootNode->mNumChildren; node_index++)
+    for (const auto& scene_node : scene.nodes)
     {
-        aiNode* scene_node = scene->mRootNode->mChildren[node_index];
         node_t& node = nodes.emplace_back();
-        node.col = glm::linearRand(glm::vec3(0), glm::vec3(1));
-        node.mat = glm::identity<glm::mat4>();
-        for (int i = 0; i < 4; i++)
-            for (int j = 0; j < 4; j++)
-                node.mat[i][j] = scene_node->mTransformation[j][i];
-        node.mesh_indices.insert(node.mesh_indices.end(), 
-            scene_node->mMeshes, 
-            scene_node->mMeshes + scene_node->mNumMeshes);
-    }
-    importer.FreeScene();
-
-    // Create merged vertex buffers for all scene
-    vk::BufferCreateInfo triangle_buffer_info;
-    triangle_buffer_info.size = mesh_data_vert.size() * sizeof(vertex_t);
-    triangle_buffer_info.usage = vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress;
-    vk::UniqueBuffer triangle_buffer = device->createBufferUnique(triangle_buffer_info);
-    vk::MemoryRequirements triangle_buffer_mem_req = device->getBufferMemoryRequirements(*triangle_buffer);
-    uint32_t triangle_buffer_mem_idx = find_memory(triangle_buffer_mem_req,
-        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
-    // Use chained properties to request eDeviceAddress flags
-    vk::StructureChain triangle_buffer_mem_info{
-        vk::MemoryAllocateInfo(triangle_buffer_mem_req.size, triangle_buffer_mem_idx),
-        vk::MemoryAllocateFlagsInfo(vk::MemoryAllocateFlagBits::eDeviceAddress) };
-    vk::UniqueDeviceMemory triangle_buffer_mem = device->allocateMemoryUnique(
-        triangle_buffer_mem_info.get<vk::MemoryAllocateInfo>());
-    device->bindBufferMemory(*triangle_buffer, *triangle_buffer_mem, 0);
-    if (auto* ptr = reinterpret_cast<vertex_t*>(device->mapMemory(*triangle_buffer_mem, 0, VK_WHOLE_SIZE)))
-    {
-        std::copy(mesh_data_vert.begin(), mesh_data_vert.end(), ptr);
-        device->unmapMemory(*triangle_buffer_mem);
-    }
-
-    // index buffer
-    vk::BufferCreateInfo triangle_buffer_idx_info;
-    triangle_buffer_idx_info.size = mesh_data_idx.size() * sizeof(uint32_t);
-    triangle_buffer_idx_info.usage = vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress;
-    vk::UniqueBuffer triangle_buffer_idx = device->createBufferUnique(triangle_buffer_idx_info);
-    vk::MemoryRequirements triangle_buffer_idx_mem_req = device->getBufferMemoryRequirements(*triangle_buffer_idx);
-    uint32_t triangle_buffer_idx_mem_idx = find_memory(triangle_buffer_idx_mem_req,
-        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
-    vk::StructureChain triangle_buffer_idx_mem_info{
-        vk::MemoryAllocateInfo(triangle_buffer_idx_mem_req.size, triangle_buffer_idx_mem_idx),
-        vk::MemoryAllocateFlagsInfo(vk::MemoryAllocateFlagBits::eDeviceAddress) };
-    vk::UniqueDeviceMemory triangle_buffer_idx_mem = device->allocateMemoryUnique(
-        triangle_buffer_mem_info.get<vk::MemoryAllocateInfo>());
-    device->bindBufferMemory(*triangle_buffer_idx, *triangle_buffer_idx_mem, 0);
-    if (auto* ptr = reinterpret_cast<uint32_t*>(device->mapMemory(*triangle_buffer_idx_mem, 0, VK_WHOLE_SIZE)))
-    {
-        std::copy(mesh_data_idx.begin(), mesh_data_idx.end(), ptr);
-        device->unmapMemory(*triangle_buffer_idx_mem);
+        node.col = glm::vec3(scene_node.col);
+        node.mat = scene_node.mat;
+        auto mesh_indices = scene.node_mesh_indices.subspan(scene_node.mesh_first, scene_node.mesh_count);
+        node.mesh_indices.assign(mesh_indices.begin(), mesh_indices.end());
     }
 
-    // Create Queue and Pools
+    // Upload the geometry
+    CPU_ZONE_NAMED(phase, "Upload Geometry");
+    // Merged vertex and index buffers for all the scene in device-local memory, filled through the staging ring
+    // The buffers are exclusive, the uploader hands their ownership to the build queue family
+    uploader_t uploader(*allocator, transfer_q, transfer_family, options.staging_mb << 20);
+
+    // The hit shaders fetch the normals and the indices as storage buffers
+    vk::BufferUsageFlags geometry_usage = vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eTransferDst |
+        vk::BufferUsageFlagBits::eStorageBuffer;
+    buffer_t triangle_buffer;
+    buffer_t triangle_buffer_nor;
+    buffer_t triangle_buffer_idx;
+    // BLAS vertex input, in compressed mode the positions and the normals are separate streams
+    vk::Format position_format = vk::Format::eR32G32B32Sfloat;
+    vk::DeviceSize position_stride = sizeof(vertex_t);
+    vk::DeviceSize geometry_size = scene.vertices.size_bytes() + scene.indices.size_bytes();
+    std::string geometry_encoding = "uncompressed";
+    if (options.compress_geometry)
+    {
+        // The provisional extension has no format feature for AS vertex input, vertex buffer support is the closest hint
+        bool quantize = (bool)(physical_device.getFormatProperties(vk::Format::eR16G16B16A16Snorm).bufferFeatures & 
+            vk::FormatFeatureFlagBits::eVertexBuffer);
+        auto pack_start = std::chrono::high_resolution_clock::now();
+        packed_geometry_t packed = pack_geometry(scene, quantize, jobs);
+        double pack_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - pack_start).count();
+
+        triangle_buffer = create_buffer(*allocator, "Position Buffer", packed.positions.size(),
+            geometry_usage | vk::BufferUsageFlagBits::eVertexBuffer, memory_usage_t::device_address, 
+            block_strategy_t::free_list);
+        uploader.upload(*triangle_buffer.buffer, 0, packed.positions.data(), packed.positions.size());
+        triangle_buffer_nor = create_buffer(*allocator, "Normal Buffer", packed.normals.size() * sizeof(uint32_t),
+            geometry_usage | vk::BufferUsageFlagBits::eVertexBuffer, memory_usage_t::device_address, 
+            block_strategy_t::free_list);
+        uploader.upload(*triangle_buffer_nor.buffer, 0, packed.normals.data(), packed.normals.size() * sizeof(uint32_t));
+        triangle_buffer_idx = create_buffer(*allocator, "Index Buffer", packed.indices.size(),
+            geometry_usage | vk::BufferUsageFlagBits::eIndexBuffer, memory_usage_t::device_address, 
+            block_strategy_t::free_list);
+        uploader.upload(*triangle_buffer_idx.buffer, 0, packed.indices.data(), packed.indices.size());
+
+        position_format = packed.position_format;
+        position_stride = packed.position_stride;
+        uint32_t short_meshes = 0;
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            meshes[i].index_type = packed.meshes[i].index_type;
+            meshes[i].idx_byte_offset = packed.meshes[i].idx_byte_offset;
+            meshes[i].dequant = packed.meshes[i].dequant;
+            short_meshes += packed.meshes[i].index_type == vk::IndexType::eUint16;
+        }
+        vk::DeviceSize packed_size = packed.positions.size() + packed.normals.size() * sizeof(uint32_t) + packed.indices.size();
+        std::cout << fmt::format("Compressed geometry: {:.2f} MB -> {:.2f} MB, saved {:.2f} MB ({:.1f}%), "
+            "positions {}, {}/{} meshes with 16-bit indices, packed in {:.3f} ms\n",
+            geometry_size / (1024.0 * 1024.0), packed_size / (1024.0 * 1024.0), (geometry_size - packed_size) / (1024.0 * 1024.0),
+            geometry_size ? 100.0 * (geometry_size - packed_size) / geometry_size : 0.0, vk::to_string(position_format),
+            short_meshes, meshes.size(), pack_ms);
+        geometry_encoding = fmt::format("compressed ({} positions, octahedral normals, {}/{} meshes with 16-bit indices)",
+            vk::to_string(position_format), short_meshes, meshes.size());
+    }
+    else
+    {
+        triangle_buffer = create_buffer(*allocator, "Vertex Buffer", scene.vertices.size_bytes(),
+            geometry_usage | vk::BufferUsageFlagBits::eVertexBuffer, memory_usage_t::device_address, 
+            block_strategy_t::free_list);
+        uploader.upload(*triangle_buffer.buffer, 0, scene.vertices.data(), scene.vertices.size_bytes());
+        triangle_buffer_idx = create_buffer(*allocator, "Index Buffer", scene.indices.size_bytes(),
+            geometry_usage | vk::BufferUsageFlagBits::eIndexBuffer, memory_usage_t::device_address, 
+            block_strategy_t::free_list);
+        uploader.upload(*triangle_buffer_idx.buffer, 0, scene.indices.data(), scene.indices.size_bytes());
+        std::cout << fmt::format("Geometry: {:.2f} MB\n", geometry_size / (1024.0 * 1024.0));
+    }
 
-    q = device->getQueue(device_family, 0);
-    cmdpool = device->createCommandPoolUnique({ {}, device_family });
-    std::array<vk::DescriptorPoolSize, 4> descrpool_sizes{
-        vk::DescriptorPoolSize{ vk::DescriptorType::eUniformBuffer, (uint32_t)nodes.size() * 3 },
-        vk::DescriptorPoolSize{ vk::DescriptorType::eInputAttachment, 4 },
-        vk::DescriptorPoolSize{ vk::DescriptorType::eAccelerationStructureKHR, 1 },
-        vk::DescriptorPoolSize{ vk::DescriptorType::eStorageImage, 1 },
-    };
-    uint32_t pool_size =
-        (uint32_t)nodes.size()  // geometry pass
-        + 1                     // composition
-        + 1                     // raytracing
-    ;
-    uint32_t pool_size_comp = 1;
-    uint32_t pool_size_rt = 1;
-    descrpool = device->createDescriptorPoolUnique({ {}, pool_size,
-        (uint32_t)descrpool_sizes.size(), descrpool_sizes.data() });
+    // The BLAS builds read the geometry, they wait for the copies on the GPU
+    vk::UniqueSemaphore upload_semaphore = device->createSemaphoreUnique({});
+    debug_name(upload_semaphore, "Upload Semaphore");
+    std::vector<vk::BufferMemoryBarrier> geometry_acquire;
+    upload_stats_t upload_stats = uploader.finish(compute_family, 
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eAccelerationStructureReadKHR, *upload_semaphore, geometry_acquire);
+    std::cout << fmt::format("Geometry upload: {:.2f} MB, {} submit(s), {} region(s), {:.3f} ms ({:.1f} MB/s)\n",
+        upload_stats.bytes / (1024.0 * 1024.0), upload_stats.submits, upload_stats.regions, upload_stats.cpu_ms,
+        upload_stats.cpu_ms > 0 ? upload_stats.bytes / (1024.0 * 1024.0) / (upload_stats.cpu_ms / 1000.0) : 0.0);
 
     // Create RT objects
+    CPU_ZONE_NEXT(phase, "Create AS");
 
-    // Raytracing properties from getProperties2 extension
-    auto rt_props = physical_device.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceRayTracingPropertiesKHR>()
-        .get<vk::PhysicalDeviceRayTracingPropertiesKHR>();
-    
     // BLAS
     // Build bottom level acceleration structure
     // see: https://developer.nvidia.com/blog/vulkan-raytracing/
     vk::DeviceSize blas_mem_size = 0;
-    vk::DeviceSize scratch_size = 0;
+    vk::DeviceSize blas_mem_alignment = 1;
     vk::MemoryRequirements2 blas_mem_req;
+    blas_builder_t blas_builder(options.scratch_budget_mb << 20);
     for (auto& m : meshes)
     {
         vk::AccelerationStructureCreateGeometryTypeInfoKHR geo_info;
         geo_info.geometryType = vk::GeometryTypeKHR::eTriangles;
         geo_info.maxPrimitiveCount = m.idx_count / 3;
-        geo_info.indexType = vk::IndexType::eUint32;
+        geo_info.indexType = m.index_type;
         geo_info.maxVertexCount = m.vtx_count;
-        geo_info.vertexFormat = vk::Format::eR32G32B32Sfloat;
+        geo_info.vertexFormat = position_format;
         geo_info.allowsTransforms = false;
 
         vk::AccelerationStructureGeometryKHR geo;
         geo.flags = vk::GeometryFlagBitsKHR::eOpaque;
         geo.geometryType = vk::GeometryTypeKHR::eTriangles;
         geo.geometry.triangles.vertexFormat = geo_info.vertexFormat;
-        geo.geometry.triangles.vertexStride = sizeof(vertex_t);
-        geo.geometry.triangles.vertexData = device->getBufferAddressKHR({ *triangle_buffer });
-        geo.geometry.triangles.indexData = device->getBufferAddressKHR({ *triangle_buffer_idx });
+        geo.geometry.triangles.vertexStride = position_stride;
+        geo.geometry.triangles.vertexData = triangle_buffer.address;
+        geo.geometry.triangles.indexData = triangle_buffer_idx.address;
         geo.geometry.triangles.indexType = geo_info.indexType;
 
         vk::AccelerationStructureCreateInfoKHR blas_info;
         blas_info.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
         blas_info.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+        if (options.compact)
+            blas_info.flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
         blas_info.maxGeometryCount = 1;
         blas_info.pGeometryInfos = &geo_info;
         m.blas = device->createAccelerationStructureKHRUnique(blas_info);
@@ -525,54 +695,68 @@ int main_run()
         blas_mem_req = device->getAccelerationStructureMemoryRequirementsKHR({
             vk::AccelerationStructureMemoryRequirementsTypeKHR::eObject, 
             vk::AccelerationStructureBuildTypeKHR::eDevice, *m.blas });
-        m.blas_offset = blas_mem_size;
+        blas_mem_alignment = std::max(blas_mem_alignment, blas_mem_req.memoryRequirements.alignment);
+        m.blas_offset = (blas_mem_size + blas_mem_alignment - 1) & ~(blas_mem_alignment - 1);
         m.blas_size = blas_mem_req.memoryRequirements.size;
-        blas_mem_size += m.blas_size;
+        blas_mem_size = m.blas_offset + m.blas_size;
 
         vk::MemoryRequirements2 scratch_req = device->getAccelerationStructureMemoryRequirementsKHR({
             vk::AccelerationStructureMemoryRequirementsTypeKHR::eBuildScratch, 
             vk::AccelerationStructureBuildTypeKHR::eDevice, *m.blas });
-        scratch_size = std::max(scratch_size, scratch_req.memoryRequirements.size);
-
-        const vk::AccelerationStructureGeometryKHR* pGeometry = &geo;
-        m.build_geo.type = vk::AccelerationStructureTypeKHR::eBottomLevel;
-        m.build_geo.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
-        m.build_geo.update = false;
-        m.build_geo.dstAccelerationStructure = *m.blas;
-        m.build_geo.geometryArrayOfPointers = false;
-        m.build_geo.geometryCount = 1;
-        m.build_geo.ppGeometries = &pGeometry;
+        m.build_scratch_size = scratch_req.memoryRequirements.size;
 
+        m.build_geo = geo;
         m.build_offset.primitiveCount = geo_info.maxPrimitiveCount;
-        m.build_offset.primitiveOffset = m.idx_offset * sizeof(uint32_t);
+        m.build_offset.primitiveOffset = (uint32_t)m.idx_byte_offset;
         m.build_offset.firstVertex = m.vtx_offset;
+        blas_builder.add(*m.blas, m.build_geo, m.build_offset, blas_info.flags, m.build_scratch_size);
     }
     
-    uint32_t blas_mem_idx = find_memory(blas_mem_req.memoryRequirements, vk::MemoryPropertyFlagBits::eDeviceLocal);
-    vk::UniqueDeviceMemory blas_mem = device->allocateMemoryUnique({ blas_mem_size, blas_mem_idx });
-    debug_name(blas_mem, "BLAS Memory");
+    // All BLAS share one sub-allocation
+    blas_mem_req.memoryRequirements.size = blas_mem_size;
+    blas_mem_req.memoryRequirements.alignment = blas_mem_alignment;
+    allocation_t blas_mem = allocator->allocate(blas_mem_req.memoryRequirements, memory_usage_t::device_local, resource_kind_t::linear);
 
     for (auto& m : meshes)
     {
-        device->bindAccelerationStructureMemoryKHR({ { *m.blas, *blas_mem, m.blas_offset } });
+        device->bindAccelerationStructureMemoryKHR({ { *m.blas, blas_mem.memory, blas_mem.offset + m.blas_offset } });
         m.blas_addr = device->getAccelerationStructureAddressKHR({ *m.blas });
     }
 
 
     // TLAS
+    // One material, i.e. one hit record, per distinct node color
+    std::vector<material_t> materials;
+    std::map<std::tuple<float, float, float>, uint32_t> material_index;
     std::vector<vk::AccelerationStructureInstanceKHR> rt_instances;
+    std::vector<uint32_t> rt_instance_mesh;
+    std::vector<instance_data_t> instance_data;
     for (const auto& n : nodes)
     {
+        auto [material, inserted] = material_index.try_emplace({ n.col.r, n.col.g, n.col.b }, (uint32_t)materials.size());
+        if (inserted)
+            materials.push_back({ glm::vec4(n.col, 1.f) });
         for (const auto& mesh_index : n.mesh_indices)
         {
+            const mesh_t& m = meshes[mesh_index];
+            uint32_t index_size = m.index_type == vk::IndexType::eUint16 ? 2 : 4;
+            auto& data = instance_data.emplace_back();
+            data.first_index = (uint32_t)(m.idx_byte_offset / index_size);
+            data.normal_scale = glm::vec3(m.dequant[0][0], m.dequant[1][1], m.dequant[2][2]);
+            data.vertex_offset = (int32_t)m.vtx_offset;
+            data.index_type = m.index_type == vk::IndexType::eUint16 ? 1 : 0;
+
+            rt_instance_mesh.push_back(mesh_index);
             auto& inst = rt_instances.emplace_back();
+            // Quantized meshes fold their dequantization into the instance transform
+            glm::mat4 mat = n.mat * meshes[mesh_index].dequant;
             // glm:column-major to NV:row-major
             for (int i = 0; i < 3; i++)
                 for (int j = 0; j < 4; j++)
-                    inst.transform.matrix[i][j] = n.mat[j][i];
+                    inst.transform.matrix[i][j] = mat[j][i];
             inst.instanceCustomIndex = rt_instances.size() - 1;
             inst.mask = 0xFF;
-            inst.instanceShaderBindingTableRecordOffset = 0;
+            inst.instanceShaderBindingTableRecordOffset = material->second;
             inst.flags = (uint8_t)vk::GeometryInstanceFlagBitsKHR::eTriangleCullDisable;
             inst.accelerationStructureReference = meshes[mesh_index].blas_addr;
         }
@@ -586,6 +770,11 @@ int main_run()
     vk::AccelerationStructureCreateInfoKHR tlas_info;
     tlas_info.type = vk::AccelerationStructureTypeKHR::eTopLevel;
     tlas_info.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+    if (options.compact && !options.dynamic)
+        tlas_info.flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
+    // Dynamic scenes refit the TLAS in place every frame
+    if (options.dynamic)
+        tlas_info.flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
     tlas_info.maxGeometryCount = 1;
     tlas_info.pGeometryInfos = &tlas_geo_info;
     vk::UniqueAccelerationStructureKHR tlas = device->createAccelerationStructureKHRUnique(tlas_info);
@@ -594,65 +783,65 @@ int main_run()
     vk::MemoryRequirements2 tlas_mem_req = device->getAccelerationStructureMemoryRequirementsKHR({
         vk::AccelerationStructureMemoryRequirementsTypeKHR::eObject,
         vk::AccelerationStructureBuildTypeKHR::eDevice, *tlas });
-    uint32_t tlas_mem_idx = find_memory(tlas_mem_req.memoryRequirements, vk::MemoryPropertyFlagBits::eDeviceLocal);
-    vk::UniqueDeviceMemory tlas_mem = device->allocateMemoryUnique({ tlas_mem_req.memoryRequirements.size, tlas_mem_idx });
-    debug_name(tlas_mem, "TLAS Memory");
-    device->bindAccelerationStructureMemoryKHR({ {*tlas, *tlas_mem, 0} });
+    allocation_t tlas_mem = allocator->bind(*tlas);
 
     vk::MemoryRequirements2 tlas_scratch_req = device->getAccelerationStructureMemoryRequirementsKHR({
         vk::AccelerationStructureMemoryRequirementsTypeKHR::eBuildScratch,
         vk::AccelerationStructureBuildTypeKHR::eDevice, *tlas });
-    scratch_size = std::max(scratch_size, tlas_scratch_req.memoryRequirements.size);
+    // The same scratch buffer serves the BLAS batches and then the TLAS build
+    vk::DeviceSize scratch_size = std::max(blas_builder.plan(), tlas_scratch_req.memoryRequirements.size);
 
     // Scratch buffer
-    vk::BufferCreateInfo scratch_buffer_info;
-    scratch_buffer_info.size = scratch_size;
-    scratch_buffer_info.usage = vk::BufferUsageFlagBits::eRayTracingKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress;
-    vk::UniqueBuffer scratch_buffer = device->createBufferUnique(scratch_buffer_info);
-    debug_name(scratch_buffer, "Scratch Buffer");
-    vk::MemoryRequirements scratch_mem_req = device->getBufferMemoryRequirements(*scratch_buffer);
-    uint32_t scratch_mem_idx = find_memory(scratch_mem_req, vk::MemoryPropertyFlagBits::eDeviceLocal);
-    vk::StructureChain scratch_mem_info{
-        vk::MemoryAllocateInfo(scratch_mem_req.size, scratch_mem_idx),
-        vk::MemoryAllocateFlagsInfo(vk::MemoryAllocateFlagBits::eDeviceAddress) };
-    vk::UniqueDeviceMemory scratch_mem = device->allocateMemoryUnique(
-        scratch_mem_info.get<vk::MemoryAllocateInfo>());
-    debug_name(scratch_mem, "Scratch Buffer Memory");
-
-    device->bindBufferMemory(*scratch_buffer, *scratch_mem, 0);
-    vk::DeviceAddress scratch_addr = device->getBufferAddressKHR(*scratch_buffer);
+    // Transient, so it comes from a linear pool that is recycled once the builds are done
+    buffer_t scratch_buffer = create_buffer(*allocator, "Scratch Buffer", scratch_size,
+        vk::BufferUsageFlagBits::eRayTracingKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        memory_usage_t::device_address, block_strategy_t::linear);
+    vk::DeviceAddress scratch_addr = scratch_buffer.address;
 
-    // Instance buffer
-    vk::BufferCreateInfo instance_buffer_info;
-    instance_buffer_info.size = rt_instances.size() * sizeof(vk::AccelerationStructureInstanceKHR);
-    instance_buffer_info.usage = vk::BufferUsageFlagBits::eRayTracingKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress;
-    vk::UniqueBuffer instance_buffer = device->createBufferUnique(instance_buffer_info);
-    debug_name(instance_buffer, "Instance Buffer");
-    vk::MemoryRequirements instance_buffer_mem_req = device->getBufferMemoryRequirements(*instance_buffer);
-    uint32_t instance_buffer_mem_idx = find_memory(instance_buffer_mem_req,
-        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
-    vk::StructureChain instance_buffer_mem_info{
-        vk::MemoryAllocateInfo(instance_buffer_mem_req.size, instance_buffer_mem_idx),
-        vk::MemoryAllocateFlagsInfo(vk::MemoryAllocateFlagBits::eDeviceAddress) };
-    vk::UniqueDeviceMemory instance_buffer_mem = device->allocateMemoryUnique(
-        instance_buffer_mem_info.get<vk::MemoryAllocateInfo>());
-    debug_name(instance_buffer_mem, "Instance Buffer Memory");
-    device->bindBufferMemory(*instance_buffer, *instance_buffer_mem, 0);
-    if (auto* ptr = reinterpret_cast<vk::AccelerationStructureInstanceKHR*>(device->mapMemory(*instance_buffer_mem, 0, VK_WHOLE_SIZE)))
-    {
-        std::copy(rt_instances.begin(), rt_instances.end(), ptr);
-        device->unmapMemory(*instance_buffer_mem);
+    // Build BLAS
+    CPU_ZONE_NEXT(phase, "Build BLAS");
+    blas_builder.wait_for(*upload_semaphore, std::move(geometry_acquire));
+    blas_build_stats_t blas_stats = blas_builder.build(device, compute_q, *compute_cmdpool, scratch_addr, timestamp_period, build_profiler);
+    std::cout << fmt::format("BLAS build: {} meshes in {} batch(es), {:.3f} ms (GPU {:.3f} ms), scratch high-water {:.2f} MB\n",
+        blas_stats.count, blas_stats.batches, blas_stats.cpu_ms, blas_stats.gpu_ms, blas_stats.scratch_high_water / (1024.0 * 1024.0));
+
+    // Compact BLAS
+    if (options.compact)
+    {
+        std::vector<as_compaction_t> entries;
+        for (auto& m : meshes)
+            entries.push_back({ &m.blas, vk::AccelerationStructureTypeKHR::eBottomLevel, fmt::format("BLAS mesh#{}", m.id), m.blas_size });
+        allocation_t compacted_mem = compact_acceleration_structures(entries, "BLAS");
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            meshes[i].blas_offset = entries[i].offset;
+            meshes[i].blas_size = entries[i].size_after;
+            meshes[i].blas_addr = entries[i].address;
+        }
+        blas_mem = std::move(compacted_mem);
+        report_compaction(entries, "BLAS");
+
+        for (size_t i = 0; i < rt_instances.size(); i++)
+            rt_instances[i].accelerationStructureReference = meshes[rt_instance_mesh[i]].blas_addr;
     }
 
+    // Instance buffer
+    CPU_ZONE_NEXT(phase, "Build TLAS");
+    buffer_t instance_buffer = create_buffer(*allocator, "Instance Buffer", 
+        rt_instances.size() * sizeof(vk::AccelerationStructureInstanceKHR),
+        vk::BufferUsageFlagBits::eRayTracingKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress, memory_usage_t::upload);
+    std::copy(rt_instances.begin(), rt_instances.end(), 
+        reinterpret_cast<vk::AccelerationStructureInstanceKHR*>(instance_buffer.mem.mapped));
+
     vk::AccelerationStructureGeometryKHR tlas_geo;
     tlas_geo.geometryType = vk::GeometryTypeKHR::eInstances;
     tlas_geo.geometry.instances.arrayOfPointers = false;
-    tlas_geo.geometry.instances.data = device->getBufferAddressKHR(*instance_buffer);
+    tlas_geo.geometry.instances.data = instance_buffer.address;
 
     const vk::AccelerationStructureGeometryKHR* tlas_build_geo_pGeometry = &tlas_geo;
     vk::AccelerationStructureBuildGeometryInfoKHR tlas_build_geo;
     tlas_build_geo.type = vk::AccelerationStructureTypeKHR::eTopLevel;
-    tlas_build_geo.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+    tlas_build_geo.flags = tlas_info.flags;
     tlas_build_geo.update = false;
     tlas_build_geo.dstAccelerationStructure = *tlas;
     tlas_build_geo.geometryArrayOfPointers = false;
@@ -663,65 +852,457 @@ int main_run()
     vk::AccelerationStructureBuildOffsetInfoKHR tlas_build_offset;
     tlas_build_offset.primitiveCount = (uint32_t)rt_instances.size();
     
-    // Build BLAS
-    for (auto& m : meshes)
+    // Build TLAS
+    // Follows the closing barrier of the BLAS builds on the same queue, the fence only guards the
+    // scratch buffer and the build timestamps
+    vk::UniqueCommandBuffer cmd_builder = std::move(
+        device->allocateCommandBuffersUnique({ *compute_cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+    debug_name(cmd_builder, "AS Build Command");
+    cmd_builder->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+    uint32_t profiler_slot = build_profiler ? build_profiler->setup_slot() : 0;
+    if (build_profiler)
+        build_profiler->begin_frame(cmd_builder, profiler_slot);
     {
-        vk::UniqueCommandBuffer cmd_builder = std::move(
-            device->allocateCommandBuffersUnique({ *cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
-        debug_name(cmd_builder, "AS Build Command");
-        cmd_builder->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
-        debug_mark_insert(cmd_builder, "Build BLAS");
-        debug_mark_begin(cmd_builder, fmt::format("Build Mesh#{}", m.id));
-        
-        m.build_geo.scratchData = scratch_addr;
-        const vk::AccelerationStructureBuildOffsetInfoKHR* pBuildOffsetInfo = &m.build_offset;
-        cmd_builder->buildAccelerationStructureKHR(m.build_geo, pBuildOffsetInfo);
-
-        vk::MemoryBarrier barrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR | vk::AccessFlagBits::eAccelerationStructureReadKHR,
-            vk::AccessFlagBits::eAccelerationStructureReadKHR | vk::AccessFlagBits::eAccelerationStructureReadKHR);
-        cmd_builder->pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-            vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-            vk::DependencyFlags(), { barrier }, {}, {});
-        
-        debug_mark_end(cmd_builder);
-        cmd_builder->end();
-
-        vk::SubmitInfo cmd_build_submit;
-        cmd_build_submit.commandBufferCount = 1;
-        cmd_build_submit.pCommandBuffers = &cmd_builder.get();
-        q.submit(cmd_build_submit, nullptr);
-        q.waitIdle();
+        gpu_scope_t scope(cmd_builder, build_profiler, profiler_slot, "Build TLAS");
+        const vk::AccelerationStructureBuildOffsetInfoKHR* pBuildOffsetInfo = &tlas_build_offset;
+        cmd_builder->buildAccelerationStructureKHR(tlas_build_geo, pBuildOffsetInfo);
+    }
+    cmd_builder->end();
+    vk::UniqueFence tlas_fence = device->createFenceUnique({});
+    vk::SubmitInfo cmd_build_submit;
+    cmd_build_submit.commandBufferCount = 1;
+    cmd_build_submit.pCommandBuffers = &cmd_builder.get();
+    compute_q.submit(cmd_build_submit, *tlas_fence);
+
+    // Compact TLAS
+    // Skipped for dynamic scenes, the TLAS is refit in place and keeps its full size
+    if (options.compact && !options.dynamic)
+    {
+        std::vector<as_compaction_t> entries{ { &tlas, vk::AccelerationStructureTypeKHR::eTopLevel, "TLAS", 
+            tlas_mem_req.memoryRequirements.size } };
+        tlas_mem = compact_acceleration_structures(entries, "TLAS");
+        report_compaction(entries, "TLAS");
     }
 
-    // Build TLAS
+    // Scratch is no longer needed, give its block back
+    device->waitForFences(*tlas_fence, true, UINT64_MAX);
+    if (build_profiler)
+        build_profiler->resolve(profiler_slot);
+    scratch_buffer = {};
+
+    // Instance records of the hit shaders
+    buffer_t instance_data_buffer = create_buffer(*allocator, "Instance Data Buffer",
+        std::max<size_t>(instance_data.size(), 1) * sizeof(instance_data_t), vk::BufferUsageFlagBits::eStorageBuffer, memory_usage_t::upload);
+    std::copy(instance_data.begin(), instance_data.end(), reinterpret_cast<instance_data_t*>(instance_data_buffer.mem.mapped));
+    buffer_t material_buffer = create_buffer(*allocator, "Material Buffer",
+        std::max<size_t>(materials.size(), 1) * sizeof(material_t), vk::BufferUsageFlagBits::eStorageBuffer, memory_usage_t::upload);
+    std::copy(materials.begin(), materials.end(), reinterpret_cast<material_t*>(material_buffer.mem.mapped));
+
+    scene_gpu_t s;
+    s.meshes = std::move(meshes);
+    s.nodes = std::move(nodes);
+    s.triangle_buffer = std::move(triangle_buffer);
+    s.triangle_buffer_nor = std::move(triangle_buffer_nor);
+    s.triangle_buffer_idx = std::move(triangle_buffer_idx);
+    s.position_format = position_format;
+    s.position_stride = position_stride;
+    s.geometry_encoding = geometry_encoding;
+    s.blas_stats = blas_stats;
+    s.blas_mem = std::move(blas_mem);
+    s.tlas = std::move(tlas);
+    s.tlas_mem = std::move(tlas_mem);
+    s.tlas_flags = tlas_info.flags;
+    s.rt_instances = std::move(rt_instances);
+    s.instance_buffer = std::move(instance_buffer);
+    s.materials = std::move(materials);
+    s.instance_data_buffer = std::move(instance_data_buffer);
+    s.material_buffer = std::move(material_buffer);
+    return s;
+
+    // The hit shaders and the rasterized G-buffer read the merged geometry on the graphics queue
     {
-        vk::UniqueCommandBuffer cmd_builder = std::move(
-            device->allocateCommandBuffersUnique({ *cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
-        debug_name(cmd_builder, "AS Build Command");
-        cmd_builder->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+        std::vector<vk::Buffer> geometry_buffers{ *triangle_buffer.buffer, *triangle_buffer_idx.buffer };
+        if (triangle_buffer_nor.buffer)
+            geometry_buffers.push_back(*triangle_buffer_nor.buffer);
+        transfer_geometry_to_graphics(geometry_buffers);
+    }
+}
 
-        debug_mark_insert(cmd_builder, "Build TLAS");
-        const vk::AccelerationStructureBuildOffsetInfoKHR* pBuildOffsetInfo = &tlas_build_offset;
-        cmd_builder->buildAccelerationStructureKHR(tlas_build_geo, pBuildOffsetInfo);
-        
-        debug_mark_end(cmd_builder);
-        cmd_builder->end();
-
-        vk::SubmitInfo cmd_build_submit;
-        cmd_build_submit.commandBufferCount = 1;
-        cmd_build_submit.pCommandBuffers = &cmd_builder.get();
-        q.submit(cmd_build_submit, nullptr);
-        q.waitIdle();
+// Hand the exclusive geometry buffers from the build queue family to the graphics one for the
+// hit shaders and the rasterized passes. The release is ordered after the builds and the
+// compaction copies on the build queue and signals the ready semaphore of the scene.
+static void release_scene(scene_gpu_t& s)
+{
+    std::vector<vk::Buffer> buffers{ *s.triangle_buffer.buffer, *s.triangle_buffer_idx.buffer };
+    if (s.triangle_buffer_nor.buffer)
+        buffers.push_back(*s.triangle_buffer_nor.buffer);
+    s.acquire.clear();
+    if (compute_family != device_family)
+        for (vk::Buffer b : buffers)
+            s.acquire.emplace_back(vk::AccessFlags(), vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead |
+                vk::AccessFlagBits::eShaderRead, compute_family, device_family, b, 0, VK_WHOLE_SIZE);
+
+    s.release_cmd = std::move(device->allocateCommandBuffersUnique({ *compute_cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+    debug_name(s.release_cmd, "Geometry Release Command");
+    s.release_cmd->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+    if (!s.acquire.empty())
+        s.release_cmd->pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+            vk::PipelineStageFlagBits::eBottomOfPipe, {}, nullptr, s.acquire, nullptr);
+    s.release_cmd->end();
+    s.ready = device->createSemaphoreUnique({});
+    debug_name(s.ready, "Scene Ready Semaphore");
+    vk::SubmitInfo submit_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &s.release_cmd.get();
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &s.ready.get();
+    compute_q.submit(submit_info, nullptr);
+}
+
+// Wait on the GPU for the release of the scene and acquire its geometry on the graphics queue.
+// The semaphore wait only covers its own batch, the barrier extends it to the frames submitted
+// after it. Nothing waits on the CPU, the command buffers are freed with the scene.
+static void acquire_scene(scene_gpu_t& s)
+{
+    vk::PipelineStageFlags dst_stages = vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eRayTracingShaderKHR |
+        vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR;
+    vk::MemoryBarrier scene_barrier({}, vk::AccessFlagBits::eAccelerationStructureReadKHR | vk::AccessFlagBits::eShaderRead);
+    s.acquire_cmd = std::move(device->allocateCommandBuffersUnique({ *cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+    debug_name(s.acquire_cmd, "Geometry Acquire Command");
+    s.acquire_cmd->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+    s.acquire_cmd->pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, dst_stages, {}, scene_barrier, s.acquire, nullptr);
+    s.acquire_cmd->end();
+    vk::PipelineStageFlags wait_stage = vk::PipelineStageFlagBits::eAllCommands;
+    vk::SubmitInfo submit_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &s.acquire_cmd.get();
+    submit_info.waitSemaphoreCount = 1;
+    submit_info.pWaitSemaphores = &s.ready.get();
+    submit_info.pWaitDstStageMask = &wait_stage;
+    q.submit(submit_info, nullptr);
+}
+
+// CPU reference still of the offline camera, written to path
+static std::vector<uint8_t> cpu_render(const scene_t& scene, job_system_t& jobs, const std::string& path)
+{
+    glm::uvec2 size(options.render_width, options.render_height);
+    camera_t cam = orbit_camera(still_angle, (float)size.x / (float)size.y);
+    cpu_camera_t cpu_cam{ glm::inverse(cam.view), glm::inverse(cam.proj), cam.light_pos };
+    cpu_tracer_t tracer(scene, jobs);
+    cpu_trace_stats_t stats;
+    std::vector<uint8_t> image = tracer.render(cpu_cam, size, jobs, stats);
+    write_ppm(path, size, image);
+    uint64_t rays = stats.primary_rays + stats.shadow_rays;
+    std::cout << fmt::format("CPU render {} ({}x{}): {} threads, {} box test, {} primary + {} shadow rays, {:.3f} ms, "
+        "{:.2f} Mrays/s\n", path, size.x, size.y, jobs.size(), tracer.uses_avx2() ? "AVX2 8-wide" : "SSE 4-wide",
+        stats.primary_rays, stats.shadow_rays, stats.ms, stats.ms > 0.0 ? rays / (stats.ms * 1000.0) : 0.0);
+    return image;
+}
+
+// Golden image check of the offline GPU still of a backend against the CPU reference
+static void compare_golden(const std::string& path, glm::uvec2 size, const std::vector<uint8_t>& reference,
+    const std::string& backend)
+{
+    glm::uvec2 gpu_size;
+    std::vector<uint8_t> gpu_image = read_ppm(path, gpu_size);
+    if (gpu_size != size)
+        throw std::runtime_error(fmt::format("golden image: {} is {}x{}, expected {}x{}", path, gpu_size.x, gpu_size.y,
+            size.x, size.y));
+    // Rounding and the quantized geometry move a few levels, the silhouettes can flip whole pixels
+    image_diff_t diff = compare_images(gpu_image, reference, 8);
+    double percent = 100.0 * diff.pixels / ((double)size.x * size.y);
+    std::cout << fmt::format("Golden image ({}): {} pixels ({:.3f}%) differ from the CPU reference, max difference {}\n",
+        backend, diff.pixels, percent, diff.max_diff);
+    if (percent > options.golden_tolerance)
+        throw std::runtime_error(fmt::format("golden image ({}): {:.3f}% of the pixels differ, tolerance {:.3f}%", backend,
+            percent, options.golden_tolerance));
+}
+
+// Without a ray tracing device the frames of the orbit are traced by the CPU tracer instead,
+// headless and at the window size. The times are CPU times, there is no GPU work to measure.
+static void cpu_frames(const scene_t& scene, job_system_t& jobs)
+{
+    glm::uvec2 size(options.width, options.height);
+    cpu_tracer_t tracer(scene, jobs);
+    benchmark_t benchmark(options.warmup, false);
+    uint32_t frame_count = options.frames > 0 ? options.frames : 1000;
+    uint64_t rays = 0;
+    double total_ms = 0.0;
+    float angle = 0.f;
+    for (uint32_t frame = 0; frame < frame_count; frame++)
+    {
+        angle += glm::radians(1.f);
+        camera_t cam = orbit_camera(angle, (float)size.x / (float)size.y);
+        cpu_camera_t cpu_cam{ glm::inverse(cam.view), glm::inverse(cam.proj), cam.light_pos };
+        cpu_trace_stats_t stats;
+        tracer.render(cpu_cam, size, jobs, stats);
+        benchmark.add_frame(stats.ms, 0.0, stats.primary_rays, stats.shadow_rays);
+        if (frame >= options.warmup)
+        {
+            rays += stats.primary_rays + stats.shadow_rays;
+            total_ms += stats.ms;
+        }
+    }
+    std::cout << fmt::format("Render mode: CPU tracer ({}x{}, {} threads, {} box test), {:.2f} Mrays/s\n", size.x, size.y,
+        jobs.size(), tracer.uses_avx2() ? "AVX2 8-wide" : "SSE 4-wide", total_ms > 0.0 ? rays / (total_ms * 1000.0) : 0.0);
+    benchmark.report();
+}
+
+int main_run()
+{
+    cpu_profiler_thread_name("Main");
+    CPU_ZONE_NAMED(startup, "Startup");
+
+    // The scene is read and imported on the side while the instance, the device and the
+    // swapchain are created, it is only needed once the queues exist. --stream-scene loads
+    // another one the same way during the frame loop, see scene_streaming.
+    job_system_t jobs(options.threads);
+    std::future<scene_t> scene_loading = std::async(std::launch::async, [&jobs]
+    {
+        cpu_profiler_thread_name("Scene Loader");
+        return load_scene(options.scene_path, options.scene_cache, options.dedup, jobs);
+    });
+
+    // The CPU reference needs no device, without a GPU still to compare with it is the whole run
+    std::optional<scene_t> preloaded_scene;
+    std::vector<uint8_t> cpu_image;
+    if (!options.cpu_render_path.empty())
+    {
+        preloaded_scene = scene_loading.get();
+        cpu_image = cpu_render(*preloaded_scene, jobs, options.cpu_render_path);
+        if (options.render_path.empty())
+        {
+            CPU_ZONE_END(startup);
+            cpu_profiler_report();
+            return EXIT_SUCCESS;
+        }
+    }
+
+    // Instance creation
+    CPU_ZONE_NAMED(phase, "Create Instance");
+
+    vk::DynamicLoader dl;
+    PFN_vkGetInstanceProcAddr vkGetInstanceProcAddr =
+        dl.getProcAddress<PFN_vkGetInstanceProcAddr>("vkGetInstanceProcAddr");
+    VULKAN_HPP_DEFAULT_DISPATCHER.init(vkGetInstanceProcAddr);
+
+    vk::ApplicationInfo instance_app_info;
+    instance_app_info.pApplicationName = "VulkanSample";
+    instance_app_info.applicationVersion = VK_MAKE_VERSION(0, 1, 0);
+    instance_app_info.pEngineName = "Custom";
+    instance_app_info.engineVersion = VK_MAKE_VERSION(0, 1, 0);
+    instance_app_info.apiVersion = VK_VERSION_1_2;
+    std::vector<const char*> instance_layers;
+    // Validation is optional so that build machines without the SDK layers can still run
+    for (const auto& layer : vk::enumerateInstanceLayerProperties())
+        if (options.validation && strcmp(layer.layerName, "VK_LAYER_KHRONOS_validation") == 0)
+            instance_layers.push_back("VK_LAYER_KHRONOS_validation");
+    //instance_layers.push_back("VK_LAYER_RENDERDOC_Capture");
+    std::vector<const char*> instance_extensions{
+        VK_EXT_DEBUG_UTILS_EXTENSION_NAME,
+        VK_EXT_DEBUG_REPORT_EXTENSION_NAME,
+        VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
+    };
+#ifdef _WIN32
+    if (!options.headless)
+    {
+        instance_extensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+        instance_extensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+    }
+#endif
+    vk::InstanceCreateInfo instance_info;
+    instance_info.pApplicationInfo = &instance_app_info;
+    instance_info.enabledLayerCount = (uint32_t)instance_layers.size();
+    instance_info.ppEnabledLayerNames = instance_layers.data();
+    instance_info.enabledExtensionCount = (uint32_t)instance_extensions.size();
+    instance_info.ppEnabledExtensionNames = instance_extensions.data();
+    instance = vk::createInstanceUnique(instance_info);
+    VULKAN_HPP_DEFAULT_DISPATCHER.init(*instance);
+
+    // Debugging
+    
+    auto debug_messenger = init_debug_message(instance);
+
+    // Window/Surface creation
+    CPU_ZONE_NEXT(phase, "Create Window");
+
+#ifdef _WIN32
+    HWND hWnd = NULL;
+    if (!options.headless)
+    {
+        WNDCLASS wc{};
+        wc.style = CS_HREDRAW | CS_VREDRAW;
+        wc.lpfnWndProc = main_window_proc;
+        wc.hInstance = GetModuleHandle(NULL);
+        wc.hIcon = LoadIcon(NULL, IDI_APPLICATION);
+        wc.hCursor = LoadCursor(NULL, IDC_ARROW);
+        wc.hbrBackground = (HBRUSH)GetStockObject(WHITE_BRUSH);
+        wc.lpszClassName = TEXT("MainWindow");
+        RegisterClass(&wc);
+        RECT window_rect = { 0, 0, (LONG)options.width, (LONG)options.height };
+        AdjustWindowRect(&window_rect, WS_OVERLAPPEDWINDOW, false);
+        hWnd = CreateWindow(TEXT("MainWindow"), TEXT("VulkanSample - RayTraced"), WS_OVERLAPPEDWINDOW | WS_VISIBLE,
+            CW_USEDEFAULT, CW_USEDEFAULT, window_rect.right - window_rect.left, 
+            window_rect.bottom - window_rect.top, NULL, NULL, wc.hInstance, NULL);
+
+        vk::Win32SurfaceCreateInfoKHR surface_info;
+        surface_info.hinstance = wc.hInstance;
+        surface_info.hwnd = hWnd;
+        surface = instance->createWin32SurfaceKHRUnique(surface_info);
+    }
+#endif
+
+    // Create device
+    CPU_ZONE_NEXT(phase, "Create Device");
+
+    if (!find_device())
+    {
+        // --render still needs a GPU, the CPU reference is written to the same path instead
+        std::cout << fmt::format("No usable device with {}, the frames are traced on the CPU\n", VK_KHR_RAY_TRACING_EXTENSION_NAME);
+        CPU_ZONE_END(phase);
+        CPU_ZONE_END(startup);
+        scene_t scene = preloaded_scene ? std::move(*preloaded_scene) : scene_loading.get();
+        if (!options.render_path.empty())
+            cpu_render(scene, jobs, options.render_path);
+        else
+            cpu_frames(scene, jobs);
+        cpu_profiler_report();
+        debug_messenger.reset();
+        return EXIT_SUCCESS;
+    }
+    VULKAN_HPP_DEFAULT_DISPATCHER.init(*device);
+    allocator = std::make_unique<memory_allocator_t>(device, physical_device, true);
+    pipeline_cache = std::make_unique<pipeline_cache_t>(device, physical_device, options.pipeline_cache_path);
+    gpu_profiler = std::make_unique<gpu_profiler_t>(device, physical_device, device_family,
+        options.frames_in_flight, options.trace_path);
+
+    auto pd_props = physical_device.getProperties();
+    std::cout << fmt::format("Device: {} ({})\n", pd_props.deviceName, vk::to_string(pd_props.deviceType));
+#ifdef _WIN32
+    if (hWnd)
+    {
+        std::string title = fmt::format("VulkanSample - RayTraced - {}", pd_props.deviceName);
+        SetWindowTextA(hWnd, title.c_str());
+    }
+#endif
+
+    // Create Swapchain
+    CPU_ZONE_NEXT(phase, "Create Swapchain");
+    // In headless mode the frame is presented to an offscreen image instead
+
+    vk::Extent2D extent(options.width, options.height);
+    std::unique_ptr<swapchain_t> swapchain;
+    std::vector<vk::Image> target_images;
+    vk::ImageLayout target_layout = vk::ImageLayout::ePresentSrcKHR;
+    vk::UniqueImage offscreen_target;
+    allocation_t offscreen_target_mem;
+    vk::UniqueImageView offscreen_target_view;
+    if (!options.headless)
+    {
+        swapchain = std::make_unique<swapchain_t>(device, physical_device, *surface,
+            present_mode_from_name(options.present_mode), options.swapchain_images, extent);
+        if (!swapchain->recreate())
+            throw std::runtime_error("the window has no area");
+        extent = swapchain->get_extent();
+        target_images = swapchain->get_images();
+        // Already sized for the window, ignore the WM_SIZE sent at creation
+        window_resized = false;
+    }
+    else
+    {
+        std::tie(offscreen_target, offscreen_target_mem, offscreen_target_view) =
+            create_gbuffer("Offscreen Target", extent, vk::Format::eB8G8R8A8Unorm,
+                vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eTransferSrc);
+        target_images.push_back(*offscreen_target);
+        target_layout = vk::ImageLayout::eTransferSrcOptimal;
+    }
+
+    // Load 3D model
+    CPU_ZONE_NEXT(phase, "Load Scene");
+
+    scene_t scene = preloaded_scene ? std::move(*preloaded_scene) : scene_loading.get();
+
+    // Create Queue and Pools
+
+    // The build queues of the graphics family are a second queue when a scene is streamed, the
+    // loader thread submits to them while this thread submits the frames
+    if (!options.stream_scene_path.empty() && build_queue_index == 0 &&
+        (transfer_family == device_family || compute_family == device_family))
+    {
+        std::cout << "The streamed scene needs a second queue in the graphics family, it is not loaded\n";
+        options.stream_scene_path.clear();
+    }
+    q = device->getQueue(device_family, 0);
+    transfer_q = device->getQueue(transfer_family, transfer_family == device_family ? build_queue_index : 0);
+    compute_q = device->getQueue(compute_family, compute_family == device_family ? build_queue_index : 0);
+    cmdpool = device->createCommandPoolUnique({ {}, device_family });
+    compute_cmdpool = device->createCommandPoolUnique({ {}, compute_family });
+    // The streamed scene gets its own RT descriptor set, the current one is in use by the frames in flight
+    uint32_t pool_size_comp = 1;
+    uint32_t pool_size_rt = options.stream_scene_path.empty() ? 1 : 2;
+    std::array<vk::DescriptorPoolSize, 6> descrpool_sizes{
+        vk::DescriptorPoolSize{ vk::DescriptorType::eUniformBufferDynamic, 2 * pool_size_rt + 2 },
+        vk::DescriptorPoolSize{ vk::DescriptorType::eInputAttachment, 5 },
+        vk::DescriptorPoolSize{ vk::DescriptorType::eAccelerationStructureKHR, pool_size_rt + 1 },
+        vk::DescriptorPoolSize{ vk::DescriptorType::eStorageImage, pool_size_rt + 3 },
+        vk::DescriptorPoolSize{ vk::DescriptorType::eStorageBuffer, 4 * pool_size_rt + 4 },
+        vk::DescriptorPoolSize{ vk::DescriptorType::eStorageBufferDynamic, pool_size_rt + 1 + 2 },
+    };
+    uint32_t pool_size =
+        1                       // geometry pass, the draws select their instance record with the first instance
+        + 1                     // composition
+        + pool_size_rt          // raytracing
+        + 1                     // shadow rays
+        + 1                     // GPU-driven culling
+    ;
+    descrpool = device->createDescriptorPoolUnique({ {}, pool_size,
+        (uint32_t)descrpool_sizes.size(), descrpool_sizes.data() });
+    std::cout << fmt::format("Upload queue family {}{}, build queue family {}{}\n", transfer_family, 
+        transfer_family != device_family ? " (dedicated transfer)" : "", compute_family,
+        compute_family != device_family ? " (async compute)" : "");
+
+    // The compute family may not support timestamps even when the graphics one does
+    bool compute_timestamps = pd_props.limits.timestampComputeAndGraphics &&
+        physical_device.getQueueFamilyProperties()[compute_family].timestampValidBits > 0;
+    gpu_profiler_t* build_profiler = compute_timestamps ? gpu_profiler.get() : nullptr;
+    float timestamp_period = compute_timestamps ? pd_props.limits.timestampPeriod : 0.f;
+    scene_gpu_t scene_gpu = create_scene_gpu(scene, jobs, timestamp_period, build_profiler);
+
+    // The hit shaders and the rasterized G-buffer read the merged geometry on the graphics queue,
+    // the frames are ordered after the acquire without waiting for the builds on the CPU
+    release_scene(scene_gpu);
+    acquire_scene(scene_gpu);
+
+    std::unique_ptr<tlas_refit_t> tlas_refit;
+    std::vector<vk::AccelerationStructureInstanceKHR> frame_instances;
+    std::vector<aabb_t> frame_instance_bounds;
+    if (options.dynamic)
+    {
+        tlas_refit = std::make_unique<tlas_refit_t>(*allocator, *scene_gpu.tlas, scene_gpu.tlas_flags,
+            (uint32_t)scene_gpu.rt_instances.size(), options.frames_in_flight, options.refit_threshold);
+        frame_instances = scene_gpu.rt_instances;
+        frame_instance_bounds.resize(scene_gpu.rt_instances.size());
     }
 
     // RT Pipeline
+    CPU_ZONE_NEXT(phase, "Create RT Pipeline");
 
     // DescriptorSet Layout
-    std::array<vk::DescriptorSetLayoutBinding, 4> rt_descrset_layout_bindings{
-        vk::DescriptorSetLayoutBinding(0, vk::DescriptorType::eAccelerationStructureKHR, 1, vk::ShaderStageFlagBits::eRaygenKHR),
-        vk::DescriptorSetLayoutBinding(1, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eRaygenKHR),
-        vk::DescriptorSetLayoutBinding(2, vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eRaygenKHR),
-        vk::DescriptorSetLayoutBinding(3, vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eRaygenKHR),
+    // Shared by the RT pipeline and trace.comp
+    vk::ShaderStageFlags rgen_stages = vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eCompute;
+    vk::ShaderStageFlags rchit_stages = vk::ShaderStageFlagBits::eClosestHitKHR | vk::ShaderStageFlagBits::eCompute;
+    std::array<vk::DescriptorSetLayoutBinding, 9> rt_descrset_layout_bindings{
+        vk::DescriptorSetLayoutBinding(0, vk::DescriptorType::eAccelerationStructureKHR, 1, rgen_stages | rchit_stages),
+        vk::DescriptorSetLayoutBinding(1, vk::DescriptorType::eStorageImage, 1, rgen_stages),
+        vk::DescriptorSetLayoutBinding(2, vk::DescriptorType::eUniformBufferDynamic, 1, rgen_stages),
+        vk::DescriptorSetLayoutBinding(3, vk::DescriptorType::eUniformBufferDynamic, 1, rchit_stages),
+        // Scene data shared by all the instances, no descriptor per object
+        vk::DescriptorSetLayoutBinding(4, vk::DescriptorType::eStorageBuffer, 1, rchit_stages),
+        vk::DescriptorSetLayoutBinding(5, vk::DescriptorType::eStorageBuffer, 1, rchit_stages),
+        vk::DescriptorSetLayoutBinding(6, vk::DescriptorType::eStorageBuffer, 1, rchit_stages),
+        vk::DescriptorSetLayoutBinding(7, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute),
+        // Shadow ray counts, one region per frame in flight
+        vk::DescriptorSetLayoutBinding(8, vk::DescriptorType::eStorageBufferDynamic, 1, rchit_stages),
     };
     vk::DescriptorSetLayoutCreateInfo rt_descrset_layout_info;
     rt_descrset_layout_info.bindingCount = (uint32_t)rt_descrset_layout_bindings.size();
@@ -733,72 +1314,108 @@ int main_run()
     vk::UniqueDescriptorSet rt_descr_sets = std::move(
         device->allocateDescriptorSetsUnique({ *descrpool, 1, &rt_descrset_layout.get() })[0]);
     debug_name(rt_descr_sets, "RT Descriptor Set");
+    vk::UniqueDescriptorSet stream_descr_sets;
+    if (!options.stream_scene_path.empty())
+    {
+        stream_descr_sets = std::move(device->allocateDescriptorSetsUnique({ *descrpool, 1, &rt_descrset_layout.get() })[0]);
+        debug_name(stream_descr_sets, "Streamed RT Descriptor Set");
+    }
 
     // Create Uniform Buffer
-    vk::BufferCreateInfo uniform_rt_buffer_info;
-    uniform_rt_buffer_info.size = sizeof(uniform_rt_buffers_t);
-    uniform_rt_buffer_info.usage = vk::BufferUsageFlagBits::eUniformBuffer;
-    vk::UniqueBuffer uniform_rt_buffer = device->createBufferUnique(uniform_rt_buffer_info);
-    debug_name(uniform_rt_buffer, "RT Uniform Buffer");
-    vk::MemoryRequirements uniform_rt_mem_req = device->getBufferMemoryRequirements(*uniform_rt_buffer);
-    uint32_t uniform_rt_mem_idx = find_memory(uniform_rt_mem_req,
-        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
-    vk::UniqueDeviceMemory uniform_rt_mem = device->allocateMemoryUnique({ uniform_rt_mem_req.size, uniform_rt_mem_idx });
-    debug_name(uniform_rt_mem, "RT Uniform Buffer Memory");
-    device->bindBufferMemory(*uniform_rt_buffer, *uniform_rt_mem, 0);
+    // One slice per frame in flight, selected with a dynamic offset
+    vk::DeviceSize uniform_rt_stride = sizeof(uniform_rt_buffers_t);
+    vk::DeviceSize ubo_alignment = pd_props.limits.minUniformBufferOffsetAlignment;
+    uniform_rt_stride = (uniform_rt_stride + ubo_alignment - 1) & ~(ubo_alignment - 1);
+    buffer_t uniform_rt_buffer = create_buffer(*allocator, "RT Uniform Buffer", uniform_rt_stride * options.frames_in_flight,
+        vk::BufferUsageFlagBits::eUniformBuffer, memory_usage_t::upload);
+    uint8_t* uniform_rt_ptr = uniform_rt_buffer.mem.mapped;
+
+    ray_counter_t ray_counter(*allocator, options.frames_in_flight);
 
     // Create Output Image
-    const super_sample = 1;
-    glm::ivec2 output_size = glm::ivec2(surface_caps.currentExtent.width, surface_caps.currentExtent.height) * super_sample;
+    // Sized for the full resolution, dynamic resolution traces into its top-left corner.
+    // An offline render only needs one tile, the image is assembled on the host.
+    const uint32_t super_sample = 1;
+    glm::ivec2 output_size = glm::ivec2(extent.width, extent.height) * (int)super_sample;
+    if (!options.render_path.empty())
+        output_size = glm::ivec2(std::min(options.tile, options.render_width), std::min(options.tile, options.render_height));
+    // The hybrid composite pass renders into it as well
+    vk::ImageUsageFlags rt_output_usage = vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eStorage;
+    if (options.hybrid)
+        rt_output_usage |= vk::ImageUsageFlagBits::eColorAttachment;
     auto [rt_output, rt_output_mem, rt_output_view] =
-        create_gbuffer("GBufferPOS", vk::Extent2D(output_size.x, output_size.y), vk::Format::eR8G8B8A8Unorm,
-            vk::ImageUsageFlagBits::eTransferSrc | vk::ImageUsageFlagBits::eStorage);
+        create_gbuffer("GBufferPOS", vk::Extent2D(output_size.x, output_size.y), vk::Format::eR8G8B8A8Unorm, rt_output_usage);
 
     // Update DescriptorSets
     vk::DescriptorImageInfo rt_descr_set_image(nullptr, *rt_output_view, vk::ImageLayout::eGeneral);
-    vk::DescriptorBufferInfo rt_descr_set_ubo_rgen(*uniform_rt_buffer, 0, uniform_rt_buffers_t::rgen_size);
-    vk::DescriptorBufferInfo rt_descr_set_ubo_rhit(*uniform_rt_buffer, uniform_rt_buffers_t::rhit_offset, uniform_rt_buffers_t::rhit_size);
-    vk::DescriptorBufferInfo rt_descr_set_idx(*triangle_buffer_idx, 0, VK_WHOLE_SIZE);
-    vk::StructureChain rt_descr_set_tlas_chain(
-        vk::WriteDescriptorSet(*rt_descr_sets, 0, 0, 1, vk::DescriptorType::eAccelerationStructureKHR),
-        vk::WriteDescriptorSetAccelerationStructureKHR(1, &tlas.get())
-    );
-    std::array<vk::WriteDescriptorSet, 4> rt_descr_set_write{
-        rt_descr_set_tlas_chain.get<vk::WriteDescriptorSet>(),
-        vk::WriteDescriptorSet(*rt_descr_sets, 1, 0, 1, vk::DescriptorType::eStorageImage, &rt_descr_set_image),
-        vk::WriteDescriptorSet(*rt_descr_sets, 2, 0, 1, vk::DescriptorType::eUniformBuffer, nullptr, &rt_descr_set_ubo_rgen),
-        vk::WriteDescriptorSet(*rt_descr_sets, 3, 0, 1, vk::DescriptorType::eUniformBuffer, nullptr, &rt_descr_set_ubo_rhit),
+    vk::DescriptorBufferInfo rt_descr_set_ubo_rgen(*uniform_rt_buffer.buffer, 0, uniform_rt_buffers_t::rgen_size);
+    vk::DescriptorBufferInfo rt_descr_set_ubo_rhit(*uniform_rt_buffer.buffer, uniform_rt_buffers_t::rhit_offset, uniform_rt_buffers_t::rhit_size);
+    vk::DescriptorBufferInfo rt_descr_set_ray_count = ray_counter.descriptor();
+    // Every binding is written, the set of a streamed scene also gets the current output image
+    auto write_rt_descr_set = [&](vk::DescriptorSet set, const scene_gpu_t& s)
+    {
+        vk::DescriptorBufferInfo rt_descr_set_idx(*s.triangle_buffer_idx.buffer, 0, VK_WHOLE_SIZE);
+        // Compressed geometry has the octahedral normals in their own stream, otherwise they are read from vertex_t
+        vk::DescriptorBufferInfo rt_descr_set_nor(s.triangle_buffer_nor.buffer ? *s.triangle_buffer_nor.buffer :
+            *s.triangle_buffer.buffer, 0, VK_WHOLE_SIZE);
+        vk::DescriptorBufferInfo rt_descr_set_instances(*s.instance_data_buffer.buffer, 0, VK_WHOLE_SIZE);
+        vk::DescriptorBufferInfo rt_descr_set_materials(*s.material_buffer.buffer, 0, VK_WHOLE_SIZE);
+        vk::StructureChain rt_descr_set_tlas_chain(
+            vk::WriteDescriptorSet(set, 0, 0, 1, vk::DescriptorType::eAccelerationStructureKHR),
+            vk::WriteDescriptorSetAccelerationStructureKHR(1, &s.tlas.get())
+        );
+        std::array<vk::WriteDescriptorSet, 9> rt_descr_set_write{
+            rt_descr_set_tlas_chain.get<vk::WriteDescriptorSet>(),
+            vk::WriteDescriptorSet(set, 1, 0, 1, vk::DescriptorType::eStorageImage, &rt_descr_set_image),
+            vk::WriteDescriptorSet(set, 2, 0, 1, vk::DescriptorType::eUniformBufferDynamic, nullptr, &rt_descr_set_ubo_rgen),
+            vk::WriteDescriptorSet(set, 3, 0, 1, vk::DescriptorType::eUniformBufferDynamic, nullptr, &rt_descr_set_ubo_rhit),
+            vk::WriteDescriptorSet(set, 4, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &rt_descr_set_idx),
+            vk::WriteDescriptorSet(set, 5, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &rt_descr_set_nor),
+            vk::WriteDescriptorSet(set, 6, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &rt_descr_set_instances),
+            vk::WriteDescriptorSet(set, 7, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr, &rt_descr_set_materials),
+            vk::WriteDescriptorSet(set, 8, 0, 1, vk::DescriptorType::eStorageBufferDynamic, nullptr, &rt_descr_set_ray_count),
+        };
+        device->updateDescriptorSets(rt_descr_set_write, nullptr);
     };
-    device->updateDescriptorSets(rt_descr_set_write, nullptr);
+    write_rt_descr_set(*rt_descr_sets, scene_gpu);
 
     // Pipeline Layout
     vk::PipelineLayoutCreateInfo rt_pipeline_layout_info;
     rt_pipeline_layout_info.setLayoutCount = 1;
     rt_pipeline_layout_info.pSetLayouts = &rt_descrset_layout.get();
-    rt_pipeline_layout_info.pushConstantRangeCount = 0;
+    vk::PushConstantRange rt_push_range(vk::ShaderStageFlagBits::eRaygenKHR, 0, sizeof(trace_push_t));
+    rt_pipeline_layout_info.pushConstantRangeCount = 1;
+    rt_pipeline_layout_info.pPushConstantRanges = &rt_push_range;
     vk::UniquePipelineLayout rt_pipeline_layout = device->createPipelineLayoutUnique(rt_pipeline_layout_info);
     debug_name(rt_pipeline_layout, "RT Pipeline Layout");
 
     // Ray-tracing Pipeline
     
     // Load shaders
-    vk::UniqueShaderModule module_trace_rgen = load_shader_module("shaders/trace.rgen.spv");
-    vk::UniqueShaderModule module_trace_rmiss = load_shader_module("shaders/trace.rmiss.spv");
-    vk::UniqueShaderModule module_trace_rchit = load_shader_module("shaders/trace.rchit.spv");
-    std::array<vk::PipelineShaderStageCreateInfo, 3> rt_pipeline_stages{
+    vk::UniqueShaderModule module_trace_rgen = load_shader_module(device, "trace.rgen", options.shader_dir);
+    vk::UniqueShaderModule module_trace_rmiss = load_shader_module(device, "trace.rmiss", options.shader_dir);
+    vk::UniqueShaderModule module_trace_rchit = load_shader_module(device, "trace.rchit", options.shader_dir);
+    vk::UniqueShaderModule module_shadow_rmiss = load_shader_module(device, "shadow.rmiss", options.shader_dir);
+    VkBool32 oct_normals = scene_gpu.triangle_buffer_nor.buffer ? VK_TRUE : VK_FALSE;
+    vk::SpecializationMapEntry oct_normals_entry(0, 0, sizeof(VkBool32));
+    vk::SpecializationInfo rchit_specialization(1, &oct_normals_entry, sizeof(oct_normals), &oct_normals);
+    std::array<vk::PipelineShaderStageCreateInfo, 4> rt_pipeline_stages{
         vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eRaygenKHR, *module_trace_rgen, "main"),
         vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eMissKHR, *module_trace_rmiss, "main"),
-        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eClosestHitKHR, *module_trace_rchit, "main"),
+        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eClosestHitKHR, *module_trace_rchit, "main", &rchit_specialization),
+        vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eMissKHR, *module_shadow_rmiss, "main"),
     };
 
     // Shader groups
-    std::array<vk::RayTracingShaderGroupCreateInfoKHR, 3> rt_groups{
+    std::array<vk::RayTracingShaderGroupCreateInfoKHR, 4> rt_groups{
         vk::RayTracingShaderGroupCreateInfoKHR(vk::RayTracingShaderGroupTypeKHR::eGeneral,
             0, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR),
         vk::RayTracingShaderGroupCreateInfoKHR(vk::RayTracingShaderGroupTypeKHR::eGeneral,
             1, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR),
         vk::RayTracingShaderGroupCreateInfoKHR(vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup,
             VK_SHADER_UNUSED_KHR, 2, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR),
+        vk::RayTracingShaderGroupCreateInfoKHR(vk::RayTracingShaderGroupTypeKHR::eGeneral,
+            3, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR),
     };
 
     // Ray-tracing Pipeline
@@ -807,202 +1424,634 @@ int main_run()
     rt_pipeline_info.pStages = rt_pipeline_stages.data();
     rt_pipeline_info.groupCount = (uint32_t)rt_groups.size();
     rt_pipeline_info.pGroups = rt_groups.data();
-    rt_pipeline_info.maxRecursionDepth = 1;
+    rt_pipeline_info.maxRecursionDepth = 2;     // the shadow rays are traced from the hit shader
     rt_pipeline_info.layout = *rt_pipeline_layout;
-    vk::UniquePipeline rt_pipeline = device->createRayTracingPipelineKHRUnique(nullptr, rt_pipeline_info).value;
+    auto pipeline_start = std::chrono::high_resolution_clock::now();
+    vk::UniquePipeline rt_pipeline = device->createRayTracingPipelineKHRUnique(pipeline_cache->get(), rt_pipeline_info).value;
     debug_name(rt_pipeline, "RT Pipeline");
+    std::cout << fmt::format("RT pipeline created in {:.3f} ms ({} cache)\n", 
+        std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - pipeline_start).count(),
+        pipeline_cache->warm() ? "warm" : "cold");
 
     // Shaders Binding Table
+    CPU_ZONE_NEXT(phase, "Create SBT");
 
-    // Create Buffer
-    vk::BufferCreateInfo sbt_buffer_info;
-    sbt_buffer_info.size = rt_props.shaderGroupHandleSize * rt_pipeline_stages.size();
-    sbt_buffer_info.usage = vk::BufferUsageFlagBits::eRayTracingKHR;
-    vk::UniqueBuffer sbt_buffer = device->createBufferUnique(sbt_buffer_info);
-    debug_name(sbt_buffer, "SBT Buffer");
-    vk::MemoryRequirements sbt_buffer_mem_req = device->getBufferMemoryRequirements(*sbt_buffer);
-    uint32_t sbt_buffer_mem_idx = find_memory(sbt_buffer_mem_req,
-        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
-    vk::UniqueDeviceMemory sbt_buffer_mem = device->allocateMemoryUnique({ sbt_buffer_mem_req.size, sbt_buffer_mem_idx });
-    debug_name(sbt_buffer_mem, "SBT Buffer Memory");
-    device->bindBufferMemory(*sbt_buffer, *sbt_buffer_mem, 0);
-    if (auto ptr = reinterpret_cast<uint8_t*>(device->mapMemory(*sbt_buffer_mem, 0, VK_WHOLE_SIZE)))
-    {
-        device->getRayTracingShaderGroupHandlesKHR<uint8_t>(*rt_pipeline, 0, (uint32_t)rt_pipeline_stages.size(), { (uint32_t)sbt_buffer_info.size, ptr });
-        device->unmapMemory(*sbt_buffer_mem);
-    }
-
-    vk::UniqueCommandBuffer cmd_trace = std::move(
-        device->allocateCommandBuffersUnique({ *cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
-    debug_name(cmd_trace, "cmd_trace");
-    cmd_trace->begin({ { vk::CommandBufferUsageFlags() } });
-    cmd_trace->bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, *rt_pipeline);
-    cmd_trace->bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, 
-        *rt_pipeline_layout, 0, *rt_descr_sets, nullptr);
-    
-    vk::ImageMemoryBarrier barrier;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-
-    barrier.image = *rt_output;
-    barrier.srcAccessMask = {};
-    barrier.dstAccessMask = vk::AccessFlagBits::eShaderWrite;
-    barrier.oldLayout = vk::ImageLayout::eUndefined;
-    barrier.newLayout = vk::ImageLayout::eGeneral;
-    cmd_trace->pipelineBarrier(vk::PipelineStageFlagBits::eAllGraphics, vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-        vk::DependencyFlagBits::eByRegion, nullptr, nullptr, barrier);
-    
-    debug_mark_insert(cmd_trace, "Trace Rays");
-    vk::DeviceSize sbt_size = rt_props.shaderGroupHandleSize * 3;
-    cmd_trace->traceRaysKHR(
-        { *sbt_buffer, rt_props.shaderGroupHandleSize * 0, rt_props.shaderGroupHandleSize, sbt_size },
-        { *sbt_buffer, rt_props.shaderGroupHandleSize * 1, rt_props.shaderGroupHandleSize, sbt_size },
-        { *sbt_buffer, rt_props.shaderGroupHandleSize * 2, rt_props.shaderGroupHandleSize, sbt_size },
-        { },
-        output_size.x, output_size.y, 1);
-    cmd_trace->end();
-
-    // Create clear screen command
-
-    vk::CommandBufferAllocateInfo cmd_clear_info;
-    cmd_clear_info.commandPool = *cmdpool;
-    cmd_clear_info.level = vk::CommandBufferLevel::ePrimary;
-    cmd_clear_info.commandBufferCount = (uint32_t)swapchain_images.size();
-    std::vector<vk::UniqueCommandBuffer> cmd_draw = device->allocateCommandBuffersUnique(cmd_clear_info);
-    std::vector<vk::CommandBuffer> submit_commands(swapchain_images.size());
-    for (int i = 0; i < swapchain_images.size(); i++)
-    {
-        debug_name(cmd_draw[i], fmt::format("Draw Command#{}", i));
-        cmd_draw[i]->begin({ vk::CommandBufferUsageFlags() });
+    // The hit records follow the material order, see instanceShaderBindingTableRecordOffset
+    auto build_sbt = [&](const std::vector<material_t>& materials, vk::Queue queue, vk::CommandPool pool,
+        const std::vector<uint32_t>& queue_families)
+    {
+        sbt_builder_t sbt_builder;
+        sbt_builder.add(sbt_region_t::raygen, 0);
+        sbt_builder.add(sbt_region_t::miss, 1);
+        sbt_builder.add(sbt_region_t::miss, 3);     // shadow rays, miss index 1
+        for (const material_t& material : materials)
+            sbt_builder.add(sbt_region_t::hit, 2, material);
+        return sbt_builder.build(*allocator, physical_device, *rt_pipeline, (uint32_t)rt_groups.size(), queue, pool, "RT",
+            queue_families);
+    };
+    scene_gpu.sbt = build_sbt(scene_gpu.materials, q, *cmdpool, {});
+
+    // Ray query backend, trace.comp reads the RT descriptor set and the hit record data from the material buffer
+    vk::UniquePipelineLayout rq_pipeline_layout;
+    vk::UniquePipeline rq_pipeline;
+    if (options.ray_query)
+    {
+        CPU_ZONE_NEXT(phase, "Create Ray Query Pipeline");
+        if (!ray_query_support)
         {
-            vk::ImageMemoryBarrier barrier;
-            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-            barrier.subresourceRange.baseMipLevel = 0;
-            barrier.subresourceRange.levelCount = 1;
-            barrier.subresourceRange.baseArrayLayer = 0;
-            barrier.subresourceRange.layerCount = 1;
-
-            barrier.image = swapchain_images[i];
-            barrier.srcAccessMask = {};
-            barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+            std::cout << "The ray query backend needs the rayQuery feature, the rays are traced with the RT pipeline\n";
+            options.ray_query = false;
+        }
+        else
+        {
+            vk::PushConstantRange rq_push_range(vk::ShaderStageFlagBits::eCompute, 0, sizeof(trace_query_push_t));
+            rq_pipeline_layout = device->createPipelineLayoutUnique({ {}, 1, &rt_descrset_layout.get(), 1, &rq_push_range });
+            debug_name(rq_pipeline_layout, "Ray Query Pipeline Layout");
+            vk::UniqueShaderModule module_trace_comp = load_shader_module(device, "trace.comp", options.shader_dir);
+            vk::ComputePipelineCreateInfo rq_pipeline_info({},
+                vk::PipelineShaderStageCreateInfo({}, vk::ShaderStageFlagBits::eCompute, *module_trace_comp, "main",
+                    &rchit_specialization), *rq_pipeline_layout);
+            rq_pipeline = device->createComputePipelineUnique(pipeline_cache->get(), rq_pipeline_info).value;
+            debug_name(rq_pipeline, "Ray Query Pipeline");
+        }
+    }
+    bool ray_query = static_cast<bool>(rq_pipeline);
+
+    // Per slot: the frame start, the end of the trace for dynamic resolution, and the end of the
+    // whole frame after the blit and the ray counter copy for the benchmark report
+    bool support_timestamps = pd_props.limits.timestampComputeAndGraphics &&
+        physical_device.getQueueFamilyProperties()[device_family].timestampValidBits > 0;
+    constexpr uint32_t frame_timestamps = 3;
+    vk::UniqueQueryPool timestamp_pool;
+    if (support_timestamps)
+    {
+        timestamp_pool = device->createQueryPoolUnique({ {}, vk::QueryType::eTimestamp, frame_timestamps * options.frames_in_flight });
+        debug_name(timestamp_pool, "Timestamp Query Pool");
+    }
+
+    // Hybrid pipelines
+    std::unique_ptr<hybrid_render_t> hybrid;
+    std::vector<glm::mat4> node_mats;
+    if (options.hybrid)
+    {
+        CPU_ZONE_NEXT(phase, "Create Hybrid Pipelines");
+        hybrid_geometry_t hybrid_geometry;
+        hybrid_geometry.positions = *scene_gpu.triangle_buffer.buffer;
+        hybrid_geometry.position_format = scene_gpu.position_format;
+        hybrid_geometry.position_stride = (uint32_t)scene_gpu.position_stride;
+        hybrid_geometry.normals = scene_gpu.triangle_buffer_nor.buffer ? *scene_gpu.triangle_buffer_nor.buffer : vk::Buffer();
+        hybrid_geometry.indices = *scene_gpu.triangle_buffer_idx.buffer;
+        if (options.gpu_driven && !gpu_driven_draws)
+        {
+            std::cout << "GPU-driven draws need drawIndirectCount, multiDrawIndirect and drawIndirectFirstInstance, "
+                "the draws are recorded on the CPU\n";
+            options.gpu_driven = false;
+        }
+        hybrid = std::make_unique<hybrid_render_t>(*allocator, physical_device, pipeline_cache->get(), *descrpool,
+            q, *cmdpool, options.shader_dir, hybrid_geometry, scene_gpu.meshes, scene_gpu.nodes, *scene_gpu.tlas, ray_counter,
+            options.frames_in_flight, options.gpu_driven);
+        hybrid->resize(glm::uvec2(output_size), *rt_output_view);
+        for (const auto& n : scene_gpu.nodes)
+            node_mats.push_back(n.mat);
+    }
+
+    allocator->report();
+
+    // Frames in flight
+    CPU_ZONE_NEXT(phase, "Create Frames");
+
+    std::vector<frame_t> frames(options.frames_in_flight);
+    for (uint32_t i = 0; i < frames.size(); i++)
+    {
+        frame_t& f = frames[i];
+        f.cmdpool = device->createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eTransient, device_family });
+        f.cmd = std::move(device->allocateCommandBuffersUnique({ *f.cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+        debug_name(f.cmd, fmt::format("Frame Command#{}", i));
+        f.acquire_sem = device->createSemaphoreUnique({});
+        debug_name(f.acquire_sem, fmt::format("Acquire Semaphore#{}", i));
+        f.render_sem = device->createSemaphoreUnique({});
+        debug_name(f.render_sem, fmt::format("Render Semaphore#{}", i));
+        f.fence = device->createFenceUnique({});
+        debug_name(f.fence, fmt::format("Frame Fence#{}", i));
+        f.uniform_offset = (uint32_t)(uniform_rt_stride * i);
+        f.uniforms = reinterpret_cast<uniform_rt_buffers_t*>(uniform_rt_ptr + f.uniform_offset);
+    }
+    // Fence of the frame that last rendered into each target image
+    std::vector<vk::Fence> target_fences(target_images.size());
+
+    // Stage of the trace writes to rt_output
+    vk::PipelineStageFlags trace_stage = ray_query ? vk::PipelineStageFlagBits::eComputeShader :
+        vk::PipelineStageFlagBits::eRayTracingShaderKHR;
+    // Stage of the shadow rays, shadow.rgen in the hybrid mode
+    vk::PipelineStageFlags shadow_stage = hybrid ? vk::PipelineStageFlagBits::eRayTracingShaderKHR : trace_stage;
+    auto record_frame = [&](const vk::UniqueCommandBuffer& cmd, uint32_t slot, uint32_t target_index)
+    {
+        cmd->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+        if (support_timestamps)
+        {
+            cmd->resetQueryPool(*timestamp_pool, slot * frame_timestamps, frame_timestamps);
+            cmd->writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *timestamp_pool, slot * frame_timestamps);
+        }
+        gpu_profiler->begin_frame(cmd, slot);
+        ray_counter.reset(cmd, slot, shadow_stage);
+        glm::uvec2 traced_size = frames[slot].traced_size;
+        if (tlas_refit)
+        {
+            uint32_t scope = gpu_profiler->begin(cmd, slot, "Update TLAS");
+            tlas_refit->record(cmd, slot);
+            gpu_profiler->end(cmd, slot, scope);
+        }
+
+        vk::ImageMemoryBarrier barrier;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+
+        if (hybrid)
+        {
+            // Leaves rt_output ready for the blit
+            hybrid->record(cmd, slot, traced_size, gpu_profiler.get());
+            if (support_timestamps)
+                cmd->writeTimestamp(vk::PipelineStageFlagBits::eColorAttachmentOutput, *timestamp_pool, slot * frame_timestamps + 1);
+        }
+        else
+        {
+            std::array<uint32_t, 3> dynamic_offsets{ frames[slot].uniform_offset, frames[slot].uniform_offset,
+                ray_counter_t::offset(slot) };
+            trace_push_t push{ glm::ivec2(0), glm::ivec2(traced_size) };
+            if (ray_query)
+            {
+                cmd->bindPipeline(vk::PipelineBindPoint::eCompute, *rq_pipeline);
+                cmd->bindDescriptorSets(vk::PipelineBindPoint::eCompute, *rq_pipeline_layout, 0, *rt_descr_sets, dynamic_offsets);
+                cmd->pushConstants<trace_query_push_t>(*rq_pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+                    trace_query_push_t{ push, traced_size });
+            }
+            else
+            {
+                cmd->bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, *rt_pipeline);
+                cmd->bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, 
+                    *rt_pipeline_layout, 0, *rt_descr_sets, dynamic_offsets);
+                cmd->pushConstants<trace_push_t>(*rt_pipeline_layout, vk::ShaderStageFlagBits::eRaygenKHR, 0, push);
+            }
+
+            // rt_output is shared by all the slots, the previous frame may still be reading it
+            barrier.image = *rt_output;
+            barrier.srcAccessMask = vk::AccessFlagBits::eTransferRead;
+            barrier.dstAccessMask = vk::AccessFlagBits::eShaderWrite;
             barrier.oldLayout = vk::ImageLayout::eUndefined;
-            barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
-            cmd_draw[i]->pipelineBarrier(vk::PipelineStageFlagBits::eAllGraphics, vk::PipelineStageFlagBits::eTransfer,
+            barrier.newLayout = vk::ImageLayout::eGeneral;
+            cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, trace_stage,
                 vk::DependencyFlagBits::eByRegion, nullptr, nullptr, barrier);
 
+            if (ray_query)
+            {
+                gpu_scope_t scope(cmd, gpu_profiler.get(), slot, "Ray Query");
+                cmd->dispatch((traced_size.x + 7) / 8, (traced_size.y + 7) / 8, 1);
+            }
+            else
+            {
+                gpu_scope_t scope(cmd, gpu_profiler.get(), slot, "Trace Rays");
+                const sbt_t& sbt = scene_gpu.sbt;
+                cmd->traceRaysKHR(sbt.regions[0], sbt.regions[1], sbt.regions[2], sbt.regions[3], traced_size.x, traced_size.y, 1);
+            }
+            if (support_timestamps)
+                cmd->writeTimestamp(trace_stage, *timestamp_pool, slot * frame_timestamps + 1);
+        }
+
+        // Blit to the target
+        debug_mark_begin(cmd, "Blit");
+        uint32_t blit_scope = gpu_profiler->begin(cmd, slot, "Blit");
+        // The headless target is shared by all the slots, the blit of the previous frame may still be writing it
+        barrier.image = target_images[target_index];
+        barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+        barrier.oldLayout = vk::ImageLayout::eUndefined;
+        barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer,
+            vk::DependencyFlagBits::eByRegion, nullptr, nullptr, barrier);
+
+        if (!hybrid)
+        {
             barrier.image = *rt_output;
             barrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
             barrier.dstAccessMask = vk::AccessFlagBits::eTransferRead;
             barrier.oldLayout = vk::ImageLayout::eGeneral;
             barrier.newLayout = vk::ImageLayout::eTransferSrcOptimal;
-            cmd_draw[i]->pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR, vk::PipelineStageFlagBits::eTransfer,
+            cmd->pipelineBarrier(trace_stage, vk::PipelineStageFlagBits::eTransfer,
                 vk::DependencyFlagBits::eByRegion, nullptr, nullptr, barrier);
+        }
 
-            vk::ImageBlit blit_region;
-            blit_region.srcSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
-            blit_region.srcOffsets[0] = vk::Offset3D(0, 0, 0);
-            blit_region.srcOffsets[1] = vk::Offset3D(output_size.x, output_size.y, 1);
-            blit_region.dstSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
-            blit_region.dstOffsets[0] = vk::Offset3D(0, 0, 0);
-            blit_region.dstOffsets[1] = vk::Offset3D(surface_caps.currentExtent.width, surface_caps.currentExtent.height, 1);
-            cmd_draw[i]->blitImage(*rt_output, vk::ImageLayout::eTransferSrcOptimal,
-                swapchain_images[i], vk::ImageLayout::eTransferDstOptimal, blit_region, vk::Filter::eLinear);
+        vk::ImageBlit blit_region;
+        blit_region.srcSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+        blit_region.srcOffsets[0] = vk::Offset3D(0, 0, 0);
+        blit_region.srcOffsets[1] = vk::Offset3D(traced_size.x, traced_size.y, 1);
+        blit_region.dstSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+        blit_region.dstOffsets[0] = vk::Offset3D(0, 0, 0);
+        blit_region.dstOffsets[1] = vk::Offset3D(extent.width, extent.height, 1);
+        cmd->blitImage(*rt_output, vk::ImageLayout::eTransferSrcOptimal,
+            target_images[target_index], vk::ImageLayout::eTransferDstOptimal, blit_region, vk::Filter::eLinear);
+
+        barrier.image = target_images[target_index];
+        barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        barrier.dstAccessMask = vk::AccessFlagBits::eMemoryRead;
+        barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+        barrier.newLayout = target_layout;
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe,
+            vk::DependencyFlagBits::eByRegion, nullptr, nullptr, barrier);
+        gpu_profiler->end(cmd, slot, blit_scope);
+        debug_mark_end(cmd);
+        ray_counter.copy(cmd, slot, shadow_stage);
+        if (support_timestamps)
+            cmd->writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *timestamp_pool, slot * frame_timestamps + 2);
+        cmd->end();
+    };
 
-            barrier.image = *rt_output;
-            barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
-            barrier.dstAccessMask = vk::AccessFlagBits::eShaderWrite;
-            barrier.oldLayout = vk::ImageLayout::eTransferSrcOptimal;
-            barrier.newLayout = vk::ImageLayout::eGeneral;
-            cmd_draw[i]->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-                vk::DependencyFlagBits::eByRegion, nullptr, nullptr, barrier);
+    benchmark_t benchmark(options.warmup, support_timestamps);
+    // The controller is driven by the GPU time, without timestamps the full size is traced
+    if (options.target_ms > 0.0 && !support_timestamps)
+        std::cout << "Dynamic resolution needs GPU timestamps, the full size is traced\n";
+    dynamic_resolution_t dynamic_resolution(glm::uvec2(output_size), support_timestamps ? options.target_ms : 0.0,
+        options.min_scale);
+    // There is no portable way to know when an image reaches the display, the latency is measured
+    // up to the first time the CPU sees the fence of the frame signaled
+    auto observe_latency = [&](frame_t& f)
+    {
+        if (!f.latency_pending)
+            return;
+        f.latency_pending = false;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - f.input_time).count();
+        benchmark.add_latency(swapchain ? present_mode_name(swapchain->get_present_mode()) : "offscreen", ms);
+    };
+    auto resolve_frame = [&](frame_t& f, uint32_t slot)
+    {
+        double trace_ms = 0.0;
+        double gpu_ms = 0.0;
+        if (support_timestamps)
+        {
+            std::array<uint64_t, frame_timestamps> timestamps{};
+            if (device->getQueryPoolResults(*timestamp_pool, slot * frame_timestamps, frame_timestamps, sizeof(timestamps),
+                timestamps.data(), sizeof(uint64_t), vk::QueryResultFlagBits::e64) == vk::Result::eSuccess)
+            {
+                trace_ms = (timestamps[1] - timestamps[0]) * pd_props.limits.timestampPeriod / 1e6;
+                gpu_ms = (timestamps[2] - timestamps[0]) * pd_props.limits.timestampPeriod / 1e6;
+            }
+        }
+        observe_latency(f);
+        // Primary rays are the traced pixels, none in the hybrid mode where the G-buffer is rasterized
+        uint64_t primary_rays = hybrid ? 0 : (uint64_t)f.traced_size.x * f.traced_size.y;
+        benchmark.add_frame(f.cpu_ms, gpu_ms, primary_rays, ray_counter.read(slot));
+        if (support_timestamps)
+            dynamic_resolution.add_sample(trace_ms, f.traced_size);
+        gpu_profiler->resolve(slot);
+        f.pending = false;
+    };
 
-            barrier.image = swapchain_images[i];
-            barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
-            barrier.dstAccessMask = vk::AccessFlagBits::eMemoryRead;
-            barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
-            barrier.newLayout = vk::ImageLayout::ePresentSrcKHR;
-            cmd_draw[i]->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eColorAttachmentOutput,
-                vk::DependencyFlagBits::eByRegion, nullptr, nullptr, barrier);
+    // The camera is returned for the rasterized passes of the hybrid mode
+    auto update_uniforms = [](uniform_rt_buffers_t* uniforms, float angle, float aspect)
+    {
+        camera_t cam = orbit_camera(angle, aspect);
+        uniforms->proj_inverse = glm::inverse(cam.proj);
+        uniforms->view_inverse = glm::inverse(cam.view);
+        uniforms->color = glm::vec4(glm::sin(angle * 5.f), 0, 0, 1);
+        uniforms->light_pos = glm::vec4(cam.light_pos, 1.f);
+        return cam;
+    };
+    // glm projects the depth to [-1, 1], Vulkan clips it to [0, 1]
+    const glm::mat4 depth_zero_to_one(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0.5f, 0, 0, 0, 0.5f, 1);
+
+    CPU_ZONE_END(phase);
+    CPU_ZONE_END(startup);
+
+    // Offline still, replaces the frame loop
+    if (!options.render_path.empty())
+    {
+        CPU_ZONE("Tiled Render");
+        glm::uvec2 render_size(options.render_width, options.render_height);
+        camera_t cam = update_uniforms(frames[0].uniforms, still_angle, (float)render_size.x / (float)render_size.y);
+        uint32_t tile = (uint32_t)std::min(output_size.x, output_size.y);
+        // The still goes through the active backend, so each of them can be checked against the CPU reference
+        tile_recorder_t record_tile;
+        uint32_t in_flight = 2;
+        if (hybrid)
+        {
+            // Every tile rasterizes its own part of the frustum, the hybrid slot holds its uniforms
+            in_flight = std::min(in_flight, options.frames_in_flight);
+            record_tile = [&](const vk::UniqueCommandBuffer& cmd, uint32_t slot, glm::uvec2 origin, glm::uvec2 extent)
+            {
+                glm::vec2 scale = glm::vec2(render_size) / glm::vec2(extent);
+                glm::vec2 offset = (glm::vec2(render_size) - 2.f * glm::vec2(origin)) / glm::vec2(extent) - 1.f;
+                glm::mat4 tile_mat(1.f);
+                tile_mat[0][0] = scale.x;
+                tile_mat[1][1] = scale.y;
+                tile_mat[3][0] = offset.x;
+                tile_mat[3][1] = offset.y;
+                hybrid->update(slot, cam.view, tile_mat * depth_zero_to_one * cam.proj, cam.pos, cam.light_pos, node_mats, false);
+                hybrid->record(cmd, slot, extent, nullptr);
+            };
+        }
+        else
+        {
+            tiled_trace_t trace;
+            trace.pipeline = ray_query ? *rq_pipeline : *rt_pipeline;
+            trace.layout = ray_query ? *rq_pipeline_layout : *rt_pipeline_layout;
+            trace.descriptor_set = *rt_descr_sets;
+            trace.dynamic_offsets = { frames[0].uniform_offset, frames[0].uniform_offset, ray_counter_t::offset(0) };
+            trace.sbt = scene_gpu.sbt.regions;
+            trace.tile_image = *rt_output;
+            trace.ray_query = ray_query;
+            record_tile = trace_tile_recorder(trace, render_size);
         }
-        cmd_draw[i]->end();
-        submit_commands[i] = *cmd_draw[i];
+        tiled_render_stats_t render_stats = render_tiled(*allocator, q, device_family, *rt_output, record_tile, in_flight,
+            render_size, tile, options.render_path, support_timestamps ? pd_props.limits.timestampPeriod : 0.f);
+        std::cout << fmt::format("Tiled render {} ({}x{}): {} tiles of {}, {:.3f} ms, slowest tile GPU {:.3f} ms, "
+            "device memory {:.2f} MB\n", options.render_path, render_size.x, render_size.y, render_stats.tiles, tile,
+            render_stats.cpu_ms, render_stats.tile_gpu_ms_max, render_stats.device_bytes / (1024.0 * 1024.0));
+        if (!cpu_image.empty())
+            compare_golden(options.render_path, render_size, cpu_image, hybrid ? "hybrid" : ray_query ? "ray query" : "RT pipeline");
+        running = false;
     }
 
-    MSG msg;
+    // Out of date swapchain, resized window or new present mode: rebuild the swapchain and
+    // the output image, false while the window is minimized
+    auto recreate_targets = [&]() -> bool
+    {
+        // Only the frames use the targets, the build queues may be busy with a streamed scene
+        q.waitIdle();
+        for (uint32_t i = 0; i < frames.size(); i++)
+            if (frames[i].pending)
+                resolve_frame(frames[i], i);
+        if (!swapchain->recreate())
+            return false;
+        extent = swapchain->get_extent();
+        target_images = swapchain->get_images();
+        target_fences.assign(target_images.size(), nullptr);
+
+        output_size = glm::ivec2(extent.width, extent.height) * (int)super_sample;
+        std::tie(rt_output, rt_output_mem, rt_output_view) =
+            create_gbuffer("GBufferPOS", vk::Extent2D(output_size.x, output_size.y), vk::Format::eR8G8B8A8Unorm, rt_output_usage);
+        rt_descr_set_image.imageView = *rt_output_view;
+        device->updateDescriptorSets(
+            vk::WriteDescriptorSet(*rt_descr_sets, 1, 0, 1, vk::DescriptorType::eStorageImage, &rt_descr_set_image), nullptr);
+        if (hybrid)
+            hybrid->resize(glm::uvec2(output_size), *rt_output_view);
+        dynamic_resolution.resize(glm::uvec2(output_size));
+        return true;
+    };
+    bool targets_valid = true;
+
+    // Streamed scene, read, uploaded and built on its own thread while the frames trace the current
+    // one. The upload, the builds and the release are chained on the transfer and build queues, the
+    // frame loop only picks the scene up once it is ready and the GPU waits for the release.
+    std::future<scene_gpu_t> scene_streaming;
+    std::optional<scene_gpu_t> retired_scene;
+    uint32_t retire_frame = 0;
+    if (!options.stream_scene_path.empty())
+    {
+        scene_streaming = std::async(std::launch::async, [&]
+        {
+            cpu_profiler_thread_name("Scene Streamer");
+            auto start = std::chrono::high_resolution_clock::now();
+            scene_t streamed = load_scene(options.stream_scene_path, options.scene_cache, options.dedup, jobs);
+            // The GPU profiler slots belong to the frames, the BLAS build is only timed on its own
+            scene_gpu_t s = create_scene_gpu(streamed, jobs, timestamp_period, nullptr);
+            // The SBT is copied on the build queue as well, before the release signals the scene ready
+            std::vector<uint32_t> sbt_families;
+            if (compute_family != device_family)
+                sbt_families = { compute_family, device_family };
+            s.sbt = build_sbt(s.materials, compute_q, *compute_cmdpool, sbt_families);
+            release_scene(s);
+            s.load_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            return s;
+        });
+    }
+
+    uint32_t frame_count = 0;
+    auto frame_start = std::chrono::high_resolution_clock::now();
     while (running)
     {
-        if (PeekMessage(&msg, hWnd, 0, 0, PM_REMOVE))
+#ifdef _WIN32
+        MSG msg;
+        if (!options.headless && PeekMessage(&msg, hWnd, 0, 0, PM_REMOVE))
         {
             TranslateMessage(&msg);
             DispatchMessage(&msg);
         }
+#endif
 
         if (!running)
             break;
 
-        vk::UniqueSemaphore backbuffer_semaphore = device->createSemaphoreUnique({});
-        debug_name(backbuffer_semaphore, "backbuffer_semaphore");
-        auto backbuffer = device->acquireNextImageKHR(*swapchain, UINT64_MAX, *backbuffer_semaphore, nullptr);
-        if (backbuffer.result == vk::Result::eSuccess)
+        if (swapchain && (window_resized || cycle_present_mode || !targets_valid))
         {
-            static float angle = 0.f;
-            angle += glm::radians(1.f);
-            glm::vec3 cam_pos = glm::vec3(glm::cos(angle * 0.1f), 0.5f, glm::sin(angle * 0.1f)) * 3.f;
-            glm::vec3 light_pos = glm::vec3(glm::cos(angle), 0.3f, glm::sin(angle)) * 5.f;
-            float aspect = (float)output_size.x / (float)output_size.y;
-            if (auto ptr = reinterpret_cast<uniform_rt_buffers_t*>(device->mapMemory(*uniform_rt_mem, 0, VK_WHOLE_SIZE)))
+            if (cycle_present_mode)
+                swapchain->set_present_mode(next_present_mode(swapchain->get_present_mode()));
+            window_resized = cycle_present_mode = false;
+            targets_valid = recreate_targets();
+            if (!targets_valid)
             {
-                ptr->proj_inverse = glm::inverse(glm::perspective(glm::radians(85.f), aspect, .1f, 100.f));
-                ptr->view_inverse = glm::inverse(glm::lookAt(cam_pos, glm::vec3(0, 0, 0), glm::vec3(0, -1, 0)));
-                ptr->color = glm::vec4(glm::sin(angle * 5.f), 0, 0, 1);
-                ptr->light_pos = glm::vec4(light_pos, 1.f);
-                device->unmapMemory(*uniform_rt_mem);
+#ifdef _WIN32
+                WaitMessage();
+#endif
+                continue;
             }
+        }
 
-            vk::SubmitInfo cmd_trace_submit;
-            cmd_trace_submit.commandBufferCount = 1;
-            cmd_trace_submit.pCommandBuffers = &cmd_trace.get();
-            q.submit(cmd_trace_submit, nullptr);
-            
-            vk::UniqueSemaphore render_sem = device->createSemaphoreUnique({});
-            debug_name(render_sem, "render_sem");
-            std::array<vk::PipelineStageFlags, 1> wait_stages{ vk::PipelineStageFlagBits::eColorAttachmentOutput };
-            vk::SubmitInfo submit_info;
+        // Record the latency of the frames that completed since the last iteration
+        for (auto& pending_frame : frames)
+            if (pending_frame.latency_pending && device->getFenceStatus(*pending_frame.fence) == vk::Result::eSuccess)
+                observe_latency(pending_frame);
+
+        CPU_ZONE("Frame");
+        CPU_ZONE_NAMED(frame_phase, "Wait Slot");
+        // Only wait for the slot that is about to be reused
+        uint32_t slot = frame_count % options.frames_in_flight;
+        frame_t& f = frames[slot];
+        if (f.pending)
+        {
+            device->waitForFences(*f.fence, true, UINT64_MAX);
+            resolve_frame(f, slot);
+        }
+
+        // Swap in the streamed scene between two frames, the frames in flight keep the previous one
+        // until the slot waits above have seen all of them complete
+        if (scene_streaming.valid() && scene_streaming.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            retired_scene = std::move(scene_gpu);
+            scene_gpu = scene_streaming.get();
+            acquire_scene(scene_gpu);
+            write_rt_descr_set(*stream_descr_sets, scene_gpu);
+            std::swap(rt_descr_sets, stream_descr_sets);
+            retire_frame = frame_count + options.frames_in_flight - 1;
+            std::cout << fmt::format("Streamed scene {}: {} meshes, {} instances, {} materials, loaded and built in {:.3f} ms, "
+                "traced from frame {}\n", options.stream_scene_path, scene_gpu.meshes.size(), scene_gpu.rt_instances.size(),
+                scene_gpu.materials.size(), scene_gpu.load_ms, frame_count);
+        }
+        if (retired_scene && frame_count >= retire_frame)
+            retired_scene.reset();
+
+        // Headless frames always render into the single offscreen target
+        CPU_ZONE_NEXT(frame_phase, "Acquire");
+        uint32_t target_index = 0;
+        if (!options.headless)
+        {
+            vk::ResultValue<uint32_t> backbuffer(vk::Result::eErrorOutOfDateKHR, 0);
+            try
+            {
+                backbuffer = device->acquireNextImageKHR(swapchain->get(), UINT64_MAX, *f.acquire_sem, nullptr);
+            }
+            catch (const vk::OutOfDateKHRError&)
+            {
+            }
+            // Suboptimal still signals the semaphore, the frame goes on and the swapchain is rebuilt after it
+            if (backbuffer.result != vk::Result::eSuccess && backbuffer.result != vk::Result::eSuboptimalKHR)
+            {
+                targets_valid = false;
+                continue;
+            }
+            if (backbuffer.result == vk::Result::eSuboptimalKHR)
+                window_resized = true;
+            target_index = backbuffer.value;
+            // The image can still be in use by another slot when the swapchain has more images than slots
+            if (target_fences[target_index] && target_fences[target_index] != *f.fence)
+                device->waitForFences(target_fences[target_index], true, UINT64_MAX);
+            target_fences[target_index] = *f.fence;
+        }
+
+        CPU_ZONE_NEXT(frame_phase, "Update");
+        static float angle = 0.f;
+        angle += glm::radians(1.f);
+        camera_t cam = update_uniforms(f.uniforms, angle, (float)output_size.x / (float)output_size.y);
+        f.input_time = std::chrono::high_resolution_clock::now();
+
+        if (tlas_refit)
+        {
+            // Spin every node around its own Y axis, alternating the direction
+            uint32_t instance_index = 0;
+            const std::vector<mesh_t>& meshes = scene_gpu.meshes;
+            for (uint32_t node_index = 0; node_index < scene_gpu.nodes.size(); node_index++)
+            {
+                const node_t& n = scene_gpu.nodes[node_index];
+                glm::mat4 node_mat = n.mat * glm::rotate(angle * (node_index % 2 ? 1.f : -1.f), glm::vec3(0, 1, 0));
+                if (hybrid)
+                    node_mats[node_index] = node_mat;
+                for (const auto& mesh_index : n.mesh_indices)
+                {
+                    glm::mat4 mat = node_mat * meshes[mesh_index].dequant;
+                    auto& inst = frame_instances[instance_index];
+                    for (int i = 0; i < 3; i++)
+                        for (int j = 0; j < 4; j++)
+                            inst.transform.matrix[i][j] = mat[j][i];
+                    frame_instance_bounds[instance_index] = meshes[mesh_index].bounds.transform(node_mat);
+                    instance_index++;
+                }
+            }
+            tlas_refit->write(slot, frame_instances, frame_instance_bounds);
+        }
+        if (hybrid)
+            hybrid->update(slot, cam.view, depth_zero_to_one * cam.proj, cam.pos, cam.light_pos, node_mats, options.gbuffer_view);
+
+        CPU_ZONE_NEXT(frame_phase, "Record");
+        f.traced_size = dynamic_resolution.size();
+        device->resetCommandPool(*f.cmdpool, {});
+        record_frame(f.cmd, slot, target_index);
+
+        CPU_ZONE_NEXT(frame_phase, "Submit");
+        std::array<vk::PipelineStageFlags, 1> wait_stages{ vk::PipelineStageFlagBits::eTransfer };
+        vk::SubmitInfo submit_info;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &f.cmd.get();
+        if (!options.headless)
+        {
             submit_info.signalSemaphoreCount = 1;
-            submit_info.pSignalSemaphores = &render_sem.get();
+            submit_info.pSignalSemaphores = &f.render_sem.get();
             submit_info.waitSemaphoreCount = 1;
-            submit_info.pWaitSemaphores = &backbuffer_semaphore.get();
+            submit_info.pWaitSemaphores = &f.acquire_sem.get();
             submit_info.pWaitDstStageMask = wait_stages.data();
-            submit_info.commandBufferCount = 1;
-            submit_info.pCommandBuffers = &submit_commands[backbuffer.value];
-            q.submit(submit_info, nullptr);
+        }
+        device->resetFences(*f.fence);
+        q.submit(submit_info, *f.fence);
 
+        CPU_ZONE_NEXT(frame_phase, "Present");
+        if (!options.headless)
+        {
             vk::PresentInfoKHR present_info;
             present_info.waitSemaphoreCount = 1;
-            present_info.pWaitSemaphores = &render_sem.get();
+            present_info.pWaitSemaphores = &f.render_sem.get();
             present_info.swapchainCount = 1;
-            present_info.pSwapchains = &swapchain.get();
-            present_info.pImageIndices = &backbuffer.value;
-            q.presentKHR(present_info);
-            q.waitIdle();
+            present_info.pSwapchains = swapchain->get_ptr();
+            present_info.pImageIndices = &target_index;
+            try
+            {
+                if (q.presentKHR(present_info) == vk::Result::eSuboptimalKHR)
+                    window_resized = true;
+            }
+            catch (const vk::OutOfDateKHRError&)
+            {
+                targets_valid = false;
+            }
         }
+        f.latency_pending = true;
+
+        CPU_ZONE_END(frame_phase);
+
+        auto frame_end = std::chrono::high_resolution_clock::now();
+        f.cpu_ms = std::chrono::duration<double, std::milli>(frame_end - frame_start).count();
+        f.pending = true;
+        frame_start = frame_end;
+
+        frame_count++;
+        if (options.frames > 0 && frame_count >= options.frames)
+            running = false;
+    }
+
+    // A scene still streaming at the end of the run is waited for, it is never traced. It is kept
+    // until the device is idle, its release may still be pending on the build queue.
+    if (scene_streaming.valid())
+    {
+        retired_scene = scene_streaming.get();
+        std::cout << fmt::format("Streamed scene {} was not ready before the last frame\n", options.stream_scene_path);
+    }
+    device->waitIdle();
+    for (uint32_t i = 0; i < frames.size(); i++)
+        if (frames[i].pending)
+            resolve_frame(frames[i], i);
+    pipeline_cache->save();
+    if (tlas_refit)
+    {
+        const auto& refit_stats = tlas_refit->get_stats();
+        std::cout << fmt::format("TLAS refit: {} updates, {} rebuilds, degradation {:.2f} (threshold {:.2f})\n",
+            refit_stats.updates, refit_stats.rebuilds, refit_stats.degradation, options.refit_threshold);
     }
+    dynamic_resolution.report();
+    std::cout << fmt::format("Render mode: {}\n", !hybrid ? ray_query ? "ray traced primary and shadow rays (ray query)" :
+        "ray traced primary and shadow rays (RT pipeline)" : options.gpu_driven ?
+        "hybrid (GPU-culled indirect G-buffer, shadow rays)" : "hybrid (rasterized G-buffer, shadow rays)");
+    // The cost of the geometry encoding on the build and on the traversal, compare the runs with
+    // and without --compress-geometry
+    const char* trace_scope = hybrid ? "Shadow Rays" : ray_query ? "Ray Query" : "Trace Rays";
+    double trace_ms = gpu_profiler->average(trace_scope);
+    std::cout << fmt::format("Geometry {}: BLAS build GPU {}, {} GPU {}\n", scene_gpu.geometry_encoding,
+        compute_timestamps ? fmt::format("{:.3f} ms", scene_gpu.blas_stats.gpu_ms) : "unavailable", trace_scope,
+        trace_ms > 0.0 ? fmt::format("{:.3f} ms/frame", trace_ms) : "unavailable");
+    benchmark.report();
+    gpu_profiler->report();
+    cpu_profiler_report();
+    // The GPU timestamps are in another clock domain, the two timelines are separate processes
+    gpu_profiler->finish(cpu_profiler_trace_events());
 
     debug_messenger.reset();
     exit(EXIT_SUCCESS);
 }
 
-int main()
+int main(int argc, char** argv)
 {
     try
     {
+        options = parse_options(argc, argv);
         main_run();
     }
     catch (vk::DeviceLostError* e)
@@ -1012,4 +2061,9 @@ int main()
         std::cout << "DEVICE LOST: " << e->what() << std::endl;
         abort();
     }
+    catch (const std::exception& e)
+    {
+        std::cout << "ERROR: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 }
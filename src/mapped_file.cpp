@@ -0,0 +1,85 @@
+#include "pch.h"
+#include "mapped_file.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mapped_file_t::mapped_file_t(const std::string& path)
+{
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("cannot open the file " + path);
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    length = (size_t)file_size.QuadPart;
+    if (length == 0)
+        return;
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping)
+        ptr = reinterpret_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("cannot open the file " + path);
+    struct stat st;
+    fstat(fd, &st);
+    length = (size_t)st.st_size;
+    if (length == 0)
+        return;
+    void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED)
+    {
+        ptr = reinterpret_cast<const uint8_t*>(p);
+        madvise(p, length, MADV_SEQUENTIAL);
+    }
+#endif
+    if (!ptr)
+    {
+        close();
+        throw std::runtime_error("cannot map the file " + path);
+    }
+}
+
+mapped_file_t& mapped_file_t::operator=(mapped_file_t&& other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+#ifdef _WIN32
+        file = std::exchange(other.file, INVALID_HANDLE_VALUE);
+        mapping = std::exchange(other.mapping, (HANDLE)NULL);
+#else
+        fd = std::exchange(other.fd, -1);
+#endif
+        ptr = std::exchange(other.ptr, nullptr);
+        length = std::exchange(other.length, 0);
+    }
+    return *this;
+}
+
+void mapped_file_t::close()
+{
+#ifdef _WIN32
+    if (ptr)
+        UnmapViewOfFile(ptr);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+#else
+    if (ptr)
+        munmap(const_cast<uint8_t*>(ptr), length);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+#endif
+    ptr = nullptr;
+    length = 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+
+// Read-only memory mapping of a whole file
+class mapped_file_t
+{
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+    const uint8_t* ptr = nullptr;
+    size_t length = 0;
+public:
+    mapped_file_t() = default;
+    explicit mapped_file_t(const std::string& path);
+    mapped_file_t(const mapped_file_t&) = delete;
+    mapped_file_t& operator=(const mapped_file_t&) = delete;
+    mapped_file_t(mapped_file_t&& other) noexcept { *this = std::move(other); }
+    mapped_file_t& operator=(mapped_file_t&& other) noexcept;
+    ~mapped_file_t() { close(); }
+    void close();
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return length; }
+    explicit operator bool() const { return ptr != nullptr; }
+};
@@ -0,0 +1,360 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "memory.h"
+
+static constexpr vk::DeviceSize align_up(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static const char* usage_name(memory_usage_t usage)
+{
+    switch (usage)
+    {
+    case memory_usage_t::device_local:
+        return "device-local";
+    case memory_usage_t::upload:
+        return "upload";
+    case memory_usage_t::readback:
+        return "readback";
+    case memory_usage_t::device_address:
+        return "device-address";
+    }
+    return "unknown";
+}
+
+allocation_t& allocation_t::operator=(allocation_t&& other) noexcept
+{
+    if (this != &other)
+    {
+        reset();
+        allocator = std::exchange(other.allocator, nullptr);
+        pool = other.pool;
+        block = other.block;
+        memory = std::exchange(other.memory, nullptr);
+        offset = other.offset;
+        size = other.size;
+        mapped = std::exchange(other.mapped, nullptr);
+    }
+    return *this;
+}
+
+void allocation_t::reset()
+{
+    if (allocator)
+        allocator->free(*this);
+    allocator = nullptr;
+    memory = nullptr;
+    mapped = nullptr;
+}
+
+memory_allocator_t::memory_allocator_t(const vk::UniqueDevice& device, vk::PhysicalDevice physical_device, bool buffer_device_address)
+    : dev(device), device_address(buffer_device_address)
+{
+    mem_props = physical_device.getMemoryProperties();
+    granularity = physical_device.getProperties().limits.bufferImageGranularity;
+}
+
+uint32_t memory_allocator_t::find_memory_type(uint32_t type_bits, memory_usage_t usage)
+{
+    auto key = std::make_pair(type_bits, usage);
+    if (auto it = type_cache.find(key); it != type_cache.end())
+        return it->second;
+
+    // Required flags followed by the preferred ones, the first match wins
+    std::vector<vk::MemoryPropertyFlags> candidates;
+    switch (usage)
+    {
+    case memory_usage_t::device_local:
+    case memory_usage_t::device_address:
+        candidates = { vk::MemoryPropertyFlagBits::eDeviceLocal, {} };
+        break;
+    case memory_usage_t::upload:
+        candidates = { vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent };
+        break;
+    case memory_usage_t::readback:
+        candidates = {
+            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostCached,
+            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent };
+        break;
+    }
+    for (const auto& flags : candidates)
+    {
+        for (uint32_t mem_i = 0; mem_i < mem_props.memoryTypeCount; mem_i++)
+        {
+            if ((1 << mem_i) & type_bits && (mem_props.memoryTypes[mem_i].propertyFlags & flags) == flags)
+            {
+                type_cache[key] = mem_i;
+                return mem_i;
+            }
+        }
+    }
+    throw std::runtime_error(fmt::format("find_memory_type failed for {} memory", usage_name(usage)));
+}
+
+uint32_t memory_allocator_t::find_pool(uint32_t type_index, memory_usage_t usage, block_strategy_t strategy)
+{
+    for (uint32_t i = 0; i < pools.size(); i++)
+        if (pools[i].type_index == type_index && pools[i].usage == usage && pools[i].strategy == strategy)
+            return i;
+
+    pool_t& pool = pools.emplace_back();
+    pool.type_index = type_index;
+    pool.usage = usage;
+    pool.strategy = strategy;
+    // Host visible memory is usually a smaller heap
+    vk::DeviceSize heap_size = mem_props.memoryHeaps[mem_props.memoryTypes[type_index].heapIndex].size;
+    vk::DeviceSize block_size = (usage == memory_usage_t::upload || usage == memory_usage_t::readback) ? 16ull << 20 : 64ull << 20;
+    pool.block_size = std::min(block_size, align_up(heap_size / 8, 1ull << 20));
+    return (uint32_t)pools.size() - 1;
+}
+
+uint32_t memory_allocator_t::create_block(pool_t& pool, vk::DeviceSize size, bool dedicated)
+{
+    // Reuse an empty slot left by a released dedicated block
+    uint32_t index = (uint32_t)pool.blocks.size();
+    for (uint32_t i = 0; i < pool.blocks.size(); i++)
+        if (!pool.blocks[i].memory)
+            index = i;
+    if (index == pool.blocks.size())
+        pool.blocks.emplace_back();
+
+    block_t& block = pool.blocks[index];
+    vk::StructureChain mem_info{
+        vk::MemoryAllocateInfo(size, pool.type_index),
+        vk::MemoryAllocateFlagsInfo(vk::MemoryAllocateFlagBits::eDeviceAddress) };
+    // Device address is needed by geometry, instance, scratch and SBT buffers which can live in any
+    // of the pools, only the device-local pool for images and acceleration structures goes without
+    if (!device_address || pool.usage == memory_usage_t::device_local)
+        mem_info.unlink<vk::MemoryAllocateFlagsInfo>();
+    block.memory = dev->allocateMemoryUnique(mem_info.get<vk::MemoryAllocateInfo>());
+    debug_name(dev, *block.memory, fmt::format("{} Pool#{} Block#{}{}", usage_name(pool.usage), 
+        pool.type_index, index, dedicated ? " (dedicated)" : ""));
+    block.size = size;
+    block.dedicated = dedicated;
+    block.live = 0;
+    block.used = 0;
+    block.head = 0;
+    block.free.clear();
+    block.free[0] = size;
+    block.mapped = nullptr;
+    if (mem_props.memoryTypes[pool.type_index].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible)
+        block.mapped = reinterpret_cast<uint8_t*>(dev->mapMemory(*block.memory, 0, VK_WHOLE_SIZE));
+    return index;
+}
+
+bool memory_allocator_t::allocate_from(pool_t& pool, block_t& block, vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize& offset)
+{
+    if (!block.memory)
+        return false;
+    if (pool.strategy == block_strategy_t::linear)
+    {
+        vk::DeviceSize start = align_up(block.head, alignment);
+        if (start + size > block.size)
+            return false;
+        offset = start;
+        block.head = start + size;
+        return true;
+    }
+
+    for (auto it = block.free.begin(); it != block.free.end(); ++it)
+    {
+        vk::DeviceSize start = align_up(it->first, alignment);
+        vk::DeviceSize end = it->first + it->second;
+        if (start + size > end)
+            continue;
+        // Split the free range in the leftovers before and after the allocation
+        vk::DeviceSize range_begin = it->first;
+        block.free.erase(it);
+        if (start > range_begin)
+            block.free[range_begin] = start - range_begin;
+        if (start + size < end)
+            block.free[start + size] = end - (start + size);
+        offset = start;
+        return true;
+    }
+    return false;
+}
+
+allocation_t memory_allocator_t::allocate(const vk::MemoryRequirements& req, memory_usage_t usage, resource_kind_t kind,
+    block_strategy_t strategy)
+{
+    std::lock_guard lock(mutex);
+    uint32_t type_index = find_memory_type(req.memoryTypeBits, usage);
+    uint32_t pool_index = find_pool(type_index, usage, strategy);
+    pool_t& pool = pools[pool_index];
+
+    // Optimal images own whole granularity pages, so they never share one with a linear resource
+    vk::DeviceSize alignment = std::max<vk::DeviceSize>(req.alignment, 1);
+    vk::DeviceSize size = req.size;
+    if (kind == resource_kind_t::optimal && granularity > 1)
+    {
+        alignment = std::max(alignment, granularity);
+        size = align_up(size, granularity);
+    }
+
+    uint32_t block_index = UINT32_MAX;
+    vk::DeviceSize offset = 0;
+    if (size > pool.block_size / 2)
+    {
+        block_index = create_block(pool, size, true);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < pool.blocks.size(); i++)
+        {
+            if (!pool.blocks[i].dedicated && allocate_from(pool, pool.blocks[i], size, alignment, offset))
+            {
+                block_index = i;
+                break;
+            }
+        }
+        if (block_index == UINT32_MAX)
+        {
+            block_index = create_block(pool, pool.block_size, false);
+            allocate_from(pool, pool.blocks[block_index], size, alignment, offset);
+        }
+    }
+
+    block_t& block = pool.blocks[block_index];
+    block.live++;
+    block.used += size;
+    pool.allocation_count++;
+
+    allocation_t alloc;
+    alloc.allocator = this;
+    alloc.pool = pool_index;
+    alloc.block = block_index;
+    alloc.memory = *block.memory;
+    alloc.offset = offset;
+    alloc.size = size;
+    alloc.mapped = block.mapped ? block.mapped + offset : nullptr;
+    return alloc;
+}
+
+void memory_allocator_t::free(const allocation_t& alloc)
+{
+    std::lock_guard lock(mutex);
+    pool_t& pool = pools[alloc.pool];
+    block_t& block = pool.blocks[alloc.block];
+    block.live--;
+    block.used -= alloc.size;
+
+    if (block.dedicated)
+    {
+        if (block.live == 0)
+            block.memory.reset();
+        return;
+    }
+    if (pool.strategy == block_strategy_t::linear)
+    {
+        if (block.live == 0)
+            block.head = 0;
+        return;
+    }
+
+    // Insert the range and merge it with the adjacent free ranges
+    auto it = block.free.emplace(alloc.offset, alloc.size).first;
+    if (auto next = std::next(it); next != block.free.end() && it->first + it->second == next->first)
+    {
+        it->second += next->second;
+        block.free.erase(next);
+    }
+    if (it != block.free.begin())
+    {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second == it->first)
+        {
+            prev->second += it->second;
+            block.free.erase(it);
+        }
+    }
+}
+
+allocation_t memory_allocator_t::bind(vk::Buffer buffer, memory_usage_t usage, block_strategy_t strategy)
+{
+    allocation_t alloc = allocate(dev->getBufferMemoryRequirements(buffer), usage, resource_kind_t::linear, strategy);
+    dev->bindBufferMemory(buffer, alloc.memory, alloc.offset);
+    return alloc;
+}
+
+allocation_t memory_allocator_t::bind(vk::Image image, memory_usage_t usage)
+{
+    allocation_t alloc = allocate(dev->getImageMemoryRequirements(image), usage, resource_kind_t::optimal);
+    dev->bindImageMemory(image, alloc.memory, alloc.offset);
+    return alloc;
+}
+
+allocation_t memory_allocator_t::bind(vk::AccelerationStructureKHR as)
+{
+    vk::MemoryRequirements2 req = dev->getAccelerationStructureMemoryRequirementsKHR({
+        vk::AccelerationStructureMemoryRequirementsTypeKHR::eObject,
+        vk::AccelerationStructureBuildTypeKHR::eDevice, as });
+    allocation_t alloc = allocate(req.memoryRequirements, memory_usage_t::device_local, resource_kind_t::linear);
+    dev->bindAccelerationStructureMemoryKHR({ { as, alloc.memory, alloc.offset } });
+    return alloc;
+}
+
+void memory_allocator_t::report() const
+{
+    std::lock_guard lock(mutex);
+    std::cout << "Device memory pools:\n";
+    for (const auto& pool : pools)
+    {
+        vk::DeviceSize total = 0, used = 0, free_total = 0, free_largest = 0;
+        uint32_t blocks = 0, live = 0;
+        for (const auto& block : pool.blocks)
+        {
+            if (!block.memory)
+                continue;
+            blocks++;
+            live += block.live;
+            total += block.size;
+            used += block.used;
+            if (block.dedicated)
+                continue;
+            if (pool.strategy == block_strategy_t::linear)
+            {
+                free_total += block.size - block.head;
+                free_largest = std::max(free_largest, block.size - block.head);
+            }
+            else
+            {
+                for (const auto& [offset, size] : block.free)
+                {
+                    free_total += size;
+                    free_largest = std::max(free_largest, size);
+                }
+            }
+        }
+        // 0% when the free space is one contiguous range, close to 100% when it's scattered
+        double fragmentation = free_total ? 100.0 * (1.0 - (double)free_largest / free_total) : 0.0;
+        std::cout << fmt::format("  type {} {:<14} {:<9} blocks {:3}  allocations {:5} live / {:6} total  "
+            "used {:9.2f} / {:9.2f} MB  fragmentation {:5.1f}%\n",
+            pool.type_index, usage_name(pool.usage), pool.strategy == block_strategy_t::linear ? "linear" : "free-list",
+            blocks, live, pool.allocation_count, used / (1024.0 * 1024.0), total / (1024.0 * 1024.0), fragmentation);
+    }
+}
+
+buffer_t create_buffer(memory_allocator_t& allocator, const std::string& name, vk::DeviceSize size,
+    vk::BufferUsageFlags usage, memory_usage_t mem_usage, block_strategy_t strategy,
+    const std::vector<uint32_t>& queue_families)
+{
+    const vk::UniqueDevice& device = allocator.device();
+    buffer_t b;
+    vk::BufferCreateInfo info;
+    info.size = size;
+    info.usage = usage;
+    if (queue_families.size() > 1)
+    {
+        info.sharingMode = vk::SharingMode::eConcurrent;
+        info.queueFamilyIndexCount = (uint32_t)queue_families.size();
+        info.pQueueFamilyIndices = queue_families.data();
+    }
+    b.buffer = device->createBufferUnique(info);
+    debug_name(b.buffer, name);
+    b.mem = allocator.bind(*b.buffer, mem_usage, strategy);
+    if (usage & vk::BufferUsageFlagBits::eShaderDeviceAddress)
+        b.address = device->getBufferAddressKHR({ *b.buffer });
+    return b;
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <mutex>
+
+enum class memory_usage_t
+{
+    device_local,       // GPU only: images, acceleration structures
+    upload,             // host visible and coherent, written by the CPU and read by the GPU
+    readback,           // host visible, cached when available, written by the GPU and read by the CPU
+    device_address,     // GPU only buffers accessed through their device address
+};
+
+enum class block_strategy_t
+{
+    free_list,          // first fit with coalescing, for long lived resources
+    linear,             // bump allocation, the block is recycled when all its allocations are freed
+};
+
+// Resources that must not share a bufferImageGranularity page
+enum class resource_kind_t
+{
+    linear,             // buffers, acceleration structures, linear images
+    optimal,            // optimal tiling images
+};
+
+class memory_allocator_t;
+
+// Sub-range of a device memory block, returned to its pool when destroyed
+class allocation_t
+{
+    friend class memory_allocator_t;
+    memory_allocator_t* allocator = nullptr;
+    uint32_t pool = 0;
+    uint32_t block = 0;
+public:
+    vk::DeviceMemory memory;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    uint8_t* mapped = nullptr;      // persistent mapping for host visible pools
+
+    allocation_t() = default;
+    allocation_t(const allocation_t&) = delete;
+    allocation_t& operator=(const allocation_t&) = delete;
+    allocation_t(allocation_t&& other) noexcept { *this = std::move(other); }
+    allocation_t& operator=(allocation_t&& other) noexcept;
+    ~allocation_t() { reset(); }
+    void reset();
+    explicit operator bool() const { return allocator != nullptr; }
+};
+
+// Pooled device memory allocator: one pool per memory type, usage class and strategy,
+// each pool grows by fixed size blocks so the number of vkAllocateMemory calls stays small.
+// Allocations and frees are serialized, a streamed scene is built while the frames allocate.
+class memory_allocator_t
+{
+    struct block_t
+    {
+        vk::UniqueDeviceMemory memory;
+        vk::DeviceSize size = 0;
+        uint8_t* mapped = nullptr;
+        bool dedicated = false;
+        uint32_t live = 0;                                  // number of allocations
+        vk::DeviceSize used = 0;
+        vk::DeviceSize head = 0;                            // linear strategy
+        std::map<vk::DeviceSize, vk::DeviceSize> free;      // free_list strategy, offset -> size
+    };
+    struct pool_t
+    {
+        uint32_t type_index;
+        memory_usage_t usage;
+        block_strategy_t strategy;
+        vk::DeviceSize block_size;
+        std::vector<block_t> blocks;
+        uint64_t allocation_count = 0;                      // total number of allocations served
+    };
+
+    const vk::UniqueDevice& dev;
+    vk::PhysicalDeviceMemoryProperties mem_props;
+    vk::DeviceSize granularity = 1;
+    bool device_address = false;
+    std::vector<pool_t> pools;
+    std::map<std::pair<uint32_t, memory_usage_t>, uint32_t> type_cache;
+    mutable std::mutex mutex;
+
+    uint32_t find_pool(uint32_t type_index, memory_usage_t usage, block_strategy_t strategy);
+    bool allocate_from(pool_t& pool, block_t& block, vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize& offset);
+    uint32_t create_block(pool_t& pool, vk::DeviceSize size, bool dedicated);
+    void free(const allocation_t& alloc);
+    friend class allocation_t;
+public:
+    memory_allocator_t(const vk::UniqueDevice& device, vk::PhysicalDevice physical_device, bool buffer_device_address);
+    memory_allocator_t(const memory_allocator_t&) = delete;
+    const vk::UniqueDevice& device() const { return dev; }
+
+    uint32_t find_memory_type(uint32_t type_bits, memory_usage_t usage);
+    allocation_t allocate(const vk::MemoryRequirements& req, memory_usage_t usage, resource_kind_t kind,
+        block_strategy_t strategy = block_strategy_t::free_list);
+
+    // Allocate and bind
+    allocation_t bind(vk::Buffer buffer, memory_usage_t usage, block_strategy_t strategy = block_strategy_t::free_list);
+    allocation_t bind(vk::Image image, memory_usage_t usage);
+    allocation_t bind(vk::AccelerationStructureKHR as);
+
+    void report() const;
+};
+
+struct buffer_t
+{
+    vk::UniqueBuffer buffer;
+    allocation_t mem;
+    vk::DeviceAddress address = 0;      // valid when created with eShaderDeviceAddress
+};
+
+// More than one queue family makes the buffer shared concurrently between them
+buffer_t create_buffer(memory_allocator_t& allocator, const std::string& name, vk::DeviceSize size,
+    vk::BufferUsageFlags usage, memory_usage_t mem_usage, block_strategy_t strategy = block_strategy_t::free_list,
+    const std::vector<uint32_t>& queue_families = {});
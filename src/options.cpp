@@ -0,0 +1,159 @@
+#include "pch.h"
+#include "options.h"
+
+static uint32_t parse_uint(const std::string& name, const std::string& value)
+{
+    try
+    {
+        return (uint32_t)std::stoul(value);
+    }
+    catch (const std::exception&)
+    {
+        throw std::runtime_error(fmt::format("invalid value '{}' for {}", value, name));
+    }
+}
+
+static float parse_float(const std::string& name, const std::string& value)
+{
+    try
+    {
+        return std::stof(value);
+    }
+    catch (const std::exception&)
+    {
+        throw std::runtime_error(fmt::format("invalid value '{}' for {}", value, name));
+    }
+}
+
+static std::pair<uint32_t, uint32_t> parse_size(const std::string& name, const std::string& value)
+{
+    size_t x = value.find('x');
+    if (x == std::string::npos)
+        throw std::runtime_error(fmt::format("invalid value '{}' for {}, expected WxH", value, name));
+    return { parse_uint(name, value.substr(0, x)), parse_uint(name, value.substr(x + 1)) };
+}
+
+options_t parse_options(int argc, char** argv)
+{
+    options_t opt;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string
+        {
+            if (i + 1 >= argc)
+                throw std::runtime_error("missing value for " + arg);
+            return argv[++i];
+        };
+
+        if (arg == "--headless")
+            opt.headless = true;
+        else if (arg == "--no-validation")
+            opt.validation = false;
+        else if (arg == "--frames")
+            opt.frames = parse_uint(arg, next());
+        else if (arg == "--warmup")
+            opt.warmup = parse_uint(arg, next());
+        else if (arg == "--frames-in-flight")
+            opt.frames_in_flight = std::max(1u, parse_uint(arg, next()));
+        else if (arg == "--scratch-budget")
+            opt.scratch_budget_mb = parse_uint(arg, next());
+        else if (arg == "--compact")
+            opt.compact = true;
+        else if (arg == "--dynamic")
+            opt.dynamic = true;
+        else if (arg == "--refit-threshold")
+            opt.refit_threshold = parse_float(arg, next());
+        else if (arg == "--staging")
+            opt.staging_mb = std::max(1u, parse_uint(arg, next()));
+        else if (arg == "--no-transfer-queue")
+            opt.transfer_queue = false;
+        else if (arg == "--no-async-compute")
+            opt.async_compute = false;
+        else if (arg == "--hybrid")
+            opt.hybrid = true;
+        else if (arg == "--gbuffer-view")
+            opt.gbuffer_view = true;
+        else if (arg == "--gpu-driven")
+            opt.hybrid = opt.gpu_driven = true;
+        else if (arg == "--rt-backend")
+        {
+            std::string backend = next();
+            if (backend != "pipeline" && backend != "query")
+                throw std::runtime_error(fmt::format("invalid value '{}' for {}, expected pipeline or query", backend, arg));
+            opt.ray_query = backend == "query";
+        }
+        else if (arg == "--size")
+            std::tie(opt.width, opt.height) = parse_size(arg, next());
+        else if (arg == "--present-mode")
+        {
+            opt.present_mode = next();
+            if (opt.present_mode != "fifo" && opt.present_mode != "mailbox" && opt.present_mode != "immediate")
+                throw std::runtime_error(fmt::format("invalid value '{}' for {}, expected fifo, mailbox or immediate", 
+                    opt.present_mode, arg));
+        }
+        else if (arg == "--swapchain-images")
+            opt.swapchain_images = parse_uint(arg, next());
+        else if (arg == "--render")
+            opt.render_path = next();
+        else if (arg == "--render-size")
+            std::tie(opt.render_width, opt.render_height) = parse_size(arg, next());
+        else if (arg == "--tile")
+            opt.tile = std::max(16u, parse_uint(arg, next()));
+        else if (arg == "--cpu-render")
+            opt.cpu_render_path = next();
+        else if (arg == "--golden-tolerance")
+            opt.golden_tolerance = parse_float(arg, next());
+        else if (arg == "--target-ms")
+            opt.target_ms = parse_float(arg, next());
+        else if (arg == "--min-scale")
+            opt.min_scale = parse_float(arg, next());
+        else if (arg == "--scene")
+            opt.scene_path = next();
+        else if (arg == "--stream-scene")
+            opt.stream_scene_path = next();
+        else if (arg == "--no-dedup")
+            opt.dedup = false;
+        else if (arg == "--compress-geometry")
+            opt.compress_geometry = true;
+        else if (arg == "--threads")
+            opt.threads = parse_uint(arg, next());
+        else if (arg == "--pipeline-cache")
+            opt.pipeline_cache_path = next();
+        else if (arg == "--no-pipeline-cache")
+            opt.pipeline_cache_path.clear();
+        else if (arg == "--trace")
+            opt.trace_path = next();
+        else if (arg == "--shader-dir")
+            opt.shader_dir = next();
+        else if (arg == "--no-scene-cache")
+            opt.scene_cache = false;
+        else
+            throw std::runtime_error("unknown option " + arg);
+    }
+
+#ifndef _WIN32
+    // There is no windowing backend outside Win32
+    opt.headless = true;
+#endif
+    // An offline render is a single still, there is no window to show it. The tiles go through the
+    // active backend: the RT pipeline, --rt-backend query or --hybrid.
+    if (!opt.render_path.empty())
+        opt.headless = true;
+    // The CPU reference has no window either
+    if (!opt.cpu_render_path.empty())
+        opt.headless = true;
+    // The hybrid mode rasterizes the primary visibility and traces its shadow rays with shadow.rgen,
+    // there is no ray query variant of it
+    if (opt.ray_query && opt.hybrid)
+        throw std::runtime_error("--rt-backend query cannot be combined with --hybrid or --gpu-driven");
+    // The streamed scene replaces the RT scene resources between two frames. The hybrid passes and
+    // the refit keep their own references to the startup scene, and an offline still has no frame loop.
+    if (!opt.stream_scene_path.empty() && (opt.hybrid || opt.dynamic || !opt.render_path.empty()))
+        throw std::runtime_error("--stream-scene cannot be combined with --hybrid, --gpu-driven, --dynamic or --render");
+    // A headless run without a frame count would never terminate
+    if (opt.headless && opt.frames == 0)
+        opt.frames = 1000;
+
+    return opt;
+}
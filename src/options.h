@@ -0,0 +1,45 @@
+#pragma once
+#include <string>
+
+struct options_t
+{
+    bool headless = false;      // render offscreen, no window/surface/swapchain
+    bool validation = true;     // enable VK_LAYER_KHRONOS_validation when available
+    uint32_t frames = 0;        // number of frames to render before exiting, 0 = until the window is closed
+    uint32_t warmup = 0;        // frames excluded from the benchmark statistics
+    uint32_t frames_in_flight = 2;
+    uint64_t scratch_budget_mb = 256;   // AS build scratch memory shared by concurrent BLAS builds
+    bool compact = false;               // compact BLAS/TLAS after the build
+    bool dynamic = false;               // animate the nodes and refit the TLAS every frame
+    float refit_threshold = 2.f;        // TLAS rebuild when the refit bounds grow past this ratio
+    uint64_t staging_mb = 32;           // staging ring used to upload the geometry
+    bool transfer_queue = true;         // upload on a dedicated transfer queue family when available
+    bool async_compute = true;          // build the acceleration structures on a compute-only queue family when available
+    double target_ms = 0.0;             // GPU trace budget for dynamic resolution, 0 = always full size
+    float min_scale = 0.5f;             // smallest dynamic resolution scale
+    bool hybrid = false;                // rasterized G-buffer and shadow rays instead of tracing the primary rays
+    bool gbuffer_view = false;          // hybrid: show the G-buffer channels at the top of the image
+    bool gpu_driven = false;            // hybrid with the draws culled on the GPU and issued with drawIndexedIndirectCount
+    bool ray_query = false;             // trace the primary and shadow rays with ray queries from trace.comp instead of the RT pipeline
+    uint32_t width = 800;
+    uint32_t height = 600;
+    std::string present_mode = "fifo";  // fifo, mailbox or immediate, P cycles them at runtime
+    uint32_t swapchain_images = 0;      // 0 = one more than the surface minimum
+    std::string render_path;            // offline tiled render to a PPM file instead of the frame loop, with the active backend
+    uint32_t render_width = 16384;
+    uint32_t render_height = 16384;
+    uint32_t tile = 1024;               // tile size of the offline render, bounds the GPU time per submission
+    std::string cpu_render_path;        // CPU reference still of the offline camera to a PPM file, the golden image of --render
+    float golden_tolerance = 0.5f;      // percentage of the pixels of the GPU still allowed to differ from the CPU reference
+    bool dedup = true;                  // share one geometry range and BLAS between identical meshes
+    bool compress_geometry = false;     // quantized positions, octahedral normals, 16-bit indices
+    uint32_t threads = 0;               // job system worker threads, 0 = one per hardware thread
+    bool scene_cache = true;            // load/store the scene from the binary cache next to the source
+    std::string pipeline_cache_path = "vkSample.pipeline_cache";  // empty = no persistent pipeline cache
+    std::string trace_path;             // Chrome trace_event JSON with the GPU scopes and the CPU zones, empty = none
+    std::string shader_dir;             // development override, "<dir>/<name>.spv" replaces the embedded shader
+    std::string scene_path = "D:\\3D\\cars.fbx";
+    std::string stream_scene_path;      // second scene read and built while the frames render, traced once it is ready
+};
+
+options_t parse_options(int argc, char** argv);
@@ -1,14 +1,24 @@
 #include <array>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <numeric>
 #include <fstream>
 #include <iostream>
 
 #define VULKAN_HPP_DISPATCH_LOADER_DYNAMIC 1
+#ifdef _WIN32
 #define VK_USE_PLATFORM_WIN32_KHR
+#endif
 #define VK_ENABLE_BETA_EXTENSIONS
 //#include <vulkan/vulkan.hpp>
 #include "vulkan.hpp"
 
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <stb_image.h>
 #include <fmt/format.h>
 
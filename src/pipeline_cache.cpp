@@ -0,0 +1,98 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "pipeline_cache.h"
+#include "hash.h"
+#include <filesystem>
+
+static constexpr uint32_t pipeline_cache_magic = 0x43504B56;     // "VKPC" little-endian
+static constexpr uint32_t pipeline_cache_version = 1;
+
+pipeline_cache_t::pipeline_cache_t(const vk::UniqueDevice& device, vk::PhysicalDevice physical_device, const std::string& path)
+    : device(device), path(path)
+{
+    auto props = physical_device.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceIDProperties>();
+    const auto& pd_props = props.get<vk::PhysicalDeviceProperties2>().properties;
+    const auto& id_props = props.get<vk::PhysicalDeviceIDProperties>();
+    expected.magic = pipeline_cache_magic;
+    expected.version = pipeline_cache_version;
+    expected.vendor_id = pd_props.vendorID;
+    expected.device_id = pd_props.deviceID;
+    expected.driver_version = pd_props.driverVersion;
+    memcpy(expected.driver_uuid, id_props.driverUUID, VK_UUID_SIZE);
+    memcpy(expected.cache_uuid, pd_props.pipelineCacheUUID, VK_UUID_SIZE);
+
+    std::vector<char> blob;
+    std::string reason = "no file";
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!path.empty() && file.is_open())
+    {
+        size_t size = file.tellg();
+        file.seekg(std::ios::beg);
+        file_header_t header{};
+        if (size >= sizeof(header) && file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        {
+            blob.resize(size - sizeof(header));
+            file.read(blob.data(), blob.size());
+            // The driver header inside the blob must agree with ours too
+            auto* vk_header = reinterpret_cast<const VkPipelineCacheHeaderVersionOne*>(blob.data());
+            if (header.magic != expected.magic || header.version != expected.version)
+                reason = "unknown format";
+            else if (header.vendor_id != expected.vendor_id || header.device_id != expected.device_id ||
+                memcmp(header.cache_uuid, expected.cache_uuid, VK_UUID_SIZE) != 0)
+                reason = "different device";
+            else if (header.driver_version != expected.driver_version ||
+                memcmp(header.driver_uuid, expected.driver_uuid, VK_UUID_SIZE) != 0)
+                reason = "different driver";
+            else if (header.data_size != blob.size() || header.data_hash != hash_bytes(blob.data(), blob.size()))
+                reason = "corrupted";
+            else if (blob.size() < sizeof(VkPipelineCacheHeaderVersionOne) ||
+                vk_header->headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+                vk_header->vendorID != expected.vendor_id || vk_header->deviceID != expected.device_id ||
+                memcmp(vk_header->pipelineCacheUUID, expected.cache_uuid, VK_UUID_SIZE) != 0)
+                reason = "invalid driver header";
+            else
+                hit = true;
+        }
+        else
+        {
+            reason = "truncated";
+        }
+    }
+    if (!hit)
+        blob.clear();
+    loaded_size = blob.size();
+
+    cache = device->createPipelineCacheUnique({ {}, blob.size(), blob.data() });
+    debug_name(cache, "Pipeline Cache");
+    if (!path.empty())
+    {
+        std::cout << (hit ? fmt::format("Pipeline cache hit {} ({:.1f} KB)\n", path, loaded_size / 1024.0) :
+            fmt::format("Pipeline cache miss {} ({})\n", path, reason));
+    }
+}
+
+void pipeline_cache_t::save()
+{
+    if (path.empty())
+        return;
+    std::vector<uint8_t> blob = device->getPipelineCacheData(*cache);
+    file_header_t header = expected;
+    header.data_size = blob.size();
+    header.data_hash = hash_bytes(blob.data(), blob.size());
+
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(blob.data()), blob.size());
+    out.close();
+    std::error_code ec;
+    if (out)
+        std::filesystem::rename(tmp_path, path, ec);
+    if (!out || ec)
+    {
+        std::cout << fmt::format("Cannot write the pipeline cache {}\n", path);
+        std::filesystem::remove(tmp_path, ec);
+        return;
+    }
+    std::cout << fmt::format("Pipeline cache saved {} ({:.1f} KB)\n", path, blob.size() / 1024.0);
+}
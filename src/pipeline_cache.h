@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+
+// VkPipelineCache persisted on disk. The blob is prefixed by a header identifying the
+// device and driver that produced it, a blob from another GPU or driver is discarded
+// instead of being handed to the driver.
+class pipeline_cache_t
+{
+    const vk::UniqueDevice& device;
+    vk::UniquePipelineCache cache;
+    std::string path;
+    bool hit = false;
+    size_t loaded_size = 0;
+public:
+    // An empty path disables the persistence, the cache is still shared in memory
+    pipeline_cache_t(const vk::UniqueDevice& device, vk::PhysicalDevice physical_device, const std::string& path);
+    vk::PipelineCache get() const { return *cache; }
+    bool warm() const { return hit; }
+    // Write to a temporary file and rename it over the previous one
+    void save();
+private:
+    struct file_header_t
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t vendor_id;
+        uint32_t device_id;
+        uint32_t driver_version;
+        uint8_t driver_uuid[VK_UUID_SIZE];
+        uint8_t cache_uuid[VK_UUID_SIZE];
+        uint64_t data_size;
+        uint64_t data_hash;
+    } expected{};
+};
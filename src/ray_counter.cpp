@@ -0,0 +1,38 @@
+#include "pch.h"
+#include "ray_counter.h"
+
+ray_counter_t::ray_counter_t(memory_allocator_t& allocator, uint32_t slots)
+{
+    counters = create_buffer(allocator, "Ray Counter Buffer", stride * slots,
+        vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst,
+        memory_usage_t::device_local);
+    readback = create_buffer(allocator, "Ray Counter Readback", stride * slots,
+        vk::BufferUsageFlagBits::eTransferDst, memory_usage_t::readback);
+    std::fill_n(readback.mem.mapped, stride * slots, 0);
+}
+
+void ray_counter_t::reset(const vk::UniqueCommandBuffer& cmd, uint32_t slot, vk::PipelineStageFlags stages)
+{
+    cmd->fillBuffer(*counters.buffer, offset(slot), stride, 0);
+    vk::BufferMemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, *counters.buffer, offset(slot), stride);
+    cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, stages, {}, nullptr, barrier, nullptr);
+}
+
+void ray_counter_t::copy(const vk::UniqueCommandBuffer& cmd, uint32_t slot, vk::PipelineStageFlags stages)
+{
+    vk::BufferMemoryBarrier barrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eTransferRead,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, *counters.buffer, offset(slot), stride);
+    cmd->pipelineBarrier(stages, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, barrier, nullptr);
+    cmd->copyBuffer(*counters.buffer, *readback.buffer, vk::BufferCopy(offset(slot), offset(slot), stride));
+    barrier = vk::BufferMemoryBarrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, *readback.buffer, offset(slot), stride);
+    cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost, {}, nullptr, barrier, nullptr);
+}
+
+uint64_t ray_counter_t::read(uint32_t slot) const
+{
+    const uint32_t* lane = reinterpret_cast<const uint32_t*>(readback.mem.mapped + offset(slot));
+    return std::accumulate(lane, lane + lanes, (uint64_t)0);
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "memory.h"
+
+// Number of shadow rays launched by the shaders of each frame in flight, the primary rays are
+// known on the host. Every slot owns a region of lanes in a device-local buffer, the shaders add
+// to the lane of their invocation to keep the atomics apart, the region is reset at the start
+// of the frame and copied to a readback buffer at its end.
+class ray_counter_t
+{
+    buffer_t counters;
+    buffer_t readback;
+public:
+    static constexpr uint32_t lanes = 64;
+    // Not less than any minStorageBufferOffsetAlignment
+    static constexpr vk::DeviceSize stride = lanes * sizeof(uint32_t);
+
+    ray_counter_t(memory_allocator_t& allocator, uint32_t slots);
+    // Bound as a dynamic storage buffer, one region per slot
+    vk::DescriptorBufferInfo descriptor() const { return { *counters.buffer, 0, stride }; }
+    static uint32_t offset(uint32_t slot) { return (uint32_t)(slot * stride); }
+    // Clear the region of the slot before the shaders in stages add to it
+    void reset(const vk::UniqueCommandBuffer& cmd, uint32_t slot, vk::PipelineStageFlags stages);
+    // Copy the region to the host after the shaders in stages are done
+    void copy(const vk::UniqueCommandBuffer& cmd, uint32_t slot, vk::PipelineStageFlags stages);
+    // Sum of the lanes, valid once the frame of the slot has completed
+    uint64_t read(uint32_t slot) const;
+};
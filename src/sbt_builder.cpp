@@ -0,0 +1,97 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "sbt_builder.h"
+
+uint32_t sbt_builder_t::add(sbt_region_t region, uint32_t group, const void* data, size_t size)
+{
+    auto& region_records = records[(size_t)region];
+    if (region == sbt_region_t::raygen && !region_records.empty())
+        throw std::runtime_error("SBT: the raygen region holds a single record");
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    region_records.push_back({ group, std::vector<uint8_t>(bytes, bytes + size) });
+    return (uint32_t)region_records.size() - 1;
+}
+
+sbt_t sbt_builder_t::build(memory_allocator_t& allocator, vk::PhysicalDevice physical_device, vk::Pipeline pipeline,
+    uint32_t group_count, vk::Queue queue, vk::CommandPool cmdpool, const std::string& name,
+    const std::vector<uint32_t>& queue_families) const
+{
+    const vk::UniqueDevice& device = allocator.device();
+    auto rt_props = physical_device.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceRayTracingPropertiesKHR>()
+        .get<vk::PhysicalDeviceRayTracingPropertiesKHR>();
+    vk::DeviceSize handle_size = rt_props.shaderGroupHandleSize;
+    vk::DeviceSize base_alignment = rt_props.shaderGroupBaseAlignment;
+    std::vector<uint8_t> handles(handle_size * group_count);
+    device->getRayTracingShaderGroupHandlesKHR<uint8_t>(pipeline, 0, group_count, handles);
+
+    // Region layout
+    std::array<vk::DeviceSize, 4> offsets{};
+    std::array<vk::DeviceSize, 4> strides{};
+    vk::DeviceSize size = 0;
+    for (size_t r = 0; r < records.size(); r++)
+    {
+        if (records[r].empty())
+            continue;
+        vk::DeviceSize record_size = handle_size;
+        for (const auto& rec : records[r])
+            record_size = std::max<vk::DeviceSize>(record_size, handle_size + rec.data.size());
+        strides[r] = (record_size + handle_size - 1) / handle_size * handle_size;
+        if (strides[r] > rt_props.maxShaderGroupStride)
+            throw std::runtime_error(fmt::format("SBT {}: record stride {} exceeds maxShaderGroupStride {}", name, strides[r],
+                rt_props.maxShaderGroupStride));
+        offsets[r] = (size + base_alignment - 1) & ~(base_alignment - 1);
+        size = offsets[r] + strides[r] * records[r].size();
+    }
+
+    std::vector<uint8_t> table(size);
+    for (size_t r = 0; r < records.size(); r++)
+    {
+        for (size_t i = 0; i < records[r].size(); i++)
+        {
+            const record_t& rec = records[r][i];
+            if (rec.group >= group_count)
+                throw std::runtime_error(fmt::format("SBT {}: group {} out of range", name, rec.group));
+            uint8_t* dst = table.data() + offsets[r] + strides[r] * i;
+            std::copy_n(handles.data() + handle_size * rec.group, handle_size, dst);
+            std::copy(rec.data.begin(), rec.data.end(), dst + handle_size);
+        }
+    }
+
+    // Staging copy into device-local memory
+    sbt_t sbt;
+    sbt.buffer = create_buffer(allocator, name + " SBT Buffer", std::max<vk::DeviceSize>(size, 1),
+        vk::BufferUsageFlagBits::eRayTracingKHR | vk::BufferUsageFlagBits::eTransferDst, memory_usage_t::device_local,
+        block_strategy_t::free_list, queue_families);
+    if (size > 0)
+    {
+        buffer_t staging = create_buffer(allocator, name + " SBT Staging Buffer", size,
+            vk::BufferUsageFlagBits::eTransferSrc, memory_usage_t::upload, block_strategy_t::linear);
+        std::copy(table.begin(), table.end(), staging.mem.mapped);
+        vk::UniqueCommandBuffer cmd = std::move(device->allocateCommandBuffersUnique({ cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+        debug_name(cmd, name + " SBT Upload Command");
+        cmd->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+        cmd->copyBuffer(*staging.buffer, *sbt.buffer.buffer, vk::BufferCopy(0, 0, size));
+        vk::MemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead);
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eRayTracingShaderKHR, {},
+            barrier, nullptr, nullptr);
+        cmd->end();
+        vk::SubmitInfo submit_info;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &cmd.get();
+        // The queue can be busy with other work, only this copy is waited for
+        vk::UniqueFence fence = device->createFenceUnique({});
+        queue.submit(submit_info, *fence);
+        device->waitForFences(*fence, true, UINT64_MAX);
+    }
+
+    // Regions without records stay empty, the raygen one is a single record so its size is its stride
+    for (size_t r = 0; r < records.size(); r++)
+    {
+        if (!records[r].empty())
+            sbt.regions[r] = vk::StridedBufferRegionKHR(*sbt.buffer.buffer, offsets[r], strides[r], strides[r] * records[r].size());
+    }
+    std::cout << fmt::format("SBT {}: {:.2f} KB, {} miss, {} hit, {} callable record(s)\n", name, size / 1024.0,
+        records[(size_t)sbt_region_t::miss].size(), records[(size_t)sbt_region_t::hit].size(),
+        records[(size_t)sbt_region_t::callable].size());
+    return sbt;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <array>
+#include <string>
+#include <vector>
+#include "memory.h"
+
+enum class sbt_region_t
+{
+    raygen,
+    miss,
+    hit,
+    callable,
+};
+
+// Shader binding table uploaded to device-local memory, the regions are in the order of traceRaysKHR
+struct sbt_t
+{
+    buffer_t buffer;
+    std::array<vk::StridedBufferRegionKHR, 4> regions;     // raygen, miss, hit, callable
+};
+
+// Lays out a shader binding table: every region starts at shaderGroupBaseAlignment, a record is
+// the handle of its group followed by its inline data (shaderRecordEXT), and all the records of
+// a region share the stride of the largest one rounded up to the handle size.
+class sbt_builder_t
+{
+    struct record_t
+    {
+        uint32_t group;
+        std::vector<uint8_t> data;
+    };
+    std::array<std::vector<record_t>, 4> records;
+public:
+    // Returns the index of the record in its region. For the hit region it is the
+    // instanceShaderBindingTableRecordOffset of the instances using it.
+    uint32_t add(sbt_region_t region, uint32_t group, const void* data = nullptr, size_t size = 0);
+    template<typename T>
+    uint32_t add(sbt_region_t region, uint32_t group, const T& data) { return add(region, group, &data, sizeof(T)); }
+    uint32_t count(sbt_region_t region) const { return (uint32_t)records[(size_t)region].size(); }
+    // Fetch the handles of pipeline's group_count groups and copy the table into device-local
+    // memory with a one time command on queue, waits for the copy. A table copied on another
+    // queue family than the one tracing is shared with the queue_families.
+    sbt_t build(memory_allocator_t& allocator, vk::PhysicalDevice physical_device, vk::Pipeline pipeline, uint32_t group_count,
+        vk::Queue queue, vk::CommandPool cmdpool, const std::string& name, const std::vector<uint32_t>& queue_families = {}) const;
+};
@@ -0,0 +1,56 @@
+#pragma once
+#include <vector>
+
+struct vertex_t
+{
+    glm::vec3 pos;
+    glm::vec3 nor;
+    vertex_t() = default;
+    vertex_t(glm::vec3 pos) : pos(pos), nor(0) {}
+    vertex_t(glm::vec2 pos) : pos(glm::vec3(pos, 0)), nor(0) {}
+    vertex_t(glm::vec3 pos, glm::vec3 nor) : pos(pos), nor(nor) {}
+};
+
+struct aabb_t
+{
+    glm::vec3 lo = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 hi = glm::vec3(std::numeric_limits<float>::lowest());
+    void grow(glm::vec3 p) { lo = glm::min(lo, p); hi = glm::max(hi, p); }
+    void grow(const aabb_t& b) { lo = glm::min(lo, b.lo); hi = glm::max(hi, b.hi); }
+    float area() const { glm::vec3 d = glm::max(hi - lo, glm::vec3(0)); return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x); }
+    // Same box as transforming the 8 corners, with the center and the extent transformed separately
+    aabb_t transform(const glm::mat4& m) const
+    {
+        glm::vec3 center = glm::vec3(m * glm::vec4((lo + hi) * 0.5f, 1.f));
+        glm::vec3 half = (hi - lo) * 0.5f;
+        glm::vec3 extent = glm::abs(glm::vec3(m[0])) * half.x + glm::abs(glm::vec3(m[1])) * half.y + glm::abs(glm::vec3(m[2])) * half.z;
+        return { center - extent, center + extent };
+    }
+};
+
+struct mesh_t
+{
+    uint32_t id;
+    uint32_t vtx_offset;
+    uint32_t vtx_count;
+    uint32_t idx_offset;
+    uint32_t idx_count;
+    vk::IndexType index_type = vk::IndexType::eUint32;
+    vk::DeviceSize idx_byte_offset = 0;
+    glm::mat4 dequant = glm::mat4(1);       // quantized position to mesh space
+    aabb_t bounds;                          // mesh space
+    vk::DeviceAddress blas_addr;
+    vk::DeviceSize blas_offset;
+    vk::DeviceSize blas_size;
+    vk::UniqueAccelerationStructureKHR blas;
+    vk::AccelerationStructureGeometryKHR build_geo;
+    vk::AccelerationStructureBuildOffsetInfoKHR build_offset;
+    vk::DeviceSize build_scratch_size;
+};
+
+struct node_t
+{
+    std::vector<uint32_t> mesh_indices;
+    glm::mat4 mat;
+    glm::vec3 col;
+};
@@ -0,0 +1,327 @@
+#include "pch.h"
+#include "scene_cache.h"
+#include "cpu_profiler.h"
+#include "hash.h"
+#include <filesystem>
+#include <unordered_map>
+
+// Cache file layout: header followed by the sections, each one aligned to 64 bytes
+static constexpr uint32_t cache_magic = 0x43534B56;    // "VKSC" little-endian
+static constexpr uint32_t cache_version = 2;
+static constexpr size_t cache_alignment = 64;
+
+enum cache_section_t : uint32_t
+{
+    section_vertices,
+    section_indices,
+    section_meshes,
+    section_nodes,
+    section_node_mesh_indices,
+    section_count
+};
+
+enum cache_flag_t : uint32_t
+{
+    cache_flag_dedup = 1,
+};
+
+struct cache_header_t
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;             // cache_flag_t used at import time
+    uint32_t source_mesh_count; // meshes before the dedup
+    uint64_t source_hash;
+    uint64_t source_size;
+    struct
+    {
+        uint64_t offset;
+        uint64_t count;
+        uint64_t stride;
+    } sections[section_count];
+};
+
+static size_t align_up(size_t value)
+{
+    return (value + cache_alignment - 1) & ~(cache_alignment - 1);
+}
+
+template<typename T>
+static std::span<const T> section(const uint8_t* base, const cache_header_t& header, cache_section_t s)
+{
+    return { reinterpret_cast<const T*>(base + header.sections[s].offset), (size_t)header.sections[s].count };
+}
+
+static void bind_sections(scene_t& scene, const uint8_t* base)
+{
+    const auto& header = *reinterpret_cast<const cache_header_t*>(base);
+    scene.vertices = section<vertex_t>(base, header, section_vertices);
+    scene.indices = section<uint32_t>(base, header, section_indices);
+    scene.meshes = section<mesh_record_t>(base, header, section_meshes);
+    scene.nodes = section<node_record_t>(base, header, section_nodes);
+    scene.source_mesh_count = header.source_mesh_count;
+    scene.node_mesh_indices = section<uint32_t>(base, header, section_node_mesh_indices);
+}
+
+static bool validate_cache(const mapped_file_t& file, uint64_t source_hash, uint64_t source_size, uint32_t flags)
+{
+    if (file.size() < sizeof(cache_header_t))
+        return false;
+    const auto& header = *reinterpret_cast<const cache_header_t*>(file.data());
+    if (header.magic != cache_magic || header.version != cache_version ||
+        header.source_hash != source_hash || header.source_size != source_size || header.flags != flags)
+        return false;
+    const uint64_t strides[section_count]{ sizeof(vertex_t), sizeof(uint32_t), sizeof(mesh_record_t), 
+        sizeof(node_record_t), sizeof(uint32_t) };
+    for (uint32_t s = 0; s < section_count; s++)
+    {
+        const auto& sec = header.sections[s];
+        if (sec.stride != strides[s] || sec.offset % cache_alignment || sec.offset + sec.count * sec.stride > file.size())
+            return false;
+    }
+    return true;
+}
+
+static uint64_t hash_mesh(const aiMesh* mesh)
+{
+    uint64_t h = hash_bytes(&mesh->mNumVertices, sizeof(mesh->mNumVertices));
+    h = hash_bytes(&mesh->mNumFaces, sizeof(mesh->mNumFaces), h);
+    h = hash_bytes(mesh->mVertices, mesh->mNumVertices * sizeof(aiVector3D), h);
+    h = hash_bytes(mesh->mNormals, mesh->mNumVertices * sizeof(aiVector3D), h);
+    for (uint32_t face_index = 0; face_index < mesh->mNumFaces; face_index++)
+        h = hash_bytes(mesh->mFaces[face_index].mIndices, 3 * sizeof(uint32_t), h);
+    return h;
+}
+
+// Same content as far as the flattened arrays are concerned
+static bool same_geometry(const aiMesh* a, const aiMesh* b)
+{
+    if (a->mNumVertices != b->mNumVertices || a->mNumFaces != b->mNumFaces)
+        return false;
+    if (memcmp(a->mVertices, b->mVertices, a->mNumVertices * sizeof(aiVector3D)) != 0 ||
+        memcmp(a->mNormals, b->mNormals, a->mNumVertices * sizeof(aiVector3D)) != 0)
+        return false;
+    for (uint32_t face_index = 0; face_index < a->mNumFaces; face_index++)
+        if (memcmp(a->mFaces[face_index].mIndices, b->mFaces[face_index].mIndices, 3 * sizeof(uint32_t)) != 0)
+            return false;
+    return true;
+}
+
+static void import_scene(scene_t& scene, const std::string& path, uint64_t source_hash, uint64_t source_size,
+    uint32_t flags, job_system_t& jobs)
+{
+    std::vector<mesh_record_t> meshes;
+    std::vector<node_record_t> nodes;
+    std::vector<uint32_t> node_mesh_indices;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    CPU_ZONE_NAMED(phase, "Assimp Read");
+    Assimp::Importer importer;
+    const aiScene* ai_scene = importer.ReadFile(path, aiProcessPreset_TargetRealtime_Fast);
+    if (!ai_scene)
+        throw std::runtime_error(fmt::format("cannot load the scene {}: {}", path, importer.GetErrorString()));
+    auto read_end = std::chrono::high_resolution_clock::now();
+    CPU_ZONE_NEXT(phase, "Mesh Layout");
+
+    // Collapse the meshes with identical content, unique_meshes[i] is the source of the mesh record i
+    // and mesh_remap maps every source mesh to its record
+    std::vector<uint32_t> unique_meshes;
+    std::vector<uint32_t> mesh_remap(ai_scene->mNumMeshes);
+    size_t source_triangles = 0;
+    if (flags & cache_flag_dedup)
+    {
+        std::vector<uint64_t> hashes(ai_scene->mNumMeshes);
+        jobs.parallel_for(ai_scene->mNumMeshes, [&](uint32_t mesh_index)
+        {
+            hashes[mesh_index] = hash_mesh(ai_scene->mMeshes[mesh_index]);
+        });
+        std::unordered_map<uint64_t, std::vector<uint32_t>> buckets;
+        for (uint32_t mesh_index = 0; mesh_index < ai_scene->mNumMeshes; mesh_index++)
+        {
+            source_triangles += ai_scene->mMeshes[mesh_index]->mNumFaces;
+            auto& bucket = buckets[hashes[mesh_index]];
+            auto match = std::find_if(bucket.begin(), bucket.end(), [&](uint32_t unique_index) {
+                return same_geometry(ai_scene->mMeshes[unique_meshes[unique_index]], ai_scene->mMeshes[mesh_index]);
+            });
+            if (match != bucket.end())
+            {
+                mesh_remap[mesh_index] = *match;
+                continue;
+            }
+            mesh_remap[mesh_index] = (uint32_t)unique_meshes.size();
+            bucket.push_back((uint32_t)unique_meshes.size());
+            unique_meshes.push_back(mesh_index);
+        }
+    }
+    else
+    {
+        for (uint32_t mesh_index = 0; mesh_index < ai_scene->mNumMeshes; mesh_index++)
+        {
+            source_triangles += ai_scene->mMeshes[mesh_index]->mNumFaces;
+            mesh_remap[mesh_index] = mesh_index;
+            unique_meshes.push_back(mesh_index);
+        }
+    }
+
+    // Prefix sum of the mesh sizes gives every mesh its own range of the merged arrays
+    size_t vertex_count = 0;
+    size_t index_count = 0;
+    meshes.resize(unique_meshes.size());
+    for (uint32_t mesh_index = 0; mesh_index < unique_meshes.size(); mesh_index++)
+    {
+        aiMesh* scene_mesh = ai_scene->mMeshes[unique_meshes[mesh_index]];
+        mesh_record_t& mesh = meshes[mesh_index];
+        mesh.idx_offset = (uint32_t)index_count;
+        mesh.idx_count = scene_mesh->mNumFaces * 3;
+        mesh.vtx_offset = (uint32_t)vertex_count;
+        mesh.vtx_count = (uint32_t)scene_mesh->mNumVertices;
+        index_count += mesh.idx_count;
+        vertex_count += mesh.vtx_count;
+    }
+    for (uint32_t node_index = 0; node_index < ai_scene->mRootNode->mNumChildren; node_index++)
+    {
+        aiNode* scene_node = ai_scene->mRootNode->mChildren[node_index];
+        node_record_t& node = nodes.emplace_back();
+        node.col = glm::vec4(glm::linearRand(glm::vec3(0), glm::vec3(1)), 1);
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                node.mat[i][j] = scene_node->mTransformation[j][i];
+        node.mesh_first = (uint32_t)node_mesh_indices.size();
+        node.mesh_count = scene_node->mNumMeshes;
+        node.pad[0] = node.pad[1] = 0;
+        for (uint32_t i = 0; i < scene_node->mNumMeshes; i++)
+            node_mesh_indices.push_back(mesh_remap[scene_node->mMeshes[i]]);
+    }
+
+    // Lay out the storage in the cache format, the same bytes back the scene and the file
+    cache_header_t header{};
+    header.magic = cache_magic;
+    header.version = cache_version;
+    header.flags = flags;
+    header.source_mesh_count = ai_scene->mNumMeshes;
+    header.source_hash = source_hash;
+    header.source_size = source_size;
+    size_t size = align_up(sizeof(cache_header_t));
+    auto add_section = [&](cache_section_t s, size_t count, size_t stride)
+    {
+        header.sections[s] = { size, count, stride };
+        size = align_up(size + count * stride);
+    };
+    add_section(section_vertices, vertex_count, sizeof(vertex_t));
+    add_section(section_indices, index_count, sizeof(uint32_t));
+    add_section(section_meshes, meshes.size(), sizeof(mesh_record_t));
+    add_section(section_nodes, nodes.size(), sizeof(node_record_t));
+    add_section(section_node_mesh_indices, node_mesh_indices.size(), sizeof(uint32_t));
+
+    scene.storage.assign(size, 0);
+    uint8_t* base = scene.storage.data();
+    memcpy(base, &header, sizeof(header));
+    auto copy_section = [&](cache_section_t s, const void* src)
+    {
+        if (header.sections[s].count)
+            memcpy(base + header.sections[s].offset, src, header.sections[s].count * header.sections[s].stride);
+    };
+    copy_section(section_meshes, meshes.data());
+    copy_section(section_nodes, nodes.data());
+    copy_section(section_node_mesh_indices, node_mesh_indices.data());
+
+    // Flatten the meshes in parallel, each job writes only to its own ranges
+    auto* vertices = reinterpret_cast<vertex_t*>(base + header.sections[section_vertices].offset);
+    auto* indices = reinterpret_cast<uint32_t*>(base + header.sections[section_indices].offset);
+    auto flatten_start = std::chrono::high_resolution_clock::now();
+    CPU_ZONE_NEXT(phase, "Flatten");
+    jobs.parallel_for((uint32_t)meshes.size(), [&](uint32_t mesh_index)
+    {
+        const aiMesh* scene_mesh = ai_scene->mMeshes[unique_meshes[mesh_index]];
+        vertex_t* vtx = vertices + meshes[mesh_index].vtx_offset;
+        for (uint32_t vertex_index = 0; vertex_index < scene_mesh->mNumVertices; vertex_index++)
+        {
+            vtx[vertex_index].pos = glm::make_vec3(&scene_mesh->mVertices[vertex_index].x);
+            vtx[vertex_index].nor = glm::make_vec3(&scene_mesh->mNormals[vertex_index].x);
+        }
+        uint32_t* idx = indices + meshes[mesh_index].idx_offset;
+        for (uint32_t face_index = 0; face_index < scene_mesh->mNumFaces; face_index++)
+            std::copy_n(scene_mesh->mFaces[face_index].mIndices, 3, idx + face_index * 3);
+    });
+    auto flatten_end = std::chrono::high_resolution_clock::now();
+    CPU_ZONE_END(phase);
+    importer.FreeScene();
+    bind_sections(scene, base);
+
+    double read_ms = std::chrono::duration<double, std::milli>(read_end - start).count();
+    double flatten_ms = std::chrono::duration<double, std::milli>(flatten_end - flatten_start).count();
+    double total_ms = std::chrono::duration<double, std::milli>(flatten_end - start).count();
+    double triangles = index_count / 3.0;
+    std::cout << fmt::format("Scene import: {} meshes, {:.0f} triangles, read {:.3f} ms, flatten {:.3f} ms on {} threads "
+        "({:.2f} Mtri/s flatten, {:.2f} Mtri/s total)\n", meshes.size(), triangles, read_ms, flatten_ms, jobs.size(),
+        flatten_ms > 0 ? triangles / flatten_ms / 1000.0 : 0.0, total_ms > 0 ? triangles / total_ms / 1000.0 : 0.0);
+    if (flags & cache_flag_dedup)
+        std::cout << fmt::format("Mesh dedup: removed {} triangles ({:.1f}%)\n", source_triangles - (size_t)triangles,
+            source_triangles ? 100.0 * (source_triangles - triangles) / source_triangles : 0.0);
+}
+
+static void report_dedup(const scene_t& scene)
+{
+    std::cout << fmt::format("Mesh dedup: {} source meshes -> {} unique, ratio {:.2f}:1\n", scene.source_mesh_count,
+        scene.meshes.size(), scene.meshes.empty() ? 1.0 : (double)scene.source_mesh_count / scene.meshes.size());
+}
+
+scene_t load_scene(const std::string& path, bool use_cache, bool dedup, job_system_t& jobs)
+{
+    uint32_t flags = dedup ? cache_flag_dedup : 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    auto elapsed_ms = [&start] {
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    };
+
+    uint64_t source_hash = 0;
+    uint64_t source_size = 0;
+    {
+        CPU_ZONE("Hash Source");
+        mapped_file_t source(path);
+        source_hash = hash_bytes(source.data(), source.size());
+        source_size = source.size();
+    }
+
+    scene_t scene;
+    std::string cache_path = path + ".vksc";
+    if (use_cache && std::filesystem::exists(cache_path))
+    {
+        mapped_file_t file(cache_path);
+        if (validate_cache(file, source_hash, source_size, flags))
+        {
+            scene.file = std::move(file);
+            scene.from_cache = true;
+            bind_sections(scene, scene.file.data());
+            std::cout << fmt::format("Scene cache hit {} ({:.2f} MB) in {:.3f} ms\n", 
+                cache_path, scene.file.size() / (1024.0 * 1024.0), elapsed_ms());
+            if (dedup)
+                report_dedup(scene);
+            return scene;
+        }
+        std::cout << fmt::format("Scene cache {} is stale\n", cache_path);
+    }
+
+    import_scene(scene, path, source_hash, source_size, flags, jobs);
+    std::cout << fmt::format("Scene import {} in {:.3f} ms\n", path, elapsed_ms());
+    if (dedup)
+        report_dedup(scene);
+    if (use_cache)
+    {
+        // Write to a temporary file first so that a crash never leaves a truncated cache behind
+        CPU_ZONE("Write Scene Cache");
+        std::string tmp_path = cache_path + ".tmp";
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(scene.storage.data()), scene.storage.size());
+        out.close();
+        std::error_code ec;
+        if (out)
+            std::filesystem::rename(tmp_path, cache_path, ec);
+        if (!out || ec)
+        {
+            std::cout << fmt::format("Cannot write the scene cache {}\n", cache_path);
+            std::filesystem::remove(tmp_path, ec);
+        }
+    }
+    return scene;
+}
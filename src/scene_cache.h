@@ -0,0 +1,44 @@
+#pragma once
+#include <span>
+#include <string>
+#include <vector>
+#include "scene.h"
+#include "mapped_file.h"
+#include "job_system.h"
+
+struct mesh_record_t
+{
+    uint32_t vtx_offset;
+    uint32_t vtx_count;
+    uint32_t idx_offset;
+    uint32_t idx_count;
+};
+
+struct node_record_t
+{
+    glm::mat4 mat;
+    glm::vec4 col;
+    uint32_t mesh_first;        // range in scene_t::node_mesh_indices
+    uint32_t mesh_count;
+    uint32_t pad[2];
+};
+
+// Scene arrays in the layout of the binary cache file. The spans point either into the
+// file mapping (warm start) or into the storage filled by the importer (cold start).
+struct scene_t
+{
+    std::span<const vertex_t> vertices;
+    std::span<const uint32_t> indices;
+    std::span<const mesh_record_t> meshes;
+    std::span<const node_record_t> nodes;
+    std::span<const uint32_t> node_mesh_indices;
+    uint32_t source_mesh_count = 0;     // meshes in the source file, more than meshes.size() after the dedup
+    bool from_cache = false;
+    mapped_file_t file;
+    std::vector<uint8_t> storage;
+};
+
+// Load the scene from "<path>.vksc" when its source hash matches, otherwise import it
+// with Assimp, flattening the meshes on the job system, and rewrite the cache.
+// With dedup the meshes with identical content are collapsed in one record that the nodes share.
+scene_t load_scene(const std::string& path, bool use_cache, bool dedup, job_system_t& jobs);
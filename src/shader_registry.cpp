@@ -0,0 +1,107 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "shader_registry.h"
+#include <filesystem>
+
+// The .inc files are generated next to the sources by "glslc -mfmt=num", see the CustomBuild
+// step of the shaders in the project
+namespace shaders
+{
+    static constexpr uint32_t composite_frag[] = {
+#include "../shaders/composite.frag.inc"
+    };
+    static constexpr uint32_t composite_vert[] = {
+#include "../shaders/composite.vert.inc"
+    };
+    static constexpr uint32_t cull_comp[] = {
+#include "../shaders/cull.comp.inc"
+    };
+    static constexpr uint32_t shadow_rgen[] = {
+#include "../shaders/shadow.rgen.inc"
+    };
+    static constexpr uint32_t shadow_rmiss[] = {
+#include "../shaders/shadow.rmiss.inc"
+    };
+    static constexpr uint32_t trace_comp[] = {
+#include "../shaders/trace.comp.inc"
+    };
+    static constexpr uint32_t trace_rchit[] = {
+#include "../shaders/trace.rchit.inc"
+    };
+    static constexpr uint32_t trace_rgen[] = {
+#include "../shaders/trace.rgen.inc"
+    };
+    static constexpr uint32_t trace_rmiss[] = {
+#include "../shaders/trace.rmiss.inc"
+    };
+    static constexpr uint32_t triangle_frag[] = {
+#include "../shaders/triangle.frag.inc"
+    };
+    static constexpr uint32_t triangle_vert[] = {
+#include "../shaders/triangle.vert.inc"
+    };
+}
+
+struct shader_entry_t
+{
+    std::string_view name;
+    std::span<const uint32_t> code;
+};
+
+static constexpr shader_entry_t shader_registry[] = {
+    { "composite.frag", shaders::composite_frag },
+    { "composite.vert", shaders::composite_vert },
+    { "cull.comp", shaders::cull_comp },
+    { "shadow.rgen", shaders::shadow_rgen },
+    { "shadow.rmiss", shaders::shadow_rmiss },
+    { "trace.comp", shaders::trace_comp },
+    { "trace.rchit", shaders::trace_rchit },
+    { "trace.rgen", shaders::trace_rgen },
+    { "trace.rmiss", shaders::trace_rmiss },
+    { "triangle.frag", shaders::triangle_frag },
+    { "triangle.vert", shaders::triangle_vert },
+};
+
+std::span<const uint32_t> find_embedded_shader(std::string_view name)
+{
+    for (const auto& entry : shader_registry)
+        if (entry.name == name)
+            return entry.code;
+    return {};
+}
+
+shader_code_t load_shader_code(const std::string& name, const std::string& override_dir)
+{
+    shader_code_t shader;
+    if (!override_dir.empty())
+    {
+        std::string path = override_dir + "/" + name + ".spv";
+        if (std::filesystem::exists(path))
+        {
+            shader.file = mapped_file_t(path);
+            if (shader.file.size() % sizeof(uint32_t) != 0)
+                throw std::runtime_error("invalid SPIR-V file " + path);
+            shader.code = { reinterpret_cast<const uint32_t*>(shader.file.data()), shader.file.size() / sizeof(uint32_t) };
+            shader.external = true;
+            return shader;
+        }
+    }
+    shader.code = find_embedded_shader(name);
+    if (shader.code.empty())
+        throw std::runtime_error("unknown shader " + name);
+    return shader;
+}
+
+vk::UniqueShaderModule load_shader_module(const vk::UniqueDevice& device, const std::string& name,
+    const std::string& override_dir)
+{
+    shader_code_t shader = load_shader_code(name, override_dir);
+    vk::ShaderModuleCreateInfo module_info;
+    module_info.codeSize = shader.code.size_bytes();
+    module_info.pCode = shader.code.data();
+    vk::UniqueShaderModule m = device->createShaderModuleUnique(module_info);
+    debug_name(m, "ShaderModule " + name);
+    if (shader.external)
+        std::cout << fmt::format("Shader {} loaded from {}\n", name, override_dir);
+    return m;
+}
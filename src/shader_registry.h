@@ -0,0 +1,25 @@
+#pragma once
+#include <span>
+#include <string>
+#include <string_view>
+#include "mapped_file.h"
+
+// SPIR-V of a shader, either embedded in the binary or mapped from an external file
+struct shader_code_t
+{
+    std::span<const uint32_t> code;
+    mapped_file_t file;         // keeps the external file mapped
+    bool external = false;
+};
+
+// SPIR-V compiled into the binary by the shader build step, empty when the name is unknown
+std::span<const uint32_t> find_embedded_shader(std::string_view name);
+
+// Look up a shader by file name (e.g. "trace.rgen"). When override_dir is set and contains
+// "<name>.spv" the file is mapped instead, so shaders can be iterated without rebuilding.
+shader_code_t load_shader_code(const std::string& name, const std::string& override_dir);
+
+// Shader module of load_shader_code, named for the debug tools. The shaders taken from
+// override_dir are reported on the console.
+vk::UniqueShaderModule load_shader_module(const vk::UniqueDevice& device, const std::string& name,
+    const std::string& override_dir);
@@ -0,0 +1,90 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "swapchain.h"
+
+swapchain_t::swapchain_t(const vk::UniqueDevice& device, vk::PhysicalDevice physical_device, vk::SurfaceKHR surface,
+    vk::PresentModeKHR present_mode, uint32_t image_count, vk::Extent2D fallback_extent)
+    : device(device), physical_device(physical_device), surface(surface), extent(fallback_extent),
+    requested_mode(present_mode), requested_images(image_count)
+{
+}
+
+bool swapchain_t::recreate()
+{
+    vk::SurfaceCapabilitiesKHR caps = physical_device.getSurfaceCapabilitiesKHR(surface);
+    // 0xFFFFFFFF means the surface takes the size of the swapchain
+    if (caps.currentExtent.width != UINT32_MAX)
+        extent = caps.currentExtent;
+    extent.width = std::clamp(extent.width, caps.minImageExtent.width, caps.maxImageExtent.width);
+    extent.height = std::clamp(extent.height, caps.minImageExtent.height, caps.maxImageExtent.height);
+    if (extent.width == 0 || extent.height == 0)
+        return false;
+
+    uint32_t count = requested_images ? requested_images : caps.minImageCount + 1;
+    count = std::max(count, caps.minImageCount);
+    if (caps.maxImageCount > 0)
+        count = std::min(count, caps.maxImageCount);
+
+    auto modes = physical_device.getSurfacePresentModesKHR(surface);
+    mode = std::find(modes.begin(), modes.end(), requested_mode) != modes.end() ? requested_mode : vk::PresentModeKHR::eFifo;
+    if (mode != requested_mode)
+        std::cout << fmt::format("Present mode {} not supported, using fifo\n", present_mode_name(requested_mode));
+
+    vk::SwapchainCreateInfoKHR info;
+    info.surface = surface;
+    info.minImageCount = count;
+    info.imageFormat = vk::Format::eB8G8R8A8Unorm;
+    info.imageColorSpace = vk::ColorSpaceKHR::eSrgbNonlinear;
+    info.imageExtent = extent;
+    info.imageArrayLayers = 1;
+    info.imageUsage = vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferDst;
+    info.preTransform = caps.currentTransform;
+    info.presentMode = mode;
+    info.clipped = true;
+    info.oldSwapchain = *swapchain;
+    vk::UniqueSwapchainKHR new_swapchain = device->createSwapchainKHRUnique(info);
+    swapchain = std::move(new_swapchain);
+    debug_name(swapchain, "Swapchain");
+    images = device->getSwapchainImagesKHR(*swapchain);
+    std::cout << fmt::format("Swapchain {}x{}, {} images, {}\n", extent.width, extent.height, images.size(), present_mode_name(mode));
+    return true;
+}
+
+vk::PresentModeKHR present_mode_from_name(const std::string& name)
+{
+    if (name == "fifo")
+        return vk::PresentModeKHR::eFifo;
+    if (name == "mailbox")
+        return vk::PresentModeKHR::eMailbox;
+    if (name == "immediate")
+        return vk::PresentModeKHR::eImmediate;
+    throw std::runtime_error("unknown present mode " + name);
+}
+
+std::string present_mode_name(vk::PresentModeKHR mode)
+{
+    switch (mode)
+    {
+    case vk::PresentModeKHR::eFifo:
+        return "fifo";
+    case vk::PresentModeKHR::eMailbox:
+        return "mailbox";
+    case vk::PresentModeKHR::eImmediate:
+        return "immediate";
+    default:
+        return vk::to_string(mode);
+    }
+}
+
+vk::PresentModeKHR next_present_mode(vk::PresentModeKHR mode)
+{
+    switch (mode)
+    {
+    case vk::PresentModeKHR::eFifo:
+        return vk::PresentModeKHR::eMailbox;
+    case vk::PresentModeKHR::eMailbox:
+        return vk::PresentModeKHR::eImmediate;
+    default:
+        return vk::PresentModeKHR::eFifo;
+    }
+}
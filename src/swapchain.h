@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Window swapchain that can be rebuilt when the surface changes size or another present mode is
+// selected. The old swapchain is handed to the new one so the driver can recycle its images.
+class swapchain_t
+{
+    const vk::UniqueDevice& device;
+    vk::PhysicalDevice physical_device;
+    vk::SurfaceKHR surface;
+    vk::UniqueSwapchainKHR swapchain;
+    std::vector<vk::Image> images;
+    vk::Extent2D extent;
+    vk::PresentModeKHR requested_mode;
+    vk::PresentModeKHR mode = vk::PresentModeKHR::eFifo;
+    uint32_t requested_images = 0;
+public:
+    // image_count = 0 picks one more than the surface minimum
+    swapchain_t(const vk::UniqueDevice& device, vk::PhysicalDevice physical_device, vk::SurfaceKHR surface,
+        vk::PresentModeKHR present_mode, uint32_t image_count, vk::Extent2D fallback_extent);
+    // Rebuild for the current surface size, false while the window has no area (minimized)
+    bool recreate();
+    // Takes effect at the next recreate(), falls back to FIFO when the surface does not support it
+    void set_present_mode(vk::PresentModeKHR present_mode) { requested_mode = present_mode; }
+    vk::SwapchainKHR get() const { return *swapchain; }
+    const vk::SwapchainKHR* get_ptr() const { return &swapchain.get(); }
+    const std::vector<vk::Image>& get_images() const { return images; }
+    vk::Extent2D get_extent() const { return extent; }
+    vk::PresentModeKHR get_present_mode() const { return mode; }
+};
+
+// "fifo", "mailbox" or "immediate"
+vk::PresentModeKHR present_mode_from_name(const std::string& name);
+std::string present_mode_name(vk::PresentModeKHR mode);
+// FIFO -> mailbox -> immediate -> FIFO
+vk::PresentModeKHR next_present_mode(vk::PresentModeKHR mode);
@@ -0,0 +1,181 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "tiled_render.h"
+
+tile_recorder_t trace_tile_recorder(const tiled_trace_t& trace, glm::uvec2 size)
+{
+    return [trace, size](const vk::UniqueCommandBuffer& cmd, uint32_t, glm::uvec2 origin, glm::uvec2 extent)
+    {
+        vk::PipelineStageFlags stage = trace.ray_query ? vk::PipelineStageFlagBits::eComputeShader :
+            vk::PipelineStageFlagBits::eRayTracingShaderKHR;
+        vk::ImageMemoryBarrier barrier;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = trace.tile_image;
+        barrier.subresourceRange = vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+
+        // The tile image is shared, the copy of the previous tile may still be reading it
+        barrier.srcAccessMask = vk::AccessFlagBits::eTransferRead;
+        barrier.dstAccessMask = vk::AccessFlagBits::eShaderWrite;
+        barrier.oldLayout = vk::ImageLayout::eUndefined;
+        barrier.newLayout = vk::ImageLayout::eGeneral;
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, stage, {}, nullptr, nullptr, barrier);
+
+        trace_push_t push{ glm::ivec2(origin), glm::ivec2(size) };
+        if (trace.ray_query)
+        {
+            cmd->bindPipeline(vk::PipelineBindPoint::eCompute, trace.pipeline);
+            cmd->bindDescriptorSets(vk::PipelineBindPoint::eCompute, trace.layout, 0, trace.descriptor_set, trace.dynamic_offsets);
+            cmd->pushConstants<trace_query_push_t>(trace.layout, vk::ShaderStageFlagBits::eCompute, 0,
+                trace_query_push_t{ push, extent });
+            cmd->dispatch((extent.x + 7) / 8, (extent.y + 7) / 8, 1);
+        }
+        else
+        {
+            cmd->bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, trace.pipeline);
+            cmd->bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, trace.layout, 0, trace.descriptor_set, trace.dynamic_offsets);
+            cmd->pushConstants<trace_push_t>(trace.layout, vk::ShaderStageFlagBits::eRaygenKHR, 0, push);
+            cmd->traceRaysKHR(trace.sbt[0], trace.sbt[1], trace.sbt[2], trace.sbt[3], extent.x, extent.y, 1);
+        }
+
+        barrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+        barrier.dstAccessMask = vk::AccessFlagBits::eTransferRead;
+        barrier.oldLayout = vk::ImageLayout::eGeneral;
+        barrier.newLayout = vk::ImageLayout::eTransferSrcOptimal;
+        cmd->pipelineBarrier(stage, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, barrier);
+    };
+}
+
+tiled_render_stats_t render_tiled(memory_allocator_t& allocator, vk::Queue queue, uint32_t family, vk::Image tile_image,
+    const tile_recorder_t& record, uint32_t in_flight, glm::uvec2 size, uint32_t tile, const std::string& path,
+    float timestamp_period)
+{
+    const vk::UniqueDevice& device = allocator.device();
+    tiled_render_stats_t stats;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw std::runtime_error("cannot open the output image " + path);
+    out << fmt::format("P6\n{} {}\n255\n", size.x, size.y);
+
+    glm::uvec2 grid = (size + tile - 1u) / tile;
+    stats.tiles = grid.x * grid.y;
+
+    // The CPU drains one readback buffer while the GPU fills the others
+    struct slot_t
+    {
+        vk::UniqueCommandBuffer cmd;
+        vk::UniqueFence fence;
+        buffer_t readback;
+        glm::uvec2 origin{ 0 };
+        glm::uvec2 extent{ 0 };
+        bool pending = false;
+    };
+    vk::UniqueCommandPool cmdpool = device->createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eResetCommandBuffer, family });
+    vk::UniqueQueryPool timestamp_pool;
+    if (timestamp_period > 0.f)
+        timestamp_pool = device->createQueryPoolUnique({ {}, vk::QueryType::eTimestamp, 2 * in_flight });
+    std::vector<slot_t> slots(in_flight);
+    for (uint32_t i = 0; i < slots.size(); i++)
+    {
+        slot_t& s = slots[i];
+        s.cmd = std::move(device->allocateCommandBuffersUnique({ *cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+        debug_name(s.cmd, fmt::format("Tile Command#{}", i));
+        s.fence = device->createFenceUnique({});
+        s.readback = create_buffer(allocator, fmt::format("Tile Readback#{}", i), (vk::DeviceSize)tile * tile * 4,
+            vk::BufferUsageFlagBits::eTransferDst, memory_usage_t::readback);
+        stats.device_bytes += s.readback.mem.size;
+    }
+    stats.device_bytes += (vk::DeviceSize)tile * tile * 4;
+
+    // One row of tiles, RGB
+    std::vector<uint8_t> band((size_t)size.x * tile * 3);
+    auto drain = [&](uint32_t slot_index)
+    {
+        slot_t& s = slots[slot_index];
+        device->waitForFences(*s.fence, true, UINT64_MAX);
+        s.pending = false;
+        if (timestamp_pool)
+        {
+            std::array<uint64_t, 2> timestamps{};
+            if (device->getQueryPoolResults(*timestamp_pool, slot_index * 2, 2, sizeof(timestamps), timestamps.data(),
+                sizeof(uint64_t), vk::QueryResultFlagBits::e64) == vk::Result::eSuccess)
+                stats.tile_gpu_ms_max = std::max(stats.tile_gpu_ms_max, (timestamps[1] - timestamps[0]) * timestamp_period / 1e6);
+        }
+        const uint8_t* src = s.readback.mem.mapped;
+        for (uint32_t y = 0; y < s.extent.y; y++)
+        {
+            uint8_t* dst = band.data() + ((size_t)y * size.x + s.origin.x) * 3;
+            for (uint32_t x = 0; x < s.extent.x; x++, src += 4)
+            {
+                dst[x * 3 + 0] = src[0];
+                dst[x * 3 + 1] = src[1];
+                dst[x * 3 + 2] = src[2];
+            }
+        }
+        // The last tile of a row completes the band
+        if (s.origin.x + s.extent.x == size.x)
+            out.write(reinterpret_cast<const char*>(band.data()), (std::streamsize)size.x * s.extent.y * 3);
+    };
+
+    for (uint32_t tile_index = 0; tile_index < stats.tiles; tile_index++)
+    {
+        uint32_t slot_index = tile_index % slots.size();
+        slot_t& s = slots[slot_index];
+        if (s.pending)
+            drain(slot_index);
+
+        s.origin = glm::uvec2(tile_index % grid.x, tile_index / grid.x) * tile;
+        s.extent = glm::min(glm::uvec2(tile), size - s.origin);
+
+        const vk::UniqueCommandBuffer& cmd = s.cmd;
+        cmd->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+        if (timestamp_pool)
+        {
+            cmd->resetQueryPool(*timestamp_pool, slot_index * 2, 2);
+            cmd->writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *timestamp_pool, slot_index * 2);
+        }
+        debug_mark_begin(cmd, fmt::format("Tile#{} ({},{})", tile_index, s.origin.x, s.origin.y));
+
+        record(cmd, slot_index, s.origin, s.extent);
+
+        // Tightly packed rows of the tile width
+        vk::BufferImageCopy region;
+        region.bufferOffset = 0;
+        region.bufferRowLength = s.extent.x;
+        region.bufferImageHeight = s.extent.y;
+        region.imageSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+        region.imageExtent = vk::Extent3D(s.extent.x, s.extent.y, 1);
+        cmd->copyImageToBuffer(tile_image, vk::ImageLayout::eTransferSrcOptimal, *s.readback.buffer, region);
+
+        vk::BufferMemoryBarrier host_barrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead,
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, *s.readback.buffer, 0, VK_WHOLE_SIZE);
+        cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost,
+            {}, nullptr, host_barrier, nullptr);
+        debug_mark_end(cmd);
+        if (timestamp_pool)
+            cmd->writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *timestamp_pool, slot_index * 2 + 1);
+        cmd->end();
+
+        device->resetFences(*s.fence);
+        vk::SubmitInfo submit_info;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &cmd.get();
+        queue.submit(submit_info, *s.fence);
+        s.pending = true;
+    }
+    // Drain in submission order so the rows are written top to bottom
+    for (uint32_t i = 0; i < slots.size(); i++)
+    {
+        uint32_t slot_index = (stats.tiles + i) % slots.size();
+        if (slots[slot_index].pending)
+            drain(slot_index);
+    }
+
+    out.close();
+    if (!out)
+        throw std::runtime_error("cannot write the output image " + path);
+    stats.cpu_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    return stats;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <array>
+#include <functional>
+#include <string>
+#include "memory.h"
+
+// Push constants of trace.rgen: the traced rectangle and the size of the whole image
+struct trace_push_t
+{
+    glm::ivec2 offset;
+    glm::ivec2 size;
+};
+
+// Push constants of trace.comp, the dispatch is rounded up to the workgroup size
+struct trace_query_push_t
+{
+    trace_push_t trace;
+    glm::uvec2 extent;      // traced rectangle
+};
+
+// Ray tracing state shared with the interactive path, the descriptor set must bind tile_image
+struct tiled_trace_t
+{
+    vk::Pipeline pipeline;                          // trace.comp with ray_query, otherwise the RT pipeline
+    vk::PipelineLayout layout;
+    vk::DescriptorSet descriptor_set;
+    std::array<uint32_t, 3> dynamic_offsets{};    // camera, light, ray counter
+    std::array<vk::StridedBufferRegionKHR, 4> sbt;  // raygen, miss, hit, callable
+    vk::Image tile_image;                           // RGBA8, tile x tile
+    bool ray_query = false;
+};
+
+// Records the tile at origin of the image into the top-left extent of the tile image and leaves
+// it in eTransferSrcOptimal, visible to the transfer stage. slot is the submission the tile goes
+// to, the previous tile of the same slot has completed.
+using tile_recorder_t = std::function<void(const vk::UniqueCommandBuffer& cmd, uint32_t slot, glm::uvec2 origin,
+    glm::uvec2 extent)>;
+
+// The tile recorder of the traced backends, the RT pipeline or trace.comp
+tile_recorder_t trace_tile_recorder(const tiled_trace_t& trace, glm::uvec2 size);
+
+struct tiled_render_stats_t
+{
+    uint32_t tiles = 0;
+    double cpu_ms = 0.0;
+    double tile_gpu_ms_max = 0.0;
+    vk::DeviceSize device_bytes = 0;    // tile image and readback buffers
+};
+
+// Offline render of an image of any size: every tile is rendered in its own submission so no
+// dispatch runs long enough to hit the driver timeout, then copied into a readback buffer while
+// the next tile is rendered, in_flight tiles are submitted at once. A row of tiles is assembled on the
+// CPU and appended to a binary PPM, so neither the device nor the host ever hold the whole image.
+tiled_render_stats_t render_tiled(memory_allocator_t& allocator, vk::Queue queue, uint32_t family, vk::Image tile_image,
+    const tile_recorder_t& record, uint32_t in_flight, glm::uvec2 size, uint32_t tile, const std::string& path,
+    float timestamp_period);
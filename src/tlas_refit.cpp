@@ -0,0 +1,98 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "tlas_refit.h"
+
+tlas_refit_t::tlas_refit_t(memory_allocator_t& allocator, vk::AccelerationStructureKHR tlas, 
+    vk::BuildAccelerationStructureFlagsKHR flags, uint32_t capacity, uint32_t slots, float rebuild_threshold)
+    : tlas(tlas), flags(flags), capacity(capacity), count(capacity), threshold(rebuild_threshold)
+{
+    const vk::UniqueDevice& device = allocator.device();
+    instances = create_buffer(allocator, "Dynamic Instance Buffer", 
+        (vk::DeviceSize)capacity * slots * sizeof(vk::AccelerationStructureInstanceKHR),
+        vk::BufferUsageFlagBits::eRayTracingKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress, memory_usage_t::upload);
+
+    // A rebuild can happen at any frame, so the scratch must fit both
+    vk::DeviceSize build_size = device->getAccelerationStructureMemoryRequirementsKHR({
+        vk::AccelerationStructureMemoryRequirementsTypeKHR::eBuildScratch,
+        vk::AccelerationStructureBuildTypeKHR::eDevice, tlas }).memoryRequirements.size;
+    vk::DeviceSize update_size = device->getAccelerationStructureMemoryRequirementsKHR({
+        vk::AccelerationStructureMemoryRequirementsTypeKHR::eUpdateScratch,
+        vk::AccelerationStructureBuildTypeKHR::eDevice, tlas }).memoryRequirements.size;
+    scratch = create_buffer(allocator, "TLAS Refit Scratch Buffer", std::max(build_size, update_size),
+        vk::BufferUsageFlagBits::eRayTracingKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress, memory_usage_t::device_address);
+}
+
+void tlas_refit_t::write(uint32_t slot, std::span<const vk::AccelerationStructureInstanceKHR> frame_instances,
+    std::span<const aabb_t> world_bounds)
+{
+    if (frame_instances.size() > capacity)
+        throw std::runtime_error(fmt::format("TLAS refit: {} instances exceed the capacity of {}", frame_instances.size(), capacity));
+    std::copy(frame_instances.begin(), frame_instances.end(), 
+        reinterpret_cast<vk::AccelerationStructureInstanceKHR*>(instances.mem.mapped) + (size_t)slot * capacity);
+
+    rebuild = frame_instances.size() != count || build_bounds.size() != world_bounds.size();
+    count = (uint32_t)frame_instances.size();
+    if (!rebuild && build_area > 0.f)
+    {
+        float area = 0.f;
+        for (size_t i = 0; i < world_bounds.size(); i++)
+        {
+            aabb_t b = build_bounds[i];
+            b.grow(world_bounds[i]);
+            area += b.area();
+        }
+        stats.degradation = area / build_area;
+        rebuild = stats.degradation > threshold;
+    }
+    if (rebuild || build_bounds.empty())
+    {
+        build_bounds.assign(world_bounds.begin(), world_bounds.end());
+        build_area = 0.f;
+        for (const auto& b : build_bounds)
+            build_area += b.area();
+        stats.degradation = 1.f;
+    }
+}
+
+void tlas_refit_t::record(const vk::UniqueCommandBuffer& cmd, uint32_t slot)
+{
+    // The previous frame may still be tracing against the TLAS or using the scratch, from the RT
+    // pipeline or from trace.comp ray queries
+    vk::PipelineStageFlags trace_stages = vk::PipelineStageFlagBits::eRayTracingShaderKHR | vk::PipelineStageFlagBits::eComputeShader;
+    vk::MemoryBarrier barrier;
+    barrier.srcAccessMask = vk::AccessFlagBits::eAccelerationStructureReadKHR | vk::AccessFlagBits::eAccelerationStructureWriteKHR;
+    barrier.dstAccessMask = vk::AccessFlagBits::eAccelerationStructureReadKHR | vk::AccessFlagBits::eAccelerationStructureWriteKHR;
+    cmd->pipelineBarrier(trace_stages | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, barrier, nullptr, nullptr);
+
+    vk::AccelerationStructureGeometryKHR geo;
+    geo.geometryType = vk::GeometryTypeKHR::eInstances;
+    geo.geometry.instances.arrayOfPointers = false;
+    geo.geometry.instances.data = instances.address + (vk::DeviceSize)slot * capacity * sizeof(vk::AccelerationStructureInstanceKHR);
+    const vk::AccelerationStructureGeometryKHR* pGeometry = &geo;
+
+    vk::AccelerationStructureBuildGeometryInfoKHR build_info;
+    build_info.type = vk::AccelerationStructureTypeKHR::eTopLevel;
+    build_info.flags = flags;
+    build_info.update = !rebuild;
+    build_info.srcAccelerationStructure = rebuild ? nullptr : tlas;
+    build_info.dstAccelerationStructure = tlas;
+    build_info.geometryArrayOfPointers = false;
+    build_info.geometryCount = 1;
+    build_info.ppGeometries = &pGeometry;
+    build_info.scratchData = scratch.address;
+
+    vk::AccelerationStructureBuildOffsetInfoKHR offset;
+    offset.primitiveCount = count;
+    const vk::AccelerationStructureBuildOffsetInfoKHR* pOffset = &offset;
+    debug_mark_begin(cmd, rebuild ? "Rebuild TLAS" : "Refit TLAS");
+    cmd->buildAccelerationStructureKHR(build_info, pOffset);
+    debug_mark_end(cmd);
+    (rebuild ? stats.rebuilds : stats.updates)++;
+    rebuild = false;
+
+    barrier.srcAccessMask = vk::AccessFlagBits::eAccelerationStructureWriteKHR;
+    barrier.dstAccessMask = vk::AccessFlagBits::eAccelerationStructureReadKHR;
+    cmd->pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+        trace_stages, {}, barrier, nullptr, nullptr);
+}
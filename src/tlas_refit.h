@@ -0,0 +1,42 @@
+#pragma once
+#include <span>
+#include <vector>
+#include "memory.h"
+#include "scene.h"
+
+struct tlas_refit_stats_t
+{
+    uint32_t updates = 0;
+    uint32_t rebuilds = 0;
+    float degradation = 1.f;    // last measured, see tlas_refit_t::write
+};
+
+// Keeps a TLAS in sync with instances that move every frame. Each frame in flight has its own
+// slice of a persistently mapped instance buffer, the TLAS is refit in place from it and
+// rebuilt from scratch only when the instance count changes or when the refit has degraded
+// the tree too much. The TLAS must be created with eAllowUpdate.
+class tlas_refit_t
+{
+    vk::AccelerationStructureKHR tlas;
+    vk::BuildAccelerationStructureFlagsKHR flags;
+    uint32_t capacity = 0;
+    uint32_t count = 0;
+    float threshold = 0.f;
+    buffer_t instances;
+    buffer_t scratch;
+    std::vector<aabb_t> build_bounds;   // instance bounds at the last full build
+    float build_area = 0.f;
+    bool rebuild = false;
+    tlas_refit_stats_t stats;
+public:
+    tlas_refit_t(memory_allocator_t& allocator, vk::AccelerationStructureKHR tlas, vk::BuildAccelerationStructureFlagsKHR flags,
+        uint32_t capacity, uint32_t slots, float rebuild_threshold);
+    // Copy the instances of the frame into the slot and choose between refit and rebuild.
+    // The degradation is estimated as the area of the union of the instance bounds at the last
+    // build and now over the area at the last build, a refit tree grows its nodes the same way.
+    void write(uint32_t slot, std::span<const vk::AccelerationStructureInstanceKHR> frame_instances,
+        std::span<const aabb_t> world_bounds);
+    // Record the refit (or rebuild) with the barriers against the previous frame and the trace
+    void record(const vk::UniqueCommandBuffer& cmd, uint32_t slot);
+    const tlas_refit_stats_t& get_stats() const { return stats; }
+};
@@ -0,0 +1,164 @@
+#include "pch.h"
+#include "debug_message.h"
+#include "uploader.h"
+
+uploader_t::uploader_t(memory_allocator_t& allocator, vk::Queue queue, uint32_t queue_family, vk::DeviceSize ring_size,
+    uint32_t segment_count) : device(allocator.device()), queue(queue), family(queue_family)
+{
+    segment_size = ring_size / segment_count & ~vk::DeviceSize(255);
+    ring = create_buffer(allocator, "Staging Ring", segment_size * segment_count,
+        vk::BufferUsageFlagBits::eTransferSrc, memory_usage_t::upload);
+    cmdpool = device->createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eResetCommandBuffer, queue_family });
+    segments.resize(segment_count);
+    for (uint32_t i = 0; i < segment_count; i++)
+    {
+        segments[i].cmd = std::move(device->allocateCommandBuffersUnique({ *cmdpool, vk::CommandBufferLevel::ePrimary, 1 })[0]);
+        debug_name(segments[i].cmd, fmt::format("Upload Command#{}", i));
+        segments[i].fence = device->createFenceUnique({});
+        debug_name(segments[i].fence, fmt::format("Upload Fence#{}", i));
+    }
+}
+
+uploader_t::~uploader_t()
+{
+    for (auto& seg : segments)
+        if (seg.pending)
+            device->waitForFences(*seg.fence, true, UINT64_MAX);
+}
+
+void uploader_t::submit(segment_t& seg, const std::vector<vk::BufferMemoryBarrier>& release, vk::Semaphore signal)
+{
+    if (seg.copies.empty() && release.empty() && !signal)
+        return;
+    seg.cmd->begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+    debug_mark_begin(seg.cmd, "Upload");
+    for (const auto& [dst, regions] : seg.copies)
+    {
+        seg.cmd->copyBuffer(*ring.buffer, dst, regions);
+        stats.regions += (uint32_t)regions.size();
+    }
+    // Covers the copies of the earlier segments too, they were submitted before on the same queue
+    if (!release.empty())
+        seg.cmd->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe,
+            {}, nullptr, release, nullptr);
+    debug_mark_end(seg.cmd);
+    seg.cmd->end();
+
+    vk::SubmitInfo submit_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &seg.cmd.get();
+    if (signal)
+    {
+        submit_info.signalSemaphoreCount = 1;
+        submit_info.pSignalSemaphores = &signal;
+    }
+    queue.submit(submit_info, *seg.fence);
+    seg.copies.clear();
+    seg.pending = true;
+    stats.submits++;
+}
+
+void uploader_t::upload(vk::Buffer dst, vk::DeviceSize dst_offset, const void* data, vk::DeviceSize size)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    auto* src = reinterpret_cast<const uint8_t*>(data);
+    while (size > 0)
+    {
+        segment_t& seg = segments[current];
+        if (seg.head == segment_size)
+        {
+            // Segment full, hand it to the GPU and move to the next one
+            submit(seg);
+            next_segment();
+            continue;
+        }
+
+        vk::DeviceSize chunk = std::min(size, segment_size - seg.head);
+        vk::DeviceSize ring_offset = current * segment_size + seg.head;
+        memcpy(ring.mem.mapped + ring_offset, src, chunk);
+        if (seg.copies.empty() || seg.copies.back().first != dst)
+            seg.copies.emplace_back(dst, std::vector<vk::BufferCopy>());
+        if (std::find(written.begin(), written.end(), dst) == written.end())
+            written.push_back(dst);
+        seg.copies.back().second.emplace_back(ring_offset, dst_offset, chunk);
+
+        // Keep the next copy source aligned
+        seg.head = std::min(segment_size, (seg.head + chunk + 15) & ~vk::DeviceSize(15));
+        src += chunk;
+        dst_offset += chunk;
+        size -= chunk;
+        stats.bytes += chunk;
+    }
+    stats.cpu_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void uploader_t::next_segment()
+{
+    current = (current + 1) % segments.size();
+    segment_t& next = segments[current];
+    if (next.pending)
+    {
+        device->waitForFences(*next.fence, true, UINT64_MAX);
+        device->resetFences(*next.fence);
+        next.cmd->reset({});
+        next.pending = false;
+    }
+    next.head = 0;
+    next.copies.clear();
+}
+
+void uploader_t::flush()
+{
+    segment_t& seg = segments[current];
+    if (seg.copies.empty())
+        return;
+    submit(seg);
+    // The segment is in flight, mark it as full so that the next upload moves on
+    seg.head = segment_size;
+}
+
+upload_stats_t uploader_t::finish()
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    flush();
+    for (auto& seg : segments)
+    {
+        if (seg.pending)
+        {
+            device->waitForFences(*seg.fence, true, UINT64_MAX);
+            device->resetFences(*seg.fence);
+            seg.cmd->reset({});
+            seg.pending = false;
+        }
+        seg.head = 0;
+        seg.copies.clear();
+    }
+    current = 0;
+    written.clear();
+    stats.cpu_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    return std::exchange(stats, {});
+}
+
+upload_stats_t uploader_t::finish(uint32_t dst_family, vk::AccessFlags dst_access, vk::Semaphore signal,
+    std::vector<vk::BufferMemoryBarrier>& acquire)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<vk::BufferMemoryBarrier> release;
+    acquire.clear();
+    if (dst_family != family)
+    {
+        for (vk::Buffer buffer : written)
+        {
+            release.emplace_back(vk::AccessFlagBits::eTransferWrite, vk::AccessFlags(), family, dst_family, buffer, 0, VK_WHOLE_SIZE);
+            acquire.emplace_back(vk::AccessFlags(), dst_access, family, dst_family, buffer, 0, VK_WHOLE_SIZE);
+        }
+    }
+    // The current segment may already be in flight after a flush
+    if (segments[current].pending)
+        next_segment();
+    submit(segments[current], release, signal);
+    segments[current].head = segment_size;
+    written.clear();
+    stats.cpu_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    return std::exchange(stats, {});
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <vector>
+#include "memory.h"
+
+struct upload_stats_t
+{
+    vk::DeviceSize bytes = 0;
+    uint32_t submits = 0;
+    uint32_t regions = 0;
+    double cpu_ms = 0.0;
+};
+
+// Streams data into device-local buffers through a persistently mapped staging ring.
+// The ring is split in segments, each one recorded in its own command buffer: while a segment
+// is being copied by the GPU the next one is filled by the CPU. Copies to the same buffer
+// within a segment are batched in a single vkCmdCopyBuffer, uploads larger than a segment
+// are streamed in chunks.
+class uploader_t
+{
+    struct segment_t
+    {
+        vk::UniqueCommandBuffer cmd;
+        vk::UniqueFence fence;
+        vk::DeviceSize head = 0;
+        std::vector<std::pair<vk::Buffer, std::vector<vk::BufferCopy>>> copies;
+        bool pending = false;
+    };
+    const vk::UniqueDevice& device;
+    vk::Queue queue;
+    uint32_t family = 0;
+    vk::UniqueCommandPool cmdpool;
+    buffer_t ring;
+    vk::DeviceSize segment_size = 0;
+    std::vector<segment_t> segments;
+    uint32_t current = 0;
+    upload_stats_t stats;
+    std::vector<vk::Buffer> written;        // destinations since the last finish, for the ownership transfer
+
+    void submit(segment_t& seg, const std::vector<vk::BufferMemoryBarrier>& release = {}, vk::Semaphore signal = nullptr);
+    void next_segment();
+public:
+    // The queue can be a dedicated transfer queue, the destination buffers must then be
+    // shared with the queue families that consume them
+    uploader_t(memory_allocator_t& allocator, vk::Queue queue, uint32_t queue_family, vk::DeviceSize ring_size,
+        uint32_t segment_count = 4);
+    uploader_t(const uploader_t&) = delete;
+    ~uploader_t();
+    void upload(vk::Buffer dst, vk::DeviceSize dst_offset, const void* data, vk::DeviceSize size);
+    // Submit the pending copies without waiting
+    void flush();
+    // Submit and wait for all the copies, returns the stats accumulated since the last finish
+    upload_stats_t finish();
+    // Submit without waiting, the copies are followed by the release of the written buffers to
+    // dst_family and by the signal of the semaphore. The consumer waits on the semaphore and
+    // records the returned acquire barriers before using the buffers. With the same family
+    // there is no ownership to transfer and no barrier is returned.
+    upload_stats_t finish(uint32_t dst_family, vk::AccessFlags dst_access, vk::Semaphore signal,
+        std::vector<vk::BufferMemoryBarrier>& acquire);
+};